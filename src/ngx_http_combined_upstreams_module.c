@@ -24,6 +24,12 @@ typedef struct {
 } ngx_http_combined_upstreams_srv_conf_t;
 
 
+typedef struct {
+    ngx_str_node_t             sn;
+    ngx_uint_t                 index;
+} ngx_http_combined_upstreams_index_node_t;
+
+
 static void *ngx_http_combined_upstreams_create_main_conf(ngx_conf_t *cf);
 static void *ngx_http_combined_upstreams_create_srv_conf(ngx_conf_t *cf);
 static void *ngx_http_combined_upstreams_create_loc_conf(ngx_conf_t *cf);
@@ -56,7 +62,7 @@ static ngx_command_t  ngx_http_combined_upstreams_commands[] = {
       0,
       NULL },
     { ngx_string("upstrand"),
-      NGX_HTTP_MAIN_CONF|NGX_CONF_BLOCK|NGX_CONF_TAKE1,
+      NGX_HTTP_MAIN_CONF|NGX_CONF_BLOCK|NGX_CONF_TAKE12,
       ngx_http_upstrand_block,
       NGX_HTTP_MAIN_CONF_OFFSET,
       0,
@@ -67,6 +73,30 @@ static ngx_command_t  ngx_http_combined_upstreams_commands[] = {
       NGX_HTTP_LOC_CONF_OFFSET,
       0,
       NULL },
+    { ngx_string("upstrand_pass"),
+      NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE1,
+      ngx_http_upstrand_pass,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+    { ngx_string("upstrand_status"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+      ngx_http_upstrand_status,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+    { ngx_string("upstrand_api"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_upstrand_api,
+      0,
+      0,
+      NULL },
+    { ngx_string("upstrand_request_body_replay"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_upstrand_request_body_replay,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
     { ngx_string("extend_single_peers"),
       NGX_HTTP_UPS_CONF|NGX_CONF_NOARGS,
       ngx_http_extend_single_peers,
@@ -104,6 +134,9 @@ static ngx_http_variable_t  ngx_http_combined_upstreams_vars[] =
     { ngx_string("upstrand_status"), NULL,
       ngx_http_get_upstrand_status_var_value, (uintptr_t) 6,
       NGX_HTTP_VAR_NOCACHEABLE, 0 },
+    { ngx_string("upstrand_trace_json"), NULL,
+      ngx_http_get_upstrand_trace_json_var_value, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
     { ngx_null_string, NULL, NULL, 0, 0, 0 }
 };
@@ -135,7 +168,7 @@ ngx_module_t  ngx_http_combined_upstreams_module = {
     NGX_HTTP_MODULE,                         /* module type */
     NULL,                                    /* init master */
     NULL,                                    /* init module */
-    NULL,                                    /* init process */
+    ngx_http_upstrand_init_process,          /* init process */
     NULL,                                    /* init thread */
     NULL,                                    /* exit thread */
     NULL,                                    /* exit process */
@@ -156,11 +189,14 @@ ngx_http_combined_upstreams_create_main_conf(ngx_conf_t *cf)
     }
 
     if (ngx_array_init(&mcf->upstrands, cf->pool, 1,
-                       sizeof(ngx_http_upstrand_conf_t)) != NGX_OK)
+                       sizeof(ngx_http_upstrand_conf_t *)) != NGX_OK)
     {
         return NULL;
     }
 
+    ngx_rbtree_init(&mcf->upstreams_index, &mcf->upstreams_index_sentinel,
+                    ngx_str_rbtree_insert_value);
+
     return mcf;
 }
 
@@ -193,6 +229,8 @@ ngx_http_combined_upstreams_create_loc_conf(ngx_conf_t *cf)
         return NULL;
     }
 
+    lcf->upstrand_request_body_replay = NGX_CONF_UNSET_SIZE;
+
     return lcf;
 }
 
@@ -204,20 +242,13 @@ ngx_http_combined_upstreams_merge_loc_conf(ngx_conf_t *cf, void *parent,
     ngx_http_combined_upstreams_loc_conf_t  *prev = parent;
     ngx_http_combined_upstreams_loc_conf_t  *conf = child;
 
-    ngx_uint_t                               i;
-
-    for (i = 0; i < prev->dyn_upstrands.nelts; i++) {
-        ngx_http_upstrand_var_list_elem_t  *elem;
-
-        elem = ngx_array_push(&conf->dyn_upstrands);
-        if (elem == NULL) {
-            return NGX_CONF_ERROR;
-        }
-
-        *elem = ((ngx_http_upstrand_var_list_elem_t *)
-                                                prev->dyn_upstrands.elts)[i];
+    if (ngx_http_dynamic_upstrand_merge(cf, prev, conf) != NGX_OK) {
+        return NGX_CONF_ERROR;
     }
 
+    ngx_conf_merge_size_value(conf->upstrand_request_body_replay,
+                              prev->upstrand_request_body_replay, 0);
+
     return NGX_CONF_OK;
 }
 
@@ -252,8 +283,9 @@ static char *
 ngx_http_add_upstream(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_uint_t                      i, j;
+    ngx_int_t                       found;
     ngx_http_upstream_main_conf_t  *umcf;
-    ngx_http_upstream_srv_conf_t   *uscf, **uscfp;
+    ngx_http_upstream_srv_conf_t   *uscf, *src, **uscfp;
     ngx_http_upstream_server_t     *us;
     ngx_str_t                      *value;
     ngx_uint_t                      backup = 0;
@@ -298,42 +330,113 @@ ngx_http_add_upstream(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         }
     }
 
-    for (i = 0; i < umcf->upstreams.nelts; i++) {
-        if (uscfp[i]->host.len == value[1].len &&
-            ngx_strncasecmp(uscfp[i]->host.data,
-                            value[1].data, value[1].len) == 0) {
-            if (uscf->servers == NULL) {
-                uscf->servers = ngx_array_create(cf->pool, 4,
-                                            sizeof(ngx_http_upstream_server_t));
-                if (uscf->servers == NULL)
-                    return NGX_CONF_ERROR;
-            }
+    found = ngx_http_combined_upstreams_find_upstream(cf, &value[1]);
 
-            us = ngx_array_push_n(uscf->servers, uscfp[i]->servers->nelts);
-            if (us == NULL)
-                return NGX_CONF_ERROR;
+    if (found == NGX_ERROR) {
+        return NGX_CONF_ERROR;
+    }
 
-            ngx_memcpy(us, uscfp[i]->servers->elts,
-                sizeof(ngx_http_upstream_server_t) * uscfp[i]->servers->nelts);
+    if (found == NGX_DECLINED) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "upstream \"%V\" not found",
+                           &value[1]);
+        return NGX_CONF_ERROR;
+    }
 
-            if (backup) {
-                for (j = 0; j < uscfp[i]->servers->nelts; j++) {
-                    us[j].backup = 1;
-                }
-            }
-            if (weight) {
-                for (j = 0; j < uscfp[i]->servers->nelts; j++) {
-                    us[j].weight *= weight;
-                }
-            }
+    src = uscfp[found];
 
-            return NGX_CONF_OK;
+    if (uscf->servers == NULL) {
+        uscf->servers = ngx_array_create(cf->pool, 4,
+                                         sizeof(ngx_http_upstream_server_t));
+        if (uscf->servers == NULL)
+            return NGX_CONF_ERROR;
+    }
+
+    us = ngx_array_push_n(uscf->servers, src->servers->nelts);
+    if (us == NULL)
+        return NGX_CONF_ERROR;
+
+    ngx_memcpy(us, src->servers->elts,
+               sizeof(ngx_http_upstream_server_t) * src->servers->nelts);
+
+    if (backup) {
+        for (j = 0; j < src->servers->nelts; j++) {
+            us[j].backup = 1;
+        }
+    }
+    if (weight) {
+        for (j = 0; j < src->servers->nelts; j++) {
+            us[j].weight *= weight;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+/* looks up an upstream by name in a case-insensitive index rather than
+ * scanning all upstreams which is slow with thousands of singlets; upstreams
+ * only get appended while reading the configuration, so the index catches up
+ * with new upstreams on every lookup, and it lives in the temporary pool */
+
+ngx_int_t
+ngx_http_combined_upstreams_find_upstream(ngx_conf_t *cf, ngx_str_t *name)
+{
+    ngx_uint_t                                 i, hash;
+    ngx_str_t                                  key, *host;
+    ngx_http_upstream_main_conf_t             *umcf;
+    ngx_http_upstream_srv_conf_t             **uscfp;
+    ngx_http_combined_upstreams_main_conf_t   *mcf;
+    ngx_http_combined_upstreams_index_node_t  *node;
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+    mcf = ngx_http_conf_get_module_main_conf(cf,
+                                        ngx_http_combined_upstreams_module);
+    uscfp = umcf->upstreams.elts;
+
+    for (i = mcf->upstreams_indexed; i < umcf->upstreams.nelts; i++) {
+        host = &uscfp[i]->host;
+
+        key.len = host->len;
+        key.data = ngx_pnalloc(cf->temp_pool, key.len);
+        if (key.data == NULL) {
+            return NGX_ERROR;
         }
+
+        hash = ngx_hash_strlow(key.data, host->data, key.len);
+
+        /* the first of upstreams with the same name wins as it did when the
+         * list was scanned */
+        if (ngx_str_rbtree_lookup(&mcf->upstreams_index, &key, hash) != NULL) {
+            continue;
+        }
+
+        node = ngx_palloc(cf->temp_pool,
+                          sizeof(ngx_http_combined_upstreams_index_node_t));
+        if (node == NULL) {
+            return NGX_ERROR;
+        }
+
+        node->sn.node.key = hash;
+        node->sn.str = key;
+        node->index = i;
+
+        ngx_rbtree_insert(&mcf->upstreams_index, &node->sn.node);
     }
 
-    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "upstream \"%V\" not found",
-                       &value[1]);
-    return NGX_CONF_ERROR;
+    mcf->upstreams_indexed = umcf->upstreams.nelts;
+
+    key.len = name->len;
+    key.data = ngx_pnalloc(cf->temp_pool, key.len);
+    if (key.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    hash = ngx_hash_strlow(key.data, name->data, key.len);
+
+    node = (ngx_http_combined_upstreams_index_node_t *)
+               ngx_str_rbtree_lookup(&mcf->upstreams_index, &key, hash);
+
+    return node == NULL ? NGX_DECLINED : (ngx_int_t) node->index;
 }
 
 
@@ -27,6 +27,14 @@
 
 typedef struct {
     ngx_array_t                 upstrands;
+    ngx_hash_t                  upstrands_hash;
+    size_t                      upstrand_name_max_len;
+    ngx_uint_t                  dyn_upstrand_slots;
+    ngx_int_t                  *upstream_var_index;
+    ngx_uint_t                  upstream_vars_captured;
+    ngx_rbtree_t                upstreams_index;
+    ngx_rbtree_node_t           upstreams_index_sentinel;
+    ngx_uint_t                  upstreams_indexed;
 #ifdef NGX_HTTP_COMBINED_UPSTREAMS_PERSISTENT_UPSTRAND_INTERCEPT_CTX
     ngx_http_easy_ctx_handle_t  upstrand_intercept_ctx;
 #endif
@@ -35,10 +43,17 @@ typedef struct {
 
 typedef struct {
     ngx_array_t                 dyn_upstrands;
+    ngx_array_t               **dyn_upstrand_slots;
+    size_t                      upstrand_request_body_replay;
     ngx_uint_t                  upstrand_gw_modules_checked;
+    ngx_uint_t                  upstrand_status_format;
 } ngx_http_combined_upstreams_loc_conf_t;
 
 
+ngx_int_t ngx_http_combined_upstreams_find_upstream(ngx_conf_t *cf,
+    ngx_str_t *name);
+
+
 extern ngx_module_t  ngx_http_combined_upstreams_module;
 
 #endif /* NGX_HTTP_COMBINED_UPSTREAMS_MODULE_H */
@@ -16,21 +16,149 @@
 
 #include "ngx_http_combined_upstreams_module.h"
 #include "ngx_http_combined_upstreams_upstrand.h"
+#include "ngx_http_combined_upstreams_upstrand_core.h"
+
+#define UPSTREAM_HEADER_TIME_VAR 3
+#define UPSTREAM_RESPONSE_TIME_VAR 5
+/* rendered upstrand variables are the status variables, upstrand_path and
+ * upstrand_trace_json */
+#define UPSTRAND_PATH_VAR UPSTREAM_VARS_SIZE
+#define UPSTRAND_TRACE_JSON_VAR (UPSTREAM_VARS_SIZE + 1)
+#define UPSTRAND_RENDERED_VARS (UPSTREAM_VARS_SIZE + 2)
+
+/* longer names of upstrands in dynamic_upstrand get lowercased in the request
+ * pool */
+#define UPSTRAND_NAME_BUF_SIZE 64
+
+/* header time averages are kept in microseconds */
+#define UPSTRAND_LEAST_TIME_PENALTY 1000000
+#define UPSTRAND_LEAST_TIME_MAX 60000000
+
+/* outcomes needed to judge an upstream */
+#define UPSTRAND_OUTLIER_MIN_SAMPLES 10
+/* error ratio (in permille) below which an upstream is never an outlier */
+#define UPSTRAND_OUTLIER_MIN_ERRORS 50
+/* max multiplier of the base ejection interval */
+#define UPSTRAND_OUTLIER_MAX_EJECTIONS 8
+
+#define UPSTRAND_API_MAX_WEIGHT 1000000
+
+/* ngx_random() returns 31 random bits */
+#define UPSTRAND_RANDOM_RANGE ((ngx_uint_t) 1 << 31)
+
+
+struct ngx_http_upstrand_counters_s {
+    ngx_atomic_t                             requests;
+    ngx_atomic_t                             hops;
+    ngx_atomic_t                             next_4xx;
+    ngx_atomic_t                             next_5xx;
+    ngx_atomic_t                             next_error;
+    ngx_atomic_t                             next_other;
+    ngx_atomic_t                             timeouts;
+    ngx_atomic_t                             intercepts;
+    ngx_atomic_t                             all_blacklisted;
+    ngx_atomic_t                             hist_reset;
+    ngx_http_upstrand_histogram_t            hops_hist;
+};
+
+
+/* workers that use a generation of the upstrand state, with their shares
+ * of the in-flight counters of the upstreams */
+typedef struct ngx_http_upstrand_shm_worker_s  ngx_http_upstrand_shm_worker_t;
+
+struct ngx_http_upstrand_shm_worker_s {
+    ngx_pid_t                                pid;
+    ngx_http_upstrand_shm_worker_t          *next;
+    ngx_atomic_t                             inflight[1];
+};
+
+
+struct ngx_http_upstrand_shm_s {
+    uint32_t                                 signature;
+    ngx_uint_t                               nelts;
+    ngx_http_upstrand_shm_t                 *prev;
+    ngx_http_upstrand_shm_worker_t          *workers;
+    ngx_uint_t                               used;
+    ngx_atomic_t                             cur;
+    ngx_atomic_t                             b_cur;
+    ngx_atomic_t                             outlier_check;
+    ngx_atomic_t                             hc_leader;
+    ngx_atomic_t                             hc_lease;
+    ngx_atomic_t                             weights_gen;
+    ngx_http_upstrand_counters_t             counters;
+    ngx_http_upstrand_upstream_state_t       state[1];
+};
+
+
+/* alias table for sampling the starting upstream by weight in O(1) (Vose's
+ * alias method), the probabilities are scaled by the total weight */
+struct ngx_http_upstrand_alias_s {
+    ngx_uint_t                               total;
+    ngx_uint_t                               prob;
+    ngx_uint_t                               alias;
+};
+
+
+struct ngx_http_upstrand_hash_ring_s {
+    ngx_http_upstrand_hash_point_t          *points;
+    ngx_uint_t                               npoints;
+};
+
+
+/* number of points per upstream on the consistent hash ring */
+#define UPSTRAND_HASH_POINTS 160
 
-#define UPSTREAM_VARS_SIZE (sizeof(upstream_vars) / sizeof(upstream_vars[0]))
+
+typedef struct {
+    ngx_str_t                                name;
+    size_t                                   offset;
+} ngx_http_upstrand_metric_t;
+
+
+#define UPSTRAND_STATUS_JSON 1
+#define UPSTRAND_STATUS_PROMETHEUS 2
+
+/* max length of a line of the status output besides the names */
+#define UPSTRAND_STATUS_LINE_SIZE (128 + NGX_ATOMIC_T_LEN)
+
+
+/* enough to read the status line of a health check response */
+#define UPSTRAND_HC_BUF_SIZE 16
 
 
 typedef struct {
-    time_t                                   blacklist_interval;
-    time_t                                   blacklist_last_occurrence;
-    ngx_uint_t                               index;
-} ngx_http_upstrand_upstream_conf_t;
+    ngx_http_upstrand_health_check_t        *hc;
+    ngx_http_upstrand_upstream_conf_t       *upstream;
+    ngx_http_upstream_srv_conf_t            *uscf;
+    ngx_peer_connection_t                    pc;
+    ngx_str_t                                request;
+    size_t                                   sent;
+    size_t                                   received;
+    ngx_uint_t                               next_server;
+    u_char                                   response[UPSTRAND_HC_BUF_SIZE];
+    ngx_uint_t                               busy:1;
+} ngx_http_upstrand_hc_probe_t;
+
+
+struct ngx_http_upstrand_health_check_s {
+    ngx_http_upstrand_conf_t                *upstrand;
+    ngx_str_t                                uri;
+    ngx_msec_t                               interval;
+    ngx_uint_t                               fails;
+    ngx_uint_t                               passes;
+    ngx_event_t                              event;
+    ngx_http_upstrand_hc_probe_t            *probes;
+    ngx_uint_t                               nprobes;
+};
 
 
 typedef struct {
     ngx_http_upstrand_conf_t                *upstrand;
     ngx_conf_t                              *cf;
+    uintptr_t                               *members;
+    uintptr_t                               *b_members;
     ngx_uint_t                               order_done:1;
+    ngx_uint_t                               broadcast_policy_done:1;
 } ngx_http_upstrand_conf_ctx_t;
 
 
@@ -40,36 +168,74 @@ typedef void (*upstream_finalize_request_pt)(ngx_http_request_t *, ngx_int_t);
 
 typedef struct {
     upstream_finalize_request_pt             upstream_finalize_request;
+    ngx_http_upstrand_upstream_conf_t       *upstream;
+    ngx_str_t                                upstream_name;
+    ngx_uint_t                               status_data;
+    ngx_chain_t                             *body;
+    ngx_chain_t                            **body_last;
+    ngx_uint_t                               status_data_set:1;
     ngx_uint_t                               last:1;
     ngx_uint_t                               intercepted:1;
+    ngx_uint_t                               header_only:1;
+    ngx_uint_t                               header_only_saved:1;
+    ngx_uint_t                               failed:1;
+    ngx_uint_t                               inflight:1;
+    ngx_uint_t                               body_done:1;
 } ngx_http_upstrand_request_common_ctx_t;
 
 
+/* a rendered variable is valid while the generation of the status data has
+ * not changed */
 typedef struct {
+    ngx_str_t                                value;
+    ngx_uint_t                               gen;
+} ngx_http_upstrand_rendered_var_t;
+
+
+typedef struct ngx_http_upstrand_request_ctx_s
+    ngx_http_upstrand_request_ctx_t;
+
+struct ngx_http_upstrand_request_ctx_s {
     ngx_http_request_t                      *r;
     ngx_http_upstrand_conf_t                *upstrand;
+    ngx_http_upstrand_request_ctx_t         *parent;
     ngx_str_t                                cur_upstream;
     ngx_array_t                              status_data;
+    ngx_array_t                              inflight;
     ngx_int_t                                start_cur;
     ngx_int_t                                start_bcur;
     ngx_int_t                                cur;
     ngx_int_t                                b_cur;
+    ngx_http_upstrand_order_t               *u_order;
+    ngx_http_upstrand_order_t               *bu_order;
     ngx_msec_t                               start_time;
     ngx_http_upstrand_request_common_ctx_t   common;
+    ngx_event_t                              hedge;
+    ngx_http_request_t                      *hedge_r;
+    ngx_http_request_t                      *hedge_loser;
+    ngx_http_headers_out_t                   broadcast_headers;
+    ngx_http_request_t                      *broadcast_r;
+    ngx_http_upstrand_request_common_ctx_t  *broadcast_chosen;
+    ngx_uint_t                               broadcast_pending;
+    ngx_uint_t                               broadcast_rank;
+    ngx_uint_t                               status_gen;
+    ngx_http_upstrand_rendered_var_t         rendered[UPSTRAND_RENDERED_VARS];
     ngx_uint_t                               backup_cycle:1;
     ngx_uint_t                               all_blacklisted:1;
     ngx_uint_t                               start_time_done:1;
-} ngx_http_upstrand_request_ctx_t;
-
-
-typedef struct {
-    ngx_int_t                                value;
-    ngx_str_t                                uri;
-} ngx_http_upstrand_intercept_status_data_t;
+    ngx_uint_t                               last_spawned:1;
+    ngx_uint_t                               hedging:1;
+    ngx_uint_t                               broadcast_saved:1;
+    ngx_uint_t                               broadcast_done:1;
+};
 
 
+/* a subrequest belongs to the upstrand context of its hop, a failover
+ * subrequest may also start a nested upstrand context */
 typedef struct {
     ngx_http_upstrand_request_common_ctx_t   common;
+    ngx_http_upstrand_request_ctx_t         *ctx;
+    ngx_http_upstrand_request_ctx_t         *nested;
 } ngx_http_upstrand_subrequest_ctx_t;
 
 
@@ -79,48 +245,221 @@ typedef struct {
 } ngx_http_upstrand_var_handle_t;
 
 
-static const ngx_str_t upstream_vars[] =
-{
-    ngx_string("upstream_addr"),
-    ngx_string("upstream_cache_status"),
-    ngx_string("upstream_connect_time"),
-    ngx_string("upstream_header_time"),
-    ngx_string("upstream_response_length"),
-    ngx_string("upstream_response_time"),
-    ngx_string("upstream_status")
-};
+typedef struct {
+    ngx_str_t                                name;
+    ngx_http_upstrand_conf_t                *upstrand;
+} ngx_http_upstrand_pass_conf_t;
 
 
+/* peer data of upstrand_pass: it wraps peer data of the current upstream from
+ * the upstrand and switches to the next upstream when the current one has run
+ * out of tries */
 typedef struct {
     ngx_http_request_t                      *r;
-    ngx_str_t                                upstream;
-    ngx_str_t                                data[UPSTREAM_VARS_SIZE];
-} ngx_http_upstrand_status_data_t;
-
-
-static ngx_int_t ngx_http_upstrand_intercept_statuses(ngx_http_request_t *r,
-    ngx_array_t *statuses, ngx_int_t status, ngx_str_t *uri);
+    ngx_http_upstrand_conf_t                *upstrand;
+    ngx_http_upstrand_upstream_conf_t       *cur_upstream;
+    ngx_http_upstrand_upstream_conf_t       *inflight;
+    void                                    *data;
+    ngx_event_get_peer_pt                    get;
+    ngx_event_free_peer_pt                   free;
+    ngx_int_t                                start_cur;
+    ngx_int_t                                start_bcur;
+    ngx_http_upstrand_order_t               *u_order;
+    ngx_http_upstrand_order_t               *bu_order;
+    ngx_uint_t                               step;
+    ngx_uint_t                               tries;
+    ngx_uint_t                               hops;
+} ngx_http_upstrand_pass_peer_data_t;
+
+
+static ngx_uint_t ngx_http_upstrand_get_rendered_var(
+    ngx_http_upstrand_request_ctx_t *ctx, ngx_uint_t idx,
+    ngx_http_variable_value_t *v);
+static void ngx_http_upstrand_set_rendered_var(
+    ngx_http_upstrand_request_ctx_t *ctx, ngx_uint_t idx,
+    ngx_http_variable_value_t *v);
+static ngx_int_t ngx_http_upstrand_init_hash(ngx_conf_t *cf,
+    ngx_http_combined_upstreams_main_conf_t *mcf);
+static ngx_int_t ngx_http_upstrand_init_upstream_vars(ngx_conf_t *cf,
+    ngx_http_combined_upstreams_main_conf_t *mcf,
+    ngx_http_core_main_conf_t *cmcf);
+static ngx_int_t ngx_http_upstrand_request_body_replay_handler(
+    ngx_http_request_t *r);
+static void ngx_http_upstrand_request_body_replay_post_handler(
+    ngx_http_request_t *r);
+static ngx_http_upstrand_request_ctx_t *ngx_http_upstrand_get_request_ctx(
+    ngx_http_request_t *r, ngx_http_upstrand_request_common_ctx_t **common);
 static ngx_int_t ngx_http_upstrand_response_header_filter(
     ngx_http_request_t *r);
+static ngx_int_t ngx_http_upstrand_filter_header(ngx_http_request_t *r,
+    ngx_http_upstrand_request_ctx_t *ctx,
+    ngx_http_upstrand_request_common_ctx_t *common);
+static ngx_int_t ngx_http_upstrand_next_header_filter(ngx_http_request_t *r,
+    ngx_http_upstrand_request_ctx_t *ctx);
 static ngx_int_t ngx_http_upstrand_response_body_filter(ngx_http_request_t *r,
     ngx_chain_t *in);
+static ngx_int_t ngx_http_upstrand_clone_hop(ngx_http_request_t *r,
+    ngx_http_upstrand_request_ctx_t *ctx, ngx_http_request_t **psr);
+static ngx_int_t ngx_http_upstrand_broadcast_start(ngx_http_request_t *r,
+    ngx_http_upstrand_request_ctx_t *ctx);
+static ngx_int_t ngx_http_upstrand_broadcast_choose(ngx_http_request_t *r,
+    ngx_http_upstrand_request_ctx_t *ctx,
+    ngx_http_upstrand_request_common_ctx_t *common);
+static ngx_int_t ngx_http_upstrand_broadcast_save_body(ngx_http_request_t *r,
+    ngx_http_upstrand_request_common_ctx_t *common, ngx_chain_t *in);
+static void ngx_http_upstrand_hedge_handler(ngx_event_t *ev);
+static void ngx_http_upstrand_hedge_cleanup(void *data);
+static void ngx_http_upstrand_cancel_hop(ngx_http_request_t *r);
+static void ngx_http_upstrand_discard_upstream_body(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_http_upstrand_request_common_ctx_t *common);
 static void ngx_http_upstrand_check_upstream_vars(ngx_http_request_t *r,
     ngx_int_t rc);
+static ngx_int_t ngx_http_upstrand_capture_upstream_vars(ngx_http_request_t *r,
+    ngx_http_upstrand_request_ctx_t *ctx,
+    ngx_http_upstrand_request_common_ctx_t *common);
+static ngx_int_t ngx_http_upstrand_warm_start(ngx_array_t *upstreams,
+    ngx_int_t start);
+static void ngx_http_upstrand_start_cursors(ngx_http_upstrand_conf_t *upstrand,
+    ngx_int_t *start_cur, ngx_int_t *start_bcur);
+static ngx_int_t ngx_http_upstrand_member_orders(ngx_http_request_t *r,
+    ngx_http_upstrand_conf_t *upstrand, ngx_int_t *start_cur,
+    ngx_int_t *start_bcur, ngx_http_upstrand_order_t **u_order,
+    ngx_http_upstrand_order_t **bu_order);
+static ngx_int_t ngx_http_upstrand_hash_order(ngx_pool_t *pool,
+    ngx_http_upstrand_hash_ring_t *ring, ngx_uint_t nelts, uint32_t hash,
+    ngx_int_t *start, ngx_http_upstrand_order_t **order);
+static ngx_int_t ngx_http_upstrand_least_time_order(ngx_pool_t *pool,
+    ngx_array_t *upstreams, ngx_uint_t slow_start, ngx_int_t *start,
+    ngx_http_upstrand_order_t **order);
+static ngx_http_upstrand_order_t *ngx_http_upstrand_order_alloc(
+    ngx_pool_t *pool, ngx_uint_t nelts);
+static ngx_int_t ngx_http_upstrand_parse_time(ngx_str_t *value);
+static void ngx_http_upstrand_hist_reset(ngx_http_upstrand_conf_t *upstrand);
+static void ngx_http_upstrand_outlier_check(ngx_pool_t *pool,
+    ngx_http_upstrand_conf_t *upstrand);
+static void ngx_http_upstrand_outlier_sweep(ngx_pool_t *pool,
+    ngx_http_upstrand_conf_t *upstrand, ngx_array_t *upstreams, time_t now);
+static ngx_int_t ngx_http_upstrand_outlier_stats(
+    ngx_http_upstrand_upstream_conf_t *u, ngx_uint_t *errors,
+    ngx_uint_t *latency);
+static ngx_uint_t ngx_http_upstrand_median(ngx_uint_t *values, ngx_uint_t n);
+static int ngx_libc_cdecl ngx_http_upstrand_cmp_uint(const void *one,
+    const void *two);
+static void ngx_http_upstrand_feed_header_time(
+    ngx_http_upstrand_conf_t *upstrand, ngx_http_upstrand_upstream_conf_t *u,
+    ngx_uint_t failed, ngx_str_t *value);
+static ngx_uint_t ngx_http_upstrand_p2c(ngx_array_t *upstreams);
+static ngx_int_t ngx_http_upstrand_inflight_start(
+    ngx_http_upstrand_request_ctx_t *ctx,
+    ngx_http_upstrand_request_common_ctx_t *common);
+static void ngx_http_upstrand_inflight_cleanup(void *data);
+static void ngx_http_upstrand_pass_inflight_cleanup(void *data);
 static ngx_int_t ngx_http_upstrand_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_dynamic_upstrand_slots(ngx_conf_t *cf,
+    ngx_http_combined_upstreams_loc_conf_t *lcf, ngx_array_t **inherited);
+static ngx_http_upstrand_conf_t *ngx_http_upstrand_find(ngx_http_request_t *r,
+    ngx_http_combined_upstreams_main_conf_t *mcf, ngx_str_t *name);
 static ngx_int_t ngx_http_get_dynamic_upstrand_value(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 static char *ngx_http_upstrand(ngx_conf_t *cf, ngx_command_t *dummy,
     void *conf);
 static char *ngx_http_upstrand_add_upstream(ngx_conf_t *cf,
-    ngx_array_t *upstreams, ngx_str_t *name, time_t blacklist_interval);
+    ngx_array_t *upstreams, uintptr_t *members, ngx_str_t *name,
+    ngx_http_upstrand_upstream_conf_t *uconf);
 #if (NGX_PCRE)
 static char *ngx_http_upstrand_regex_add_upstream(ngx_conf_t *cf,
-    ngx_array_t *upstreams, ngx_str_t *name, time_t blacklist_interval);
+    ngx_array_t *upstreams, uintptr_t *members, ngx_str_t *name,
+    ngx_http_upstrand_upstream_conf_t *uconf);
 #endif
+static ngx_http_upstrand_alias_t *ngx_http_upstrand_alias_table(
+    ngx_conf_t *cf, ngx_array_t *upstreams);
+static void ngx_http_upstrand_alias_build(ngx_http_upstrand_alias_t *alias,
+    ngx_uint_t *p, ngx_array_t *upstreams);
+static void ngx_http_upstrand_reload_weights(
+    ngx_http_upstrand_conf_t *upstrand);
+static ngx_http_upstrand_hash_ring_t *ngx_http_upstrand_hash_ring(
+    ngx_conf_t *cf, ngx_array_t *upstreams);
+static int ngx_libc_cdecl ngx_http_upstrand_cmp_hash_points(const void *one,
+    const void *two);
+static ngx_int_t ngx_http_upstrand_pass_init_upstream(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstrand_pass_init_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_http_upstrand_upstream_conf_t
+    *ngx_http_upstrand_pass_step_upstream(
+    ngx_http_upstrand_pass_peer_data_t *pd, ngx_uint_t step);
+static ngx_int_t ngx_http_upstrand_pass_find_upstream(
+    ngx_http_upstrand_pass_peer_data_t *pd);
+static ngx_int_t ngx_http_upstrand_pass_init_upstream_peer(
+    ngx_http_upstrand_pass_peer_data_t *pd);
+static ngx_int_t ngx_http_upstrand_pass_next_upstream(
+    ngx_http_upstrand_pass_peer_data_t *pd, ngx_uint_t failed);
+static ngx_int_t ngx_http_upstrand_pass_get_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_http_upstrand_pass_record_hops(
+    ngx_http_upstrand_pass_peer_data_t *pd);
+static void ngx_http_upstrand_pass_free_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
 static ngx_http_upstrand_subrequest_ctx_t
     *ngx_http_get_upstrand_subrequest_ctx(ngx_http_request_t *r,
     ngx_http_request_t *ctx_r);
+static char *ngx_http_upstrand_zone(ngx_conf_t *cf,
+    ngx_http_upstrand_conf_t *upstrand, ngx_str_t *value);
+static ngx_int_t ngx_http_upstrand_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static void ngx_http_upstrand_reset_weights(
+    ngx_http_upstrand_conf_t *oupstrand, ngx_http_upstrand_conf_t *upstrand);
+static void ngx_http_upstrand_free_generations(ngx_slab_pool_t *shpool,
+    ngx_http_upstrand_shm_t *shm);
+static ngx_uint_t ngx_http_upstrand_shm_prune_workers(ngx_slab_pool_t *shpool,
+    ngx_http_upstrand_shm_t *shm);
+static ngx_int_t ngx_http_upstrand_shm_add_worker(
+    ngx_http_upstrand_conf_t *upstrand);
+static void ngx_http_upstrand_bind_state(ngx_http_upstrand_conf_t *upstrand,
+    ngx_http_upstrand_upstream_state_t *state,
+    ngx_http_upstrand_counters_t *counters);
+static uint32_t ngx_http_upstrand_signature(ngx_conf_t *cf,
+    ngx_http_upstrand_conf_t *upstrand);
+static ngx_int_t ngx_http_upstrand_hc_init(ngx_cycle_t *cycle,
+    ngx_http_upstrand_health_check_t *hc);
+static void ngx_http_upstrand_hc_add_probes(
+    ngx_http_upstrand_health_check_t *hc, ngx_array_t *upstreams,
+    ngx_http_upstream_srv_conf_t **uscfp);
+static void ngx_http_upstrand_hc_handler(ngx_event_t *ev);
+static void ngx_http_upstrand_hc_start_probe(
+    ngx_http_upstrand_hc_probe_t *probe);
+static void ngx_http_upstrand_hc_write_handler(ngx_event_t *wev);
+static void ngx_http_upstrand_hc_read_handler(ngx_event_t *rev);
+static void ngx_http_upstrand_hc_finalize_probe(
+    ngx_http_upstrand_hc_probe_t *probe, ngx_uint_t passed);
+
+
+static ngx_int_t ngx_http_upstrand_status_handler(ngx_http_request_t *r);
+static u_char *ngx_http_upstrand_status_json(u_char *p,
+    ngx_http_upstrand_conf_t *upstrand, ngx_http_upstream_srv_conf_t **uscfp,
+    time_t now);
+static u_char *ngx_http_upstrand_status_prometheus(u_char *p,
+    ngx_http_upstrand_conf_t **upstrands, ngx_uint_t nelts,
+    ngx_http_upstream_srv_conf_t **uscfp, time_t now);
+static void ngx_http_upstrand_status_cursors(
+    ngx_http_upstrand_conf_t *upstrand, ngx_atomic_uint_t *cur,
+    ngx_atomic_uint_t *b_cur);
+static ngx_int_t ngx_http_upstrand_api_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_upstrand_api_update(ngx_http_request_t *r,
+    ngx_http_upstrand_conf_t *upstrand, ngx_http_upstream_srv_conf_t **uscfp);
+static ngx_int_t ngx_http_upstrand_api_check_weight(
+    ngx_http_upstrand_conf_t *upstrand, ngx_http_upstream_srv_conf_t **uscfp,
+    ngx_str_t *name, ngx_int_t weight);
+static u_char *ngx_http_upstrand_api_json(u_char *p,
+    ngx_http_upstrand_conf_t *upstrand, ngx_http_upstream_srv_conf_t **uscfp);
+static ngx_atomic_uint_t ngx_http_upstrand_member_gauge(
+    ngx_http_upstrand_upstream_conf_t *u, ngx_uint_t gauge, time_t now);
+static u_char *ngx_http_upstrand_hist_json(u_char *p, ngx_str_t *name,
+    ngx_http_upstrand_histogram_t *hist);
+static u_char *ngx_http_upstrand_hist_prometheus(u_char *p, ngx_str_t *name,
+    ngx_str_t *upstrand, ngx_str_t *upstream,
+    ngx_http_upstrand_histogram_t *hist);
 
 
 static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
@@ -141,18 +480,335 @@ extern ngx_module_t  ngx_http_grpc_module;
 
 static ngx_uint_t  ngx_http_upstrand_gw_modules[5];
 
+
+/* indices of the modes are their values */
+static ngx_str_t  ngx_http_upstrand_admin_modes[] = {
+    ngx_string("up"),
+    ngx_string("drained"),
+    ngx_string("blacklisted"),
+    ngx_string("whitelisted"),
+    ngx_null_string
+};
+
+
+static ngx_http_upstrand_metric_t  ngx_http_upstrand_counter_metrics[] = {
+    { ngx_string("requests"),
+      offsetof(ngx_http_upstrand_counters_t, requests) },
+    { ngx_string("hops"),
+      offsetof(ngx_http_upstrand_counters_t, hops) },
+    { ngx_string("timeouts"),
+      offsetof(ngx_http_upstrand_counters_t, timeouts) },
+    { ngx_string("intercepts"),
+      offsetof(ngx_http_upstrand_counters_t, intercepts) },
+    { ngx_string("all_blacklisted"),
+      offsetof(ngx_http_upstrand_counters_t, all_blacklisted) },
+    { ngx_null_string, 0 }
+};
+
+
+static ngx_http_upstrand_metric_t  ngx_http_upstrand_next_upstream_metrics[] = {
+    { ngx_string("4xx"),
+      offsetof(ngx_http_upstrand_counters_t, next_4xx) },
+    { ngx_string("5xx"),
+      offsetof(ngx_http_upstrand_counters_t, next_5xx) },
+    { ngx_string("error"),
+      offsetof(ngx_http_upstrand_counters_t, next_error) },
+    { ngx_string("other"),
+      offsetof(ngx_http_upstrand_counters_t, next_other) },
+    { ngx_null_string, 0 }
+};
+
+
+static ngx_http_upstrand_metric_t  ngx_http_upstrand_member_metrics[] = {
+    { ngx_string("hops"),
+      offsetof(ngx_http_upstrand_upstream_state_t, hops) },
+    { ngx_string("next_upstream"),
+      offsetof(ngx_http_upstrand_upstream_state_t, next_upstream) },
+    { ngx_string("blacklistings"),
+      offsetof(ngx_http_upstrand_upstream_state_t, blacklistings) },
+    { ngx_null_string, 0 }
+};
+
+
+/* the offsets of the gauges are their ids */
+static ngx_http_upstrand_metric_t  ngx_http_upstrand_member_gauges[] = {
+    { ngx_string("blacklisted"), 0 },
+    { ngx_string("ejected"), 1 },
+    { ngx_string("down"), 2 },
+    { ngx_string("inflight"), 3 },
+    { ngx_null_string, 0 }
+};
+
+
+static ngx_http_upstrand_metric_t  ngx_http_upstrand_member_histograms[] = {
+    { ngx_string("header_time"),
+      offsetof(ngx_http_upstrand_upstream_state_t, header_time_hist) },
+    { ngx_string("response_time"),
+      offsetof(ngx_http_upstrand_upstream_state_t, response_time_hist) },
+    { ngx_null_string, 0 }
+};
+
+
+#define ngx_http_upstrand_metric_value(base, metric)                          \
+    (*(ngx_atomic_t *) ((u_char *) (base) + (metric)->offset))
+
+#define ngx_http_upstrand_metric_hist(base, metric)                           \
+    ((ngx_http_upstrand_histogram_t *) ((u_char *) (base) + (metric)->offset))
+
 #define UPSTRAND_EFFECTIVE_GW_MODULES_SIZE 1
 
 
+static ngx_inline void
+ngx_http_upstrand_count(ngx_atomic_t *counter)
+{
+    (void) ngx_atomic_fetch_add(counter, 1);
+}
+
+
+static ngx_inline void
+ngx_http_upstrand_hist_add(ngx_http_upstrand_histogram_t *hist,
+                           ngx_msec_t value)
+{
+    ngx_uint_t  i;
+
+    for (i = 0; i < UPSTRAND_HIST_BUCKETS - 1; i++) {
+        if (value <= (ngx_msec_t) 1 << i) {
+            break;
+        }
+    }
+
+    ngx_http_upstrand_count(&hist->buckets[i]);
+    ngx_http_upstrand_count(&hist->count);
+    (void) ngx_atomic_fetch_add(&hist->sum, value);
+}
+
+
+static ngx_inline void
+ngx_http_upstrand_breaker_fail(ngx_http_upstrand_upstream_conf_t *u,
+                               time_t now)
+{
+    ngx_atomic_uint_t  old, failures;
+
+    failures = u->state->failures;
+    old = u->state->blacklist_last_occurrence;
+
+    /* failures of requests that were sent before the breaker opened do not
+     * extend the open interval */
+    if (failures == 0
+        || now - (time_t) old >= ngx_http_upstrand_open_interval(u, failures))
+    {
+        (void) ngx_atomic_fetch_add(&u->state->failures, 1);
+        ngx_http_upstrand_count(&u->state->blacklistings);
+    }
+
+    /* failure means that another worker has just updated the state, and its
+     * value is as good as this one */
+    (void) ngx_atomic_cmp_set(&u->state->blacklist_last_occurrence, old,
+                              (ngx_atomic_uint_t) now);
+
+    u->state->probe = 0;
+}
+
+
+/* the ramp of a recovering upstream starts after delay: when the breaker
+ * closes, when the upstream passes health checks, when it gets back from
+ * ejection or from drained and blacklisted modes */
+
+static ngx_inline void
+ngx_http_upstrand_slow_start(ngx_http_upstrand_upstream_conf_t *u,
+                             ngx_msec_t delay)
+{
+    if (u->slow_start > 0) {
+        /* zero means that the upstream is not recovering */
+        u->state->recovered = (ngx_current_msec + delay) | 1;
+    }
+}
+
+
+static ngx_inline void
+ngx_http_upstrand_breaker_succeed(ngx_http_upstrand_upstream_conf_t *u)
+{
+    if (u->state->failures == 0) {
+        return;
+    }
+
+    u->state->failures = 0;
+    u->state->probe = 0;
+    u->state->blacklist_last_occurrence = 0;
+
+    ngx_http_upstrand_slow_start(u, 0);
+}
+
+
+/* returns a uniformly distributed random number in [0, n): values from the
+ * incomplete last span of the range are rejected, otherwise the remainder
+ * would prefer small numbers when n is not a power of two */
+
+static ngx_inline ngx_uint_t
+ngx_http_upstrand_random(ngx_uint_t n)
+{
+    ngx_uint_t  r, range;
+
+    for ( ;; ) {
+        r = (ngx_uint_t) ngx_random();
+        range = UPSTRAND_RANDOM_RANGE;
+
+#if (NGX_PTR_SIZE == 8)
+        /* large totals of weights need more bits */
+        if (n > range) {
+            r = r << 31 | (ngx_uint_t) ngx_random();
+            range <<= 31;
+        }
+#endif
+
+        /* 32-bit platforms cannot draw more than 31 bits in this way */
+        if (n >= range || r < range - range % n) {
+            return r % n;
+        }
+    }
+}
+
+
+/* a recovering upstream is accepted as the starting upstream with probability
+ * growing linearly from near zero to one during the slow start period */
+
+static ngx_inline ngx_uint_t
+ngx_http_upstrand_is_warm(ngx_http_upstrand_upstream_conf_t *u)
+{
+    ngx_msec_int_t  elapsed;
+
+    if (u->slow_start == 0 || u->state->recovered == 0) {
+        return 1;
+    }
+
+    elapsed = (ngx_msec_int_t)
+            (ngx_current_msec - (ngx_msec_t) u->state->recovered);
+
+    /* the ramp of an ejected upstream has not started yet */
+    if (elapsed < 0) {
+        return 0;
+    }
+
+    if ((ngx_msec_t) elapsed >= u->slow_start) {
+        return 1;
+    }
+
+    return ngx_http_upstrand_random(u->slow_start) < (ngx_msec_t) elapsed + 1;
+}
+
+
+/* reopens the upstream for the caller only: other requests see it half-open
+ * with a pending probe */
+static ngx_inline void
+ngx_http_upstrand_breaker_reopen(ngx_http_upstrand_upstream_conf_t *u,
+                                 time_t now)
+{
+    u->state->blacklist_last_occurrence = 0;
+    u->state->probe = now;
+}
+
+
+/* a weight set in upstrand_api overrides the configured weight, zero weights
+ * are valid in both */
+
+static ngx_inline ngx_uint_t
+ngx_http_upstrand_weight(ngx_http_upstrand_upstream_conf_t *u)
+{
+    return u->state->weight_set ? u->state->weight : u->weight;
+}
+
+
+static ngx_inline ngx_uint_t
+ngx_http_upstrand_alias_sample(ngx_http_upstrand_alias_t *alias,
+                               ngx_uint_t nelts)
+{
+    ngx_uint_t  i;
+
+    i = ngx_http_upstrand_random(nelts);
+
+    return ngx_http_upstrand_random(alias[i].total) < alias[i].prob ?
+            i : alias[i].alias;
+}
+
+
+static ngx_inline void
+ngx_http_upstrand_update_header_time(ngx_http_upstrand_upstream_conf_t *u,
+                                     ngx_int_t sample)
+{
+    ngx_int_t  value;
+
+    time_t     now;
+
+    now = ngx_time();
+
+    /* the update is not atomic: a concurrent sample from another worker may
+     * get lost which is harmless for a moving average */
+    value = (ngx_int_t) ngx_http_upstrand_header_time(u, now);
+
+    if (sample < 0) {
+        /* failures push the upstream towards the end of the order */
+        value = ngx_max(value * 2, UPSTRAND_LEAST_TIME_PENALTY);
+        value = ngx_min(value, UPSTRAND_LEAST_TIME_MAX);
+
+    } else if (value == 0) {
+        value = sample;
+
+    } else {
+        value += (sample - value) / 8;
+    }
+
+    u->state->header_time = value;
+    u->state->header_time_sampled = now;
+}
+
+
+/* an outcome packs the header time in msec, the failure bit and a bit that
+ * distinguishes it from an empty slot of the window */
+
+static ngx_inline void
+ngx_http_upstrand_outlier_record(ngx_http_upstrand_upstream_conf_t *u,
+                                 ngx_uint_t failed, ngx_msec_t time)
+{
+    ngx_atomic_uint_t  pos;
+
+    pos = ngx_atomic_fetch_add(&u->state->outcome, 1);
+
+    u->state->outcomes[pos % UPSTRAND_OUTLIER_WINDOW] =
+            (ngx_atomic_uint_t) time << 2 | 2 | (failed ? 1 : 0);
+}
+
+
+static ngx_inline void
+ngx_http_upstrand_inflight_add(ngx_http_upstrand_upstream_conf_t *u,
+                               ngx_atomic_int_t value)
+{
+    (void) ngx_atomic_fetch_add(&u->state->inflight, value);
+
+    /* the worker's share is written only by the worker itself */
+    if (u->worker_inflight != NULL) {
+        *u->worker_inflight += value;
+    }
+}
+
+
 ngx_int_t
 ngx_http_upstrand_init(ngx_conf_t *cf)
 {
-#ifdef NGX_HTTP_COMBINED_UPSTREAMS_PERSISTENT_UPSTRAND_INTERCEPT_CTX
     ngx_http_combined_upstreams_main_conf_t  *mcf;
+    ngx_http_core_main_conf_t                *cmcf;
+    ngx_http_handler_pt                      *h;
 
     mcf = ngx_http_conf_get_module_main_conf(cf,
                                     ngx_http_combined_upstreams_module);
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+    if (ngx_http_upstrand_init_upstream_vars(cf, mcf, cmcf) != NGX_OK
+        || ngx_http_upstrand_init_hash(cf, mcf) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
 
+#ifdef NGX_HTTP_COMBINED_UPSTREAMS_PERSISTENT_UPSTRAND_INTERCEPT_CTX
     if (ngx_http_register_easy_ctx(cf, &ngx_http_combined_upstreams_module,
                                    &mcf->upstrand_intercept_ctx)
         == NGX_ERROR)
@@ -161,6 +817,17 @@ ngx_http_upstrand_init(ngx_conf_t *cf)
     }
 #endif
 
+#if nginx_version >= 1013004
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_PRECONTENT_PHASE].handlers);
+#else
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_ACCESS_PHASE].handlers);
+#endif
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_upstrand_request_body_replay_handler;
+
     ngx_http_upstrand_gw_modules[0] = ngx_http_proxy_module.ctx_index;
 
 #if 0
@@ -183,136 +850,354 @@ ngx_http_upstrand_init(ngx_conf_t *cf)
 }
 
 
+/* the hash is used for looking up upstrands in dynamic_upstrand, when
+ * upstrands have equal names the last of them wins like with their variables */
+
 static ngx_int_t
-ngx_http_upstrand_intercept_statuses(ngx_http_request_t *r,
-                                     ngx_array_t *statuses, ngx_int_t status,
-                                     ngx_str_t *uri)
+ngx_http_upstrand_init_hash(ngx_conf_t *cf,
+    ngx_http_combined_upstreams_main_conf_t *mcf)
 {
-    ngx_uint_t                                  i;
-    ngx_http_upstrand_intercept_status_data_t  *elts;
+    size_t                      elt_size;
+    ngx_uint_t                  i;
+    ngx_int_t                   rc;
+    ngx_str_t                   name;
+    ngx_hash_init_t             hash;
+    ngx_hash_keys_arrays_t      keys;
+    ngx_http_upstrand_conf_t  **upstrands;
+
+    keys.pool = cf->pool;
+    keys.temp_pool = cf->temp_pool;
+
+    if (ngx_hash_keys_array_init(&keys, NGX_HASH_SMALL) != NGX_OK) {
+        return NGX_ERROR;
+    }
 
-    elts = statuses->elts;
+    upstrands = mcf->upstrands.elts;
 
-    for (i = 0; i < statuses->nelts; i++) {
-        if ((elts[i].value == -4 && status >= 400 && status < 500)
-            ||
-            (elts[i].value == -5 && status >= 500 && status < 600)
-            ||
-            elts[i].value == status)
-        {
-            *uri = elts[i].uri;
-            return NGX_OK;
+    for (i = mcf->upstrands.nelts; i > 0; i--) {
+        name.len = upstrands[i - 1]->name.len;
+        name.data = ngx_pnalloc(cf->pool, name.len);
+        if (name.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_strlow(name.data, upstrands[i - 1]->name.data, name.len);
+
+        rc = ngx_hash_add_key(&keys, &name, upstrands[i - 1],
+                              NGX_HASH_READONLY_KEY);
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (name.len > mcf->upstrand_name_max_len) {
+            mcf->upstrand_name_max_len = name.len;
         }
     }
 
-    return NGX_DECLINED;
+    /* there are no directives to tune the hash, so that a bucket must fit
+     * the longest name (see NGX_HASH_ELT_SIZE in ngx_hash.c) along with the
+     * bucket terminator */
+    elt_size = sizeof(void *)
+               + ngx_align(mcf->upstrand_name_max_len + 2, sizeof(void *));
+
+    hash.hash = &mcf->upstrands_hash;
+    hash.key = ngx_hash_key_lc;
+    hash.max_size = ngx_max(4096, 2 * keys.keys.nelts);
+    hash.bucket_size = ngx_align(ngx_max(64, elt_size + sizeof(void *)),
+                                 ngx_cacheline_size);
+    hash.name = "upstrands_hash";
+    hash.pool = cf->pool;
+    hash.temp_pool = NULL;
+
+    return ngx_hash_init(&hash, keys.keys.elts, keys.keys.nelts);
 }
 
 
+/* upstream variables are captured in hops only when their upstrand
+ * counterparts are referenced in the configuration, the header and the
+ * response times are always needed for the upstream state */
+
 static ngx_int_t
-ngx_http_upstrand_response_header_filter(ngx_http_request_t *r)
+ngx_http_upstrand_init_upstream_vars(ngx_conf_t *cf,
+    ngx_http_combined_upstreams_main_conf_t *mcf,
+    ngx_http_core_main_conf_t *cmcf)
 {
-    ngx_uint_t                                i;
-#ifdef NGX_HTTP_COMBINED_UPSTREAMS_PERSISTENT_UPSTRAND_INTERCEPT_CTX
-    ngx_http_combined_upstreams_main_conf_t  *mcf;
-#endif
-    ngx_http_request_t                       *sr;
-    ngx_http_upstrand_request_ctx_t          *ctx;
-    ngx_http_upstrand_subrequest_ctx_t       *sr_ctx;
-    ngx_http_upstrand_request_common_ctx_t   *common;
-    ngx_http_upstream_t                      *u;
-    ngx_int_t                                 status;
-    ngx_int_t                                *next_upstream_statuses;
-    ngx_uint_t                                is_next_upstream_status;
-    ngx_http_upstrand_status_data_t          *status_data;
-    ngx_int_t                                 rc;
+    ngx_uint_t            i, j;
+    ngx_str_t             name;
+    ngx_http_variable_t  *v;
 
-    static const ngx_str_t    intercepted = ngx_string("<intercepted>");
+    mcf->upstream_vars_captured = (ngx_uint_t) 1 << UPSTREAM_HEADER_TIME_VAR;
+    mcf->upstream_vars_captured |= (ngx_uint_t) 1 << UPSTREAM_RESPONSE_TIME_VAR;
 
-    ctx = ngx_http_get_module_ctx(r->main, ngx_http_combined_upstreams_module);
-    if (ctx == NULL) {
-        return ngx_http_next_header_filter(r);
-    }
+    v = cmcf->variables.elts;
 
-    if (r != ctx->r) {
-        sr_ctx = ngx_http_get_upstrand_subrequest_ctx(r, ctx->r);
-        if (sr_ctx == NULL) {
-            return NGX_ERROR;
+    for (i = 0; i < cmcf->variables.nelts; i++) {
+        if (v[i].name.len <= 9
+            || ngx_strncmp(v[i].name.data, "upstrand_", 9) != 0)
+        {
+            continue;
         }
-    }
-    common = r == ctx->r ? &ctx->common : &sr_ctx->common;
 
-    u = r->upstream;
-
-    status = r->headers_out.status;
-
-    next_upstream_statuses = ctx->upstrand->next_upstream_statuses.elts;
-    is_next_upstream_status = 0;
-
-    for (i = 0; i < ctx->upstrand->next_upstream_statuses.nelts; i++) {
-
-        if ((next_upstream_statuses[i] == -4 && status >= 400 && status < 500)
-            ||
-            (next_upstream_statuses[i] == -5 && status >= 500 && status < 600)
-            ||
-            next_upstream_statuses[i] == status
-            ||
-            (next_upstream_statuses[i] == -101
-             && status == NGX_HTTP_BAD_GATEWAY
-             && u && u->peer.connection == NULL)
-            ||
-            (next_upstream_statuses[i] == -102
-             && status == NGX_HTTP_GATEWAY_TIME_OUT
-             && u && u->peer.connection == NULL))
+        if (v[i].name.len == 19
+            && ngx_strncmp(v[i].name.data + 9, "trace_json", 10) == 0)
         {
-            is_next_upstream_status = 1;
+            mcf->upstream_vars_captured = ((ngx_uint_t) 1 << UPSTREAM_VARS_SIZE)
+                                          - 1;
             break;
         }
+
+        for (j = 0; j < UPSTREAM_VARS_SIZE; j++) {
+            if (v[i].name.len == upstream_vars[j].len
+                && ngx_strncmp(v[i].name.data + 9, upstream_vars[j].data + 9,
+                               v[i].name.len - 9) == 0)
+            {
+                mcf->upstream_vars_captured |= (ngx_uint_t) 1 << j;
+                break;
+            }
+        }
     }
 
-    status_data = ngx_array_push(&ctx->status_data);
-    if (status_data == NULL) {
+    mcf->upstream_var_index = ngx_palloc(cf->pool, UPSTREAM_VARS_SIZE
+                                                   * sizeof(ngx_int_t));
+    if (mcf->upstream_var_index == NULL) {
         return NGX_ERROR;
     }
-    status_data->r = r;
-    status_data->upstream = common->intercepted ?
-            intercepted : ctx->cur_upstream;
-    ngx_memzero(&status_data->data, sizeof(status_data->data));
 
-    if (u) {
-        if (u->finalize_request) {
-            common->upstream_finalize_request = u->finalize_request;
-        }
-        /* BEWARE: the finalizer won't run when proxy_intercept_errors is on */
-        u->finalize_request = ngx_http_upstrand_check_upstream_vars;
-    }
+    for (i = 0; i < UPSTREAM_VARS_SIZE; i++) {
+        mcf->upstream_var_index[i] = NGX_ERROR;
 
-    if (is_next_upstream_status) {
-        ngx_http_upstrand_upstream_conf_t  *u_elts, *bu_elts;
-        ngx_uint_t                          bu_nelts;
-        time_t                              now = ngx_time();
+        if (!(mcf->upstream_vars_captured & ((ngx_uint_t) 1 << i))) {
+            continue;
+        }
 
-        u_elts = ctx->upstrand->upstreams.elts;
-        bu_elts = ctx->upstrand->b_upstreams.elts;
-        bu_nelts = ctx->upstrand->b_upstreams.nelts;
+        name = upstream_vars[i];
 
-        /* do not blacklist last upstream immediately after whitelisting */
-        if (!ctx->all_blacklisted) {
-            if (ctx->backup_cycle && bu_nelts > 0) {
-                if (bu_elts[ctx->b_cur].blacklist_interval > 0) {
-                    bu_elts[ctx->b_cur].blacklist_last_occurrence = now;
-                }
-            } else {
-                if (u_elts[ctx->cur].blacklist_interval > 0) {
-                    u_elts[ctx->cur].blacklist_last_occurrence = now;
-                }
-            }
+        mcf->upstream_var_index[i] = ngx_http_get_variable_index(cf, &name);
+        if (mcf->upstream_var_index[i] == NGX_ERROR) {
+            return NGX_ERROR;
         }
+    }
 
-        if (r->method & (NGX_HTTP_POST|NGX_HTTP_LOCK|NGX_HTTP_PATCH)
-            && !ctx->upstrand->retry_non_idempotent
-            && u && u->peer.connection != NULL)
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstrand_request_body_replay_handler(ngx_http_request_t *r)
+{
+    ngx_http_combined_upstreams_loc_conf_t  *lcf;
+    ngx_int_t                                rc;
+
+    if (r != r->main || r->request_body || r->discard_body) {
+        return NGX_DECLINED;
+    }
+
+    lcf = ngx_http_get_module_loc_conf(r, ngx_http_combined_upstreams_module);
+
+    /* bodies of unknown length and bodies exceeding the replay limit are
+     * read later as configured in the location and may be streamed to the
+     * first upstream without a chance to get replayed */
+    if (lcf->upstrand_request_body_replay == 0
+        || r->headers_in.chunked
+        || r->headers_in.content_length_n <= 0
+        || r->headers_in.content_length_n
+            > (off_t) lcf->upstrand_request_body_replay)
+    {
+        return NGX_DECLINED;
+    }
+
+    /* the body is kept in memory buffers and a temporary file as usual, the
+     * hops share the same chain: only buffer descriptors get copied when the
+     * body is sent to an upstream */
+    rc = ngx_http_read_client_request_body(r,
+                            ngx_http_upstrand_request_body_replay_post_handler);
+
+    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+        return rc;
+    }
+
+    ngx_http_finalize_request(r, NGX_DONE);
+
+    return NGX_DONE;
+}
+
+
+static void
+ngx_http_upstrand_request_body_replay_post_handler(ngx_http_request_t *r)
+{
+    r->write_event_handler = ngx_http_core_run_phases;
+    ngx_http_core_run_phases(r);
+}
+
+
+static ngx_int_t
+ngx_http_upstrand_response_header_filter(ngx_http_request_t *r)
+{
+    ngx_http_upstrand_request_ctx_t         *ctx;
+    ngx_http_upstrand_request_common_ctx_t  *common;
+
+    ctx = ngx_http_upstrand_get_request_ctx(r, &common);
+    if (ctx == NULL) {
+        return ngx_http_next_header_filter(r);
+    }
+
+    if (common == NULL) {
+        return NGX_ERROR;
+    }
+
+    return ngx_http_upstrand_filter_header(r, ctx, common);
+}
+
+
+static ngx_int_t
+ngx_http_upstrand_filter_header(ngx_http_request_t *r,
+                                ngx_http_upstrand_request_ctx_t *ctx,
+                                ngx_http_upstrand_request_common_ctx_t *common)
+{
+#ifdef NGX_HTTP_COMBINED_UPSTREAMS_PERSISTENT_UPSTRAND_INTERCEPT_CTX
+    ngx_http_combined_upstreams_main_conf_t  *mcf;
+#endif
+    ngx_http_request_t                       *sr;
+    ngx_http_upstrand_subrequest_ctx_t       *sr_ctx;
+    ngx_http_upstream_t                      *u;
+    ngx_int_t                                 status;
+    ngx_uint_t                                is_next_upstream_status;
+    ngx_http_upstrand_status_data_t          *status_data;
+    ngx_http_upstrand_counters_t             *counters;
+    ngx_int_t                                 rc;
+
+    static const ngx_str_t    intercepted = ngx_string("<intercepted>");
+
+    if (ctx->hedge.timer_set) {
+        ngx_del_timer(&ctx->hedge);
+    }
+
+    /* the hop lost the race but it could not be cancelled in time */
+    if (r == ctx->hedge_loser) {
+        common->last = 0;
+        return NGX_OK;
+    }
+
+    if (!common->intercepted) {
+        ngx_http_upstrand_count(&ctx->upstrand->counters->hops);
+
+        if (common->upstream != NULL) {
+            ngx_http_upstrand_count(&common->upstream->state->hops);
+        }
+    }
+
+    u = r->upstream;
+
+    status = r->headers_out.status;
+
+    is_next_upstream_status = ngx_http_upstrand_is_next_upstream_status(
+                                ctx->upstrand->next_upstream_statuses.elts,
+                                ctx->upstrand->next_upstream_statuses.nelts,
+                                status, u && u->peer.connection == NULL);
+
+    status_data = ngx_array_push(&ctx->status_data);
+    if (status_data == NULL) {
+        return NGX_ERROR;
+    }
+    status_data->r = r;
+    status_data->upstream = common->intercepted ?
+            intercepted : common->upstream_name;
+    ngx_memzero(&status_data->data, sizeof(status_data->data));
+
+    /* the array may get reallocated, so the hop keeps the index of its
+     * status data */
+    if (!common->status_data_set) {
+        common->status_data = ctx->status_data.nelts - 1;
+        common->status_data_set = 1;
+    }
+
+    ctx->status_gen++;
+
+    if (u) {
+        /* the finalizer has been already replaced when the request is the
+         * failover subrequest which started a nested upstrand */
+        if (u->finalize_request
+            && u->finalize_request != ngx_http_upstrand_check_upstream_vars)
+        {
+            common->upstream_finalize_request = u->finalize_request;
+        }
+        /* BEWARE: the finalizer won't run when proxy_intercept_errors is on */
+        u->finalize_request = ngx_http_upstrand_check_upstream_vars;
+    }
+
+    if (ctx->upstrand->order == ngx_http_upstrand_order_broadcast) {
+        rc = ngx_http_upstrand_broadcast_choose(r, ctx, common);
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+
+    } else if (is_next_upstream_status) {
+
+        common->failed = 1;
+
+        counters = ctx->upstrand->counters;
+
+        if (u && u->peer.connection == NULL
+            && (status == NGX_HTTP_BAD_GATEWAY
+                || status == NGX_HTTP_GATEWAY_TIME_OUT))
         {
+            ngx_http_upstrand_count(&counters->next_error);
+
+        } else if (status >= 500 && status < 600) {
+            ngx_http_upstrand_count(&counters->next_5xx);
+
+        } else if (status >= 400 && status < 500) {
+            ngx_http_upstrand_count(&counters->next_4xx);
+
+        } else {
+            ngx_http_upstrand_count(&counters->next_other);
+        }
+
+        if (common->upstream != NULL) {
+            ngx_http_upstrand_count(&common->upstream->state->next_upstream);
+        }
+
+        if (common->upstream != NULL
+            && common->upstream->blacklist_interval > 0)
+        {
+            ngx_http_upstrand_breaker_fail(common->upstream, ngx_time());
+        }
+
+        if (ctx->hedging) {
+            /* the hop lost the race, the response of the other hop which is
+             * still pending will be used */
+            ctx->hedging = 0;
+            common->last = 0;
+
+            if (ctx->upstrand->next_upstream_discard_body && u
+                && u->finalize_request
+                    == ngx_http_upstrand_check_upstream_vars)
+            {
+                ngx_http_upstrand_discard_upstream_body(r, u, common);
+            }
+
+            return NGX_OK;
+        }
+
+        /* the hop which is marked last may have been already spawned by
+         * hedging */
+        if (ctx->last_spawned) {
+            common->last = 1;
+        }
+
+        if (r->method & (NGX_HTTP_POST|NGX_HTTP_LOCK|NGX_HTTP_PATCH)
+            && !ctx->upstrand->retry_non_idempotent
+            && u && u->peer.connection != NULL)
+        {
+            common->last = 1;
+
+        } else if (ctx->r->request_body_no_buffering && u && u->request_sent)
+        {
+            /* the request body was streamed to the upstream and cannot be
+             * sent to the next upstream */
+            ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                          "unbuffered request body cannot be replayed in "
+                          "upstrand \"%V\"", &ctx->upstrand->name);
             common->last = 1;
 
         } else {
@@ -329,28 +1214,18 @@ ngx_http_upstrand_response_header_filter(ngx_http_request_t *r)
                         >= ctx->upstrand->next_upstream_timeout)
                 {
                     common->last = 1;
+                    ngx_http_upstrand_count(&counters->timeouts);
 
                 } else {
-                    if (ngx_http_subrequest(r, &ctx->r->uri, &ctx->r->args,
-                                            &sr, NULL,
-                                            NGX_HTTP_SUBREQUEST_CLONE)
-                        != NGX_OK)
-                    {
+                    if (ngx_http_upstrand_clone_hop(r, ctx, &sr) != NGX_OK) {
                         return NGX_ERROR;
                     }
 
-                    /* subrequest must use method of the original request */
-                    sr->method = r->method;
-                    sr->method_name = r->method_name;
-
-                    sr->header_in = r->header_in;
-
-                    /* adjust pointers to last elements in lists when needed */
-                    if (r->headers_in.headers.last
-                        == &r->headers_in.headers.part)
+                    if (ctx->upstrand->next_upstream_discard_body && u
+                        && u->finalize_request
+                            == ngx_http_upstrand_check_upstream_vars)
                     {
-                        sr->headers_in.headers.last =
-                                &sr->headers_in.headers.part;
+                        ngx_http_upstrand_discard_upstream_body(r, u, common);
                     }
 
                     return NGX_OK;
@@ -359,6 +1234,19 @@ ngx_http_upstrand_response_header_filter(ngx_http_request_t *r)
         }
 
     } else {
+        if (common->upstream != NULL
+            && common->upstream->blacklist_interval > 0)
+        {
+            ngx_http_upstrand_breaker_succeed(common->upstream);
+        }
+
+        if (ctx->hedging) {
+            /* the first acceptable response wins the race */
+            ctx->hedging = 0;
+            ctx->hedge_loser = r == ctx->r ? ctx->hedge_r : ctx->r;
+            ngx_http_upstrand_cancel_hop(ctx->hedge_loser);
+        }
+
         common->last = 1;
     }
 
@@ -367,12 +1255,14 @@ ngx_http_upstrand_response_header_filter(ngx_http_request_t *r)
 
         if (ctx->upstrand->intercept_statuses.nelts > 0
             && !common->intercepted
-            && ngx_http_upstrand_intercept_statuses(r,
+            && ngx_http_upstrand_intercept_statuses(
                     &ctx->upstrand->intercept_statuses, status, &failover_uri)
                 == NGX_OK)
         {
             common->last = 0;
 
+            ngx_http_upstrand_count(&ctx->upstrand->counters->intercepts);
+
             sr_ctx = ngx_pcalloc(ctx->r->pool,
                                  sizeof(ngx_http_upstrand_subrequest_ctx_t));
             if (sr_ctx == NULL) {
@@ -380,6 +1270,7 @@ ngx_http_upstrand_response_header_filter(ngx_http_request_t *r)
             }
             sr_ctx->common.last = 1;
             sr_ctx->common.intercepted = 1;
+            sr_ctx->ctx = ctx;
 
             /* BEWARE: no special adjustments in the failover subrequest */
             rc = ngx_http_subrequest(r, &failover_uri, NULL, &sr, NULL, 0);
@@ -407,6 +1298,10 @@ ngx_http_upstrand_response_header_filter(ngx_http_request_t *r)
             return NGX_OK;
         }
 
+        ngx_http_upstrand_hist_reset(ctx->upstrand);
+        ngx_http_upstrand_hist_add(&ctx->upstrand->counters->hops_hist,
+                                   ctx->status_data.nelts);
+
         if (r != ctx->r) {
             /* copy HTTP headers to main request */
             ctx->r->headers_out = r->headers_out;
@@ -427,11 +1322,33 @@ ngx_http_upstrand_response_header_filter(ngx_http_request_t *r)
             }
 #endif
 
-            return ngx_http_next_header_filter(ctx->r);
+            return ngx_http_upstrand_next_header_filter(ctx->r, ctx);
         }
     }
 
-    return ngx_http_next_header_filter(r);
+    return ngx_http_upstrand_next_header_filter(r, ctx);
+}
+
+
+/* the response of a nested upstrand is a response of a hop in the parent
+ * upstrand */
+
+static ngx_int_t
+ngx_http_upstrand_next_header_filter(ngx_http_request_t *r,
+                                     ngx_http_upstrand_request_ctx_t *ctx)
+{
+    ngx_http_upstrand_subrequest_ctx_t  *sr_ctx;
+
+    if (r != ctx->r || ctx->parent == NULL) {
+        return ngx_http_next_header_filter(r);
+    }
+
+    sr_ctx = ngx_http_get_upstrand_subrequest_ctx(r, ctx->parent->r);
+    if (sr_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    return ngx_http_upstrand_filter_header(r, ctx->parent, &sr_ctx->common);
 }
 
 
@@ -439,26 +1356,27 @@ static ngx_int_t
 ngx_http_upstrand_response_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 {
     ngx_http_upstrand_request_ctx_t         *ctx;
-    ngx_http_upstrand_subrequest_ctx_t      *sr_ctx;
     ngx_http_upstrand_request_common_ctx_t  *common;
     ngx_http_upstream_t                     *u;
 
-    ctx = ngx_http_get_module_ctx(r->main, ngx_http_combined_upstreams_module);
+    ctx = ngx_http_upstrand_get_request_ctx(r, &common);
     if (ctx == NULL) {
         return ngx_http_next_body_filter(r, in);
     }
 
-    if (r != ctx->r) {
-        sr_ctx = ngx_http_get_upstrand_subrequest_ctx(r, ctx->r);
-        if (sr_ctx == NULL) {
-            return NGX_ERROR;
-        }
+    if (common == NULL) {
+        return NGX_ERROR;
     }
-    common = r == ctx->r ? &ctx->common : &sr_ctx->common;
 
     u = r->upstream;
 
     if (!common->last) {
+        if (common == ctx->broadcast_chosen
+            && ngx_http_upstrand_broadcast_save_body(r, common, in) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
         /* if upstream buffering is off then its out_bufs must be updated
          * right here! (at least in nginx 1.8.0) */
         if (u && !u->buffering) {
@@ -482,1099 +1400,5461 @@ ngx_http_upstrand_response_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 }
 
 
-static void
-ngx_http_upstrand_check_upstream_vars(ngx_http_request_t *r, ngx_int_t  rc)
+static ngx_int_t
+ngx_http_upstrand_clone_hop(ngx_http_request_t *r,
+                            ngx_http_upstrand_request_ctx_t *ctx,
+                            ngx_http_request_t **psr)
 {
-    ngx_uint_t                               i;
-    ngx_http_upstrand_request_ctx_t         *ctx;
-    ngx_http_upstrand_subrequest_ctx_t      *sr_ctx;
-    ngx_http_upstrand_request_common_ctx_t  *common;
-    ngx_http_variable_value_t               *var;
-    ngx_str_t                                var_name;
-    ngx_int_t                                key;
-    ngx_http_upstrand_status_data_t         *upstreams, *status = NULL;
-
-    ctx = ngx_http_get_module_ctx(r->main, ngx_http_combined_upstreams_module);
-    if (ctx == NULL) {
-        return;
-    }
+    ngx_http_request_t  *sr;
 
-    upstreams = ctx->status_data.elts;
-    for (i = 0; i < ctx->status_data.nelts; i++) {
-        if (r == upstreams[i].r) {
-            status = &upstreams[i];
-            break;
-        }
-    }
-    if (status == NULL) {
-        return;
+    if (ngx_http_subrequest(r, &ctx->r->uri, &ctx->r->args, psr, NULL,
+                            NGX_HTTP_SUBREQUEST_CLONE)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
     }
 
-    for (i = 0; i < UPSTREAM_VARS_SIZE; i++) {
-        var_name = upstream_vars[i];
-        key = ngx_hash_key(var_name.data, var_name.len);
-
-        var = ngx_http_get_variable(r, &var_name, key);
-        if (var == NULL) {
-            return;
-        }
-
-        if (var->not_found || !var->valid || var->len == 0) {
-            continue;
-        }
+    sr = *psr;
 
-        status->data[i].len = var->len;
+    /* subrequest must use method of the original request */
+    sr->method = r->method;
+    sr->method_name = r->method_name;
 
-        if (r == ctx->r) {
-            /* main request data must be always accessible */
-            status->data[i].data = var->data;
-        } else {
-            status->data[i].data = ngx_pnalloc(ctx->r->pool, var->len);
-            if (status->data[i].data == NULL) {
-                return;
-            }
-            ngx_memcpy(status->data[i].data, var->data, var->len);
-        }
-    }
+    sr->header_in = r->header_in;
 
-    if (r != ctx->r) {
-        sr_ctx = ngx_http_get_upstrand_subrequest_ctx(r, ctx->r);
-        if (sr_ctx == NULL) {
-            return;
-        }
+    /* adjust pointers to last elements in lists when needed */
+    if (r->headers_in.headers.last == &r->headers_in.headers.part) {
+        sr->headers_in.headers.last = &sr->headers_in.headers.part;
     }
-    common = r == ctx->r ? &ctx->common : &sr_ctx->common;
 
-    if (common->upstream_finalize_request) {
-        common->upstream_finalize_request(r, rc);
-    }
+    return NGX_OK;
 }
 
 
 static ngx_int_t
-ngx_http_upstrand_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v,
-    uintptr_t data)
+ngx_http_upstrand_broadcast_start(ngx_http_request_t *r,
+                                  ngx_http_upstrand_request_ctx_t *ctx)
 {
-    ngx_http_upstrand_conf_t  *upstrand = (ngx_http_upstrand_conf_t *) data;
+    ngx_uint_t                           i, n;
+    ngx_http_request_t                  *sr;
+    ngx_http_upstrand_subrequest_ctx_t  *sr_ctx;
+    ngx_http_upstrand_upstream_conf_t   *u_elts, *upstream;
+    ngx_http_upstream_main_conf_t       *umcf;
+    ngx_http_upstream_srv_conf_t       **uscfp;
 
-    ngx_uint_t                                i;
-    ngx_http_combined_upstreams_loc_conf_t   *lcf;
-    ngx_http_upstrand_request_ctx_t          *ctx;
-    ngx_http_upstrand_subrequest_ctx_t       *sr_ctx;
-    ngx_http_upstrand_request_common_ctx_t   *common;
-    ngx_http_upstrand_upstream_conf_t        *u_elts, *bu_elts;
-    ngx_uint_t                                u_nelts, bu_nelts;
-    ngx_http_upstream_main_conf_t            *umcf;
-    ngx_http_upstream_srv_conf_t            **uscfp;
-    ngx_http_upstream_conf_t                 *u;
-    time_t                                    now;
-    ngx_int_t                                 start_cur, start_bcur;
-    ngx_int_t                                 cur_cur, cur_bcur;
-    ngx_uint_t                                force_last = 0;
+    u_elts = ctx->upstrand->upstreams.elts;
+    n = ctx->upstrand->upstreams.nelts;
 
-    ctx = ngx_http_get_module_ctx(r->main, ngx_http_combined_upstreams_module);
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+    uscfp = umcf->upstreams.elts;
 
-    u_elts = upstrand->upstreams.elts;
-    bu_elts = upstrand->b_upstreams.elts;
-    u_nelts = upstrand->upstreams.nelts;
-    bu_nelts = upstrand->b_upstreams.nelts;
+    /* hops get cloned before the request body is read by the upstream */
+    if (r->request_body == NULL
+        && (r->headers_in.content_length_n > 0 || r->headers_in.chunked))
+    {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                      "request body was not read before broadcasting in "
+                      "upstrand \"%V\", only the first upstream will get it",
+                      &ctx->upstrand->name);
+    }
 
-    if (ctx != NULL) {
-        if (ctx->upstrand->name.len != upstrand->name.len
-            || ngx_strncmp(ctx->upstrand->name.data, upstrand->name.data,
-                           upstrand->name.len) != 0)
-        {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                          "accessing multiple upstrand variables in a single "
-                          "request is prohibited (original upstrand is \"%V\", "
-                          "new upstrand is \"%V\")",
-                          &ctx->upstrand->name, &upstrand->name);
+    ctx->broadcast_pending = n;
+
+    upstream = &u_elts[ctx->start_cur];
+    ctx->common.upstream = upstream;
+    ctx->common.upstream_name = uscfp[upstream->index]->host;
+
+    for (i = 1; i < n; i++) {
+        if (ngx_http_upstrand_clone_hop(r, ctx, &sr) != NGX_OK) {
             return NGX_ERROR;
         }
 
-        if (r == ctx->r
-            || ngx_http_get_module_ctx(r, ngx_http_combined_upstreams_module)
-                != NULL)
-        {
-            goto was_accessed;
+        sr_ctx = ngx_pcalloc(r->pool,
+                             sizeof(ngx_http_upstrand_subrequest_ctx_t));
+        if (sr_ctx == NULL) {
+            return NGX_ERROR;
         }
+
+        upstream = &u_elts[(ctx->start_cur + i) % n];
+        sr_ctx->common.upstream = upstream;
+        sr_ctx->common.upstream_name = uscfp[upstream->index]->host;
+        sr_ctx->ctx = ctx;
+
+        ngx_http_set_ctx(sr, sr_ctx, ngx_http_combined_upstreams_module);
     }
 
-    /* location must be protected from interceptions by error_page,
-     * this is achieved by setting error_page flag for the request */
-    r->error_page = 1;
+    return NGX_OK;
+}
 
-    lcf = ngx_http_get_module_loc_conf(r, ngx_http_combined_upstreams_module);
 
-    if (!lcf->upstrand_gw_modules_checked) {
-        for (i = 0; i < UPSTRAND_EFFECTIVE_GW_MODULES_SIZE; i++) {
-            /* FIXME: this is a dirty hack: getting proxy module's location
-             * configuration as an upstream configuration is safe only if the
-             * upstream configuration is the first field of the location
-             * configuration; fortunately, this is true for proxy, uwsgi,
-             * fastcgi, scgi, and grpc modules */
-            u = r->loc_conf[ngx_http_upstrand_gw_modules[i]];
-            /* location must be protected against X-Accel-Redirect headers */
-            u->ignore_headers |= NGX_HTTP_UPSTREAM_IGN_XA_REDIRECT;
-        }
-        lcf->upstrand_gw_modules_checked = 1;
+/* returns NGX_DECLINED when the response of the hop must be sent as is */
+static ngx_int_t
+ngx_http_upstrand_broadcast_choose(ngx_http_request_t *r,
+                                   ngx_http_upstrand_request_ctx_t *ctx,
+                                   ngx_http_upstrand_request_common_ctx_t
+                                       *common)
+{
+    ngx_http_request_t                      *mr;
+    ngx_int_t                                status, rc;
+    ngx_uint_t                               rank, ok;
+    ngx_buf_t                               *b;
+    ngx_chain_t                             *cl;
+    ngx_http_upstrand_request_common_ctx_t  *chosen;
+
+    ctx->broadcast_pending--;
+    common->last = 0;
+
+    if (ctx->broadcast_done) {
+        return NGX_OK;
     }
 
-    if (ctx == NULL) {
-        ctx = ngx_pcalloc(r->main->pool,
-                          sizeof(ngx_http_upstrand_request_ctx_t));
-        if (ctx == NULL) {
-            return NGX_ERROR;
-        }
+    status = r->headers_out.status;
+    ok = status >= NGX_HTTP_OK && status < NGX_HTTP_SPECIAL_RESPONSE;
 
-        ctx->r = r;
-        ctx->upstrand = upstrand;
-        if (ngx_array_init(&ctx->status_data, r->pool, 1,
-                           sizeof(ngx_http_upstrand_status_data_t)) != NGX_OK)
-        {
-            return NGX_ERROR;
-        }
-        if (upstrand->order_per_request &&
-            upstrand->order == ngx_http_upstrand_order_start_random)
-        {
-            ctx->start_cur = ngx_random() % u_nelts;
-            ctx->start_bcur = ngx_random() % bu_nelts;
-        } else {
-            ctx->start_cur = upstrand->cur;
-            ctx->start_bcur = upstrand->b_cur;
-        }
-        ctx->cur = ctx->start_cur;
-        ctx->b_cur = ctx->start_bcur;
+    if (ok && ctx->upstrand->broadcast_policy
+                == ngx_http_upstrand_broadcast_first_2xx)
+    {
+        ctx->broadcast_done = 1;
+        common->last = 1;
+        return NGX_DECLINED;
+    }
 
-        if (u_nelts > 0) {
-            if (!upstrand->order_per_request) {
-                upstrand->cur = (upstrand->cur + 1) % u_nelts;
-            }
-        } else {
-            ctx->backup_cycle = 1;
-            if (bu_nelts > 0 && !upstrand->order_per_request) {
-                upstrand->b_cur = (upstrand->b_cur + 1) % bu_nelts;
-            }
-        }
+    /* the worst status wins; when all upstreams must succeed, successful
+     * responses rank below any failure */
+    rank = ok && ctx->upstrand->broadcast_policy
+                    == ngx_http_upstrand_broadcast_all ? 0 : status;
 
-        /* ctx->start_time will be reset to the value of the upstream's first
-         * peer's start_time in ngx_http_upstrand_response_header_filter() */
-        ctx->start_time = ngx_current_msec;
+    /* on a tie the latest response is preferred as its body can be sent
+     * without buffering */
+    if (!ctx->broadcast_saved || rank >= ctx->broadcast_rank) {
+        if (ctx->broadcast_pending == 0) {
+            ctx->broadcast_done = 1;
+            common->last = 1;
+            return NGX_DECLINED;
+        }
 
-        ngx_http_set_ctx(r->main, ctx, ngx_http_combined_upstreams_module);
+        ctx->broadcast_headers = r->headers_out;
+        ctx->broadcast_rank = rank;
+        ctx->broadcast_saved = 1;
 
-    } else if (r != ctx->r) {
+        /* the body of the chosen response gets saved while it arrives */
+        ctx->broadcast_r = r;
+        ctx->broadcast_chosen = common;
+        common->body_last = &common->body;
 
-        sr_ctx = ngx_pcalloc(r->pool,
-                             sizeof(ngx_http_upstrand_subrequest_ctx_t));
-        if (sr_ctx == NULL) {
-            return NGX_ERROR;
+        /* adjust pointers to last elements in lists when needed */
+        if (r->headers_out.headers.last == &r->headers_out.headers.part) {
+            ctx->broadcast_headers.headers.last =
+                    &ctx->broadcast_headers.headers.part;
         }
-        ngx_http_set_ctx(r, sr_ctx, ngx_http_combined_upstreams_module);
-
-        if (ctx->backup_cycle) {
-            if (bu_nelts > 0) {
-                ctx->b_cur = (ctx->b_cur + 1) % bu_nelts;
-            }
-        } else if (u_nelts > 0) {
-            ctx->cur = (ctx->cur + 1) % u_nelts;
-            if (ctx->cur == ctx->start_cur) {
-                ctx->backup_cycle = 1;
-            }
+#if nginx_version >= 1013002
+        if (r->headers_out.trailers.last == &r->headers_out.trailers.part) {
+            ctx->broadcast_headers.trailers.last =
+                    &ctx->broadcast_headers.trailers.part;
         }
+#endif
+
+        return NGX_OK;
     }
 
-    now = ngx_time();
-    start_cur = cur_cur = ctx->cur;
-    start_bcur = cur_bcur = ctx->b_cur;
+    if (ctx->broadcast_pending > 0) {
+        return NGX_OK;
+    }
 
-    for ( ;; ) {
-        if (ctx->backup_cycle) {
-            if (bu_nelts > 0) {
-                if (now - bu_elts[cur_bcur].blacklist_last_occurrence
-                    < bu_elts[cur_bcur].blacklist_interval)
-                {
-                    ngx_int_t  old_bcur = cur_bcur;
+    ctx->broadcast_done = 1;
 
-                    cur_bcur = (cur_bcur + 1) % bu_nelts;
-                    if (cur_bcur == ctx->start_bcur) {
-                        force_last = 1;
-                    } else if (!force_last) {
-                        ctx->b_cur = old_bcur;
-                    }
-                    if (cur_bcur == start_bcur) {
-                        ctx->all_blacklisted = 1;
-                        break;
-                    }
-                } else {
-                    break;
-                }
-            } else {
-                ctx->all_blacklisted = 1;
-                break;
-            }
-        } else if (u_nelts > 0) {
-            if (now - u_elts[cur_cur].blacklist_last_occurrence
-                < u_elts[cur_cur].blacklist_interval)
-            {
-                ngx_int_t  old_cur = cur_cur;
+    mr = ctx->r;
+    mr->headers_out = ctx->broadcast_headers;
 
-                cur_cur = (cur_cur + 1) % u_nelts;
-                if (bu_nelts == 0 && cur_cur == ctx->start_cur) {
-                    force_last = 1;
-                } else if (!force_last) {
-                    ctx->cur = old_cur;
-                }
-                if (cur_cur == start_cur) {
-                    ctx->backup_cycle = 1;
-                }
-            } else {
-                break;
-            }
-        }
+    if (ctx->broadcast_headers.headers.last
+        == &ctx->broadcast_headers.headers.part)
+    {
+        mr->headers_out.headers.last = &mr->headers_out.headers.part;
+    }
+#if nginx_version >= 1013002
+    if (ctx->broadcast_headers.trailers.last
+        == &ctx->broadcast_headers.trailers.part)
+    {
+        mr->headers_out.trailers.last = &mr->headers_out.trailers.part;
     }
+#endif
 
-    if (ctx->all_blacklisted) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                      "all upstreams in upstrand \"%V\" are blacklisted, "
-                      "whitelisting them", &upstrand->name);
-        ctx->cur = start_cur;
-        ctx->b_cur = start_bcur;
-        for (i = 0; i < u_nelts; i++) {
-            u_elts[i].blacklist_last_occurrence = 0;
-        }
-        for (i = 0; i < bu_nelts; i++) {
-            bu_elts[i].blacklist_last_occurrence = 0;
-        }
+    rc = ngx_http_next_header_filter(mr);
+
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
     }
 
-    if (r != ctx->r) {
-        sr_ctx = ngx_http_get_upstrand_subrequest_ctx(r, ctx->r);
-        if (sr_ctx == NULL) {
-            return NGX_ERROR;
-        }
+    chosen = ctx->broadcast_chosen;
+    ctx->broadcast_chosen = NULL;
+
+    if (mr->header_only) {
+        return NGX_OK;
     }
-    common = r == ctx->r ? &ctx->common : &sr_ctx->common;
 
-    if (force_last ||
-        (bu_nelts == 0 &&
-         (u_nelts == 0
-          || (ctx->cur + 1) % u_nelts == (ngx_uint_t) ctx->start_cur)) ||
-        (ctx->backup_cycle &&
-         (bu_nelts == 0
-          || (ctx->b_cur + 1) % bu_nelts == (ngx_uint_t) ctx->start_bcur)))
-    {
-        common->last = 1;
+    /* the rest of the body of the chosen response which is still arriving
+     * follows the saved part */
+    if (!chosen->body_done) {
+        chosen->last = 1;
+
+        if (chosen->body == NULL) {
+            return NGX_OK;
+        }
+
+        return ngx_http_next_body_filter(ctx->broadcast_r, chosen->body)
+                   == NGX_ERROR ? NGX_ERROR : NGX_OK;
     }
 
-was_accessed:
+    b = ngx_calloc_buf(mr->pool);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
 
-    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
-    uscfp = umcf->upstreams.elts;
+    b->last_buf = 1;
 
-    if (ctx->backup_cycle && bu_nelts > 0) {
-        ctx->cur_upstream = uscfp[bu_elts[ctx->b_cur].index]->host;
-    } else {
-        ctx->cur_upstream = uscfp[u_elts[ctx->cur].index]->host;
+    cl = ngx_alloc_chain_link(mr->pool);
+    if (cl == NULL) {
+        return NGX_ERROR;
     }
 
-    v->valid = 1;
-    v->not_found = 0;
-    v->len = ctx->cur_upstream.len;
-    v->data = ctx->cur_upstream.data;
+    cl->buf = b;
+    cl->next = NULL;
+    *chosen->body_last = cl;
 
-    return NGX_OK;
+    return ngx_http_next_body_filter(mr, chosen->body) == NGX_ERROR ?
+                                                        NGX_ERROR : NGX_OK;
 }
 
 
+/* buffers in memory point to buffers of the upstream which get reused, and
+ * therefore their contents get copied, whereas buffers in temporary files
+ * stay valid until the main request gets finalized */
+
 static ngx_int_t
-ngx_http_get_dynamic_upstrand_value(ngx_http_request_t *r,
-    ngx_http_variable_value_t *v, uintptr_t  data)
+ngx_http_upstrand_broadcast_save_body(ngx_http_request_t *r,
+                                      ngx_http_upstrand_request_common_ctx_t
+                                          *common,
+                                      ngx_chain_t *in)
 {
-    ngx_uint_t                               i;
-    ngx_int_t                               *index = (ngx_int_t *) data;
-    ngx_int_t                                found_idx = NGX_ERROR;
-    ngx_http_combined_upstreams_loc_conf_t  *lcf;
-    ngx_array_t                             *upstrands;
-    ngx_http_upstrand_var_list_elem_t       *upstrands_elts;
-    ngx_array_t                             *upstrand_cands;
-    ngx_http_upstrand_var_handle_t          *upstrand_cands_elts;
-    ngx_http_variable_value_t               *upstrand_var = NULL;
-    ngx_str_t                                upstrand_var_name;
-
-    if (index == NULL) {
-        return NGX_ERROR;
-    }
+    off_t         size;
+    ngx_buf_t    *b, *nb;
+    ngx_chain_t  *cl, *ln;
 
-    lcf = ngx_http_get_module_loc_conf(r, ngx_http_combined_upstreams_module);
+    for (ln = in; ln; ln = ln->next) {
+        b = ln->buf;
+
+        if (b->last_buf || b->last_in_chain) {
+            common->body_done = 1;
+        }
 
-    upstrands = &lcf->dyn_upstrands;
-    upstrands_elts = upstrands->elts;
+        size = ngx_buf_size(b);
 
-    for (i = 0; i < upstrands->nelts; i++) {
-        if (*index != upstrands_elts[i].index) {
+        if (size == 0) {
             continue;
         }
-        found_idx = i;
-        break;
-    }
 
-    if (found_idx == NGX_ERROR) {
-        return NGX_ERROR;
-    }
+        nb = ngx_calloc_buf(r->pool);
+        if (nb == NULL) {
+            return NGX_ERROR;
+        }
 
-    upstrand_cands = &upstrands_elts[found_idx].data;
-    upstrand_cands_elts = upstrand_cands->elts;
+        if (ngx_buf_in_memory(b)) {
+            nb->start = ngx_pnalloc(r->pool, size);
+            if (nb->start == NULL) {
+                return NGX_ERROR;
+            }
 
-    for (i = 0; i < upstrand_cands->nelts; i++) {
-        ngx_int_t                   key;
-        ngx_str_t                   var_name;
-        ngx_http_variable_value_t  *found = NULL;
+            nb->pos = nb->start;
+            nb->last = ngx_cpymem(nb->start, b->pos, size);
+            nb->end = nb->last;
+            nb->temporary = 1;
 
-        if (upstrand_cands_elts[i].index == NGX_ERROR) {
-            var_name = upstrand_cands_elts[i].key;
-        } else {
-            found = ngx_http_get_indexed_variable(r,
-                                                upstrand_cands_elts[i].index);
-            if (found == NULL || found->len == 0) {
-                continue;
-            }
+            b->pos = b->last;
 
-            var_name.len = found->len;
-            var_name.data = found->data;
+        } else {
+            nb->in_file = 1;
+            nb->file = b->file;
+            nb->file_pos = b->file_pos;
+            nb->file_last = b->file_last;
         }
 
-        upstrand_var_name.len = var_name.len + 9;
-        upstrand_var_name.data = ngx_pnalloc(r->pool, upstrand_var_name.len);
-        if (upstrand_var_name.data == NULL) {
-            return NGX_ERROR;
+        if (b->in_file) {
+            b->file_pos = b->file_last;
         }
 
-        ngx_memcpy(upstrand_var_name.data, "upstrand_", 9);
-        ngx_memcpy(upstrand_var_name.data + 9, var_name.data, var_name.len);
-
-        key = ngx_hash_strlow(upstrand_var_name.data, upstrand_var_name.data,
-                              upstrand_var_name.len);
-
-        upstrand_var = ngx_http_get_variable(r, &upstrand_var_name, key);
-        if (upstrand_var == NULL) {
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL) {
             return NGX_ERROR;
         }
 
-        break;
-    }
+        cl->buf = nb;
+        cl->next = NULL;
 
-    if (upstrand_var == NULL) {
-        v->len = 0;
-        v->data = (u_char *) "";
-        v->valid = 1;
-        v->no_cacheable = 0;
-        v->not_found = 0;
-    } else {
-        *v = *upstrand_var;
+        *common->body_last = cl;
+        common->body_last = &cl->next;
     }
 
     return NGX_OK;
 }
 
 
-ngx_int_t
-ngx_http_get_upstrand_path_var_value(ngx_http_request_t *r,
-    ngx_http_variable_value_t *v, uintptr_t  data)
+static void
+ngx_http_upstrand_hedge_handler(ngx_event_t *ev)
 {
-    ngx_uint_t                        i, len = 0, cur_len = 0;
-    ngx_http_upstrand_request_ctx_t  *ctx;
-    ngx_http_upstrand_status_data_t  *upstreams;
+    ngx_http_upstrand_request_ctx_t  *ctx = ev->data;
 
-    ctx = ngx_http_get_module_ctx(r->main, ngx_http_combined_upstreams_module);
-    if (ctx == NULL) {
-        return NGX_ERROR;
-    }
+    ngx_http_request_t               *r, *sr;
+    ngx_http_upstrand_conf_t         *upstrand;
+    ngx_connection_t                 *c;
 
-    upstreams = ctx->status_data.elts;
+    r = ctx->r;
+    c = r->connection;
+    upstrand = ctx->upstrand;
 
-    for (i = 0; i < ctx->status_data.nelts; i++) {
-        len += upstreams[i].upstream.len + 4;
+    /* the budget is checked against the number of recent requests */
+    if ((upstrand->hedges + 1) * 100 > upstrand->hedge_budget
+                                       * upstrand->hedge_requests)
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "upstrand \"%V\" hedge budget is exhausted",
+                       &upstrand->name);
+        return;
     }
 
-    v->data = (u_char *) "";
+    if (ngx_http_upstrand_clone_hop(r, ctx, &sr) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "failed to start hedged request in upstrand \"%V\"",
+                      &upstrand->name);
+        return;
+    }
 
-    if (len > 0) {
-        len -= 4;
+    upstrand->hedges++;
 
-        v->data = ngx_pnalloc(r->pool, len);
-        if (v->data == NULL) {
-            return NGX_ERROR;
-        }
+    ctx->hedge_r = sr;
+    ctx->hedging = 1;
 
-        for (i = 0; i < ctx->status_data.nelts; i++) {
-            ngx_memcpy(v->data + cur_len, upstreams[i].upstream.data,
-                       upstreams[i].upstream.len);
-            cur_len += upstreams[i].upstream.len;
-            if (i < ctx->status_data.nelts - 1) {
-                ngx_memcpy(v->data + cur_len, " -> ", 4);
-                cur_len += 4;
-            }
-        }
-    }
+    ngx_http_run_posted_requests(c);
+}
 
-    v->len = len;
-    v->valid = 1;
-    v->no_cacheable = 0;
-    v->not_found = 0;
 
-    return NGX_OK;
+static void
+ngx_http_upstrand_hedge_cleanup(void *data)
+{
+    ngx_http_upstrand_request_ctx_t  *ctx = data;
+
+    if (ctx->hedge.timer_set) {
+        ngx_del_timer(&ctx->hedge);
+    }
 }
 
 
-ngx_int_t
-ngx_http_get_upstrand_status_var_value(ngx_http_request_t *r,
-    ngx_http_variable_value_t *v, uintptr_t  data)
+static void
+ngx_http_upstrand_cancel_hop(ngx_http_request_t *r)
 {
-    ngx_uint_t                        i, len = 0, cur_len = 0;
-    ngx_http_upstrand_request_ctx_t  *ctx;
-    ngx_http_upstrand_status_data_t  *upstreams;
-    ngx_uint_t                        idx = data;
+    ngx_http_upstream_t  *u;
 
-    if (idx >= UPSTREAM_VARS_SIZE) {
-        return NGX_ERROR;
+    u = r->upstream;
+
+    if (u == NULL || u->cleanup == NULL) {
+        return;
     }
 
-    ctx = ngx_http_get_module_ctx(r->main, ngx_http_combined_upstreams_module);
-    if (ctx == NULL) {
-        return NGX_ERROR;
+    /* the upstream cleanup finalizes the request with NGX_DONE which releases
+     * a reference to the main request, the hop gets finalized normally after
+     * this, hence the extra reference */
+    r->main->count++;
+
+    (*u->cleanup)(r);
+
+    ngx_http_finalize_request(r, NGX_OK);
+}
+
+
+static void
+ngx_http_upstrand_discard_upstream_body(ngx_http_request_t *r,
+                                        ngx_http_upstream_t *u,
+                                        ngx_http_upstrand_request_common_ctx_t
+                                            *common)
+{
+    off_t  size;
+
+    /* the upstream finalizes the request right after sending the header when
+     * the request is header only; the original value gets restored in
+     * ngx_http_upstrand_check_upstream_vars() */
+    common->header_only = r->header_only;
+    common->header_only_saved = 1;
+    r->header_only = 1;
+
+    /* the connection can be kept alive if the whole body has already been
+     * read along with the header */
+    size = u->buffer.last - u->buffer.pos;
+
+    if (u->headers_in.content_length_n >= 0
+        && !u->headers_in.chunked
+        && !u->headers_in.connection_close
+        && size == u->headers_in.content_length_n)
+    {
+        u->keepalive = 1;
     }
+}
 
-    upstreams = ctx->status_data.elts;
 
-    for (i = 0; i < ctx->status_data.nelts; i++) {
-        len += upstreams[i].upstream.len + 4 + upstreams[i].data[idx].len;
+static void
+ngx_http_upstrand_check_upstream_vars(ngx_http_request_t *r, ngx_int_t  rc)
+{
+    ngx_http_upstrand_request_ctx_t          *ctx;
+    ngx_http_upstrand_subrequest_ctx_t       *sr_ctx;
+    ngx_http_upstrand_request_common_ctx_t   *common;
+    upstream_finalize_request_pt              finalize_request;
+
+    ctx = ngx_http_upstrand_get_request_ctx(r, &common);
+    if (ctx == NULL || common == NULL) {
+        return;
     }
 
-    v->data = (u_char *) "";
+    finalize_request = common->upstream_finalize_request;
 
-    if (len > 0) {
-        --len;
+    for ( ;; ) {
+        if (ngx_http_upstrand_capture_upstream_vars(r, ctx, common) != NGX_OK)
+        {
+            return;
+        }
 
-        v->data = ngx_pnalloc(r->pool, len);
-        if (v->data == NULL) {
-            return NGX_ERROR;
+        /* the failover subrequest which started a nested upstrand is also
+         * a hop of the parent upstrand */
+        if (r != ctx->r || ctx->parent == NULL) {
+            break;
         }
 
-        for (i = 0; i < ctx->status_data.nelts; i++) {
-            ngx_memcpy(v->data + cur_len, i == 0 ? "(" : " (", i == 0 ? 1 : 2);
-            cur_len += (i == 0 ? 1 : 2);
-            ngx_memcpy(v->data + cur_len, upstreams[i].upstream.data,
-                       upstreams[i].upstream.len);
-            cur_len += upstreams[i].upstream.len;
-            ngx_memcpy(v->data + cur_len, ") ", 2);
-            cur_len += 2;
-            ngx_memcpy(v->data + cur_len, upstreams[i].data[idx].data,
-                       upstreams[i].data[idx].len);
-            cur_len += upstreams[i].data[idx].len;
+        sr_ctx = ngx_http_get_upstrand_subrequest_ctx(r, ctx->parent->r);
+        if (sr_ctx == NULL) {
+            break;
         }
-    }
 
-    v->len = len;
-    v->valid = 1;
-    v->no_cacheable = 0;
-    v->not_found = 0;
+        ctx = ctx->parent;
+        common = &sr_ctx->common;
+    }
 
-    return NGX_OK;
+    if (finalize_request) {
+        finalize_request(r, rc);
+    }
 }
 
 
-char *
-ngx_http_upstrand_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+static ngx_int_t
+ngx_http_upstrand_capture_upstream_vars(ngx_http_request_t *r,
+                                ngx_http_upstrand_request_ctx_t *ctx,
+                                ngx_http_upstrand_request_common_ctx_t *common)
 {
-    ngx_http_combined_upstreams_main_conf_t  *mcf = conf;
+    ngx_uint_t                                i;
+    ngx_int_t                                 time;
+    ngx_http_combined_upstreams_main_conf_t  *mcf;
+    ngx_http_variable_value_t                *var;
+    ngx_http_upstrand_status_data_t          *status;
+
+    if (!common->status_data_set) {
+        return NGX_DECLINED;
+    }
+
+    status = (ngx_http_upstrand_status_data_t *) ctx->status_data.elts
+             + common->status_data;
+
+    mcf = ngx_http_get_module_main_conf(r, ngx_http_combined_upstreams_module);
+
+    for (i = 0; i < UPSTREAM_VARS_SIZE; i++) {
+        if (!(mcf->upstream_vars_captured & ((ngx_uint_t) 1 << i))) {
+            continue;
+        }
+
+        var = ngx_http_get_flushed_variable(r, mcf->upstream_var_index[i]);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (var->not_found || !var->valid || var->len == 0) {
+            continue;
+        }
+
+        status->data[i].len = var->len;
+
+        if (r == ctx->r) {
+            /* main request data must be always accessible */
+            status->data[i].data = var->data;
+        } else {
+            status->data[i].data = ngx_pnalloc(ctx->r->pool, var->len);
+            if (status->data[i].data == NULL) {
+                return NGX_ERROR;
+            }
+            ngx_memcpy(status->data[i].data, var->data, var->len);
+        }
+    }
+
+    ctx->status_gen++;
+
+    if ((ctx->upstrand->order == ngx_http_upstrand_order_least_time
+         || ctx->upstrand->outlier_detection)
+        && common->upstream != NULL)
+    {
+        ngx_http_upstrand_feed_header_time(ctx->upstrand, common->upstream,
+                                           common->failed,
+                                &status->data[UPSTREAM_HEADER_TIME_VAR]);
+
+        if (ctx->upstrand->outlier_detection) {
+            ngx_http_upstrand_outlier_check(r->pool, ctx->upstrand);
+        }
+    }
+
+    if (common->upstream != NULL) {
+        ngx_http_upstrand_hist_reset(ctx->upstrand);
+
+        time = ngx_http_upstrand_parse_time(
+                                    &status->data[UPSTREAM_HEADER_TIME_VAR]);
+        if (time != NGX_ERROR) {
+            ngx_http_upstrand_hist_add(
+                        &common->upstream->state->header_time_hist, time);
+        }
+
+        time = ngx_http_upstrand_parse_time(
+                                    &status->data[UPSTREAM_RESPONSE_TIME_VAR]);
+        if (time != NGX_ERROR) {
+            ngx_http_upstrand_hist_add(
+                        &common->upstream->state->response_time_hist, time);
+        }
+    }
+
+    if (common->inflight) {
+        ngx_http_upstrand_inflight_add(common->upstream, -1);
+        common->inflight = 0;
+    }
+
+    if (common->header_only_saved) {
+        r->header_only = common->header_only;
+        common->header_only_saved = 0;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstrand_start_cursors(ngx_http_upstrand_conf_t *upstrand,
+                                ngx_int_t *start_cur, ngx_int_t *start_bcur)
+{
+    ngx_uint_t  u_nelts, bu_nelts;
+
+    u_nelts = upstrand->upstreams.nelts;
+    bu_nelts = upstrand->b_upstreams.nelts;
+
+    *start_cur = 0;
+    *start_bcur = 0;
+
+    /* the hash and least_time orders set the start cursors in member_orders()
+     * as they depend on the request or on the current header times */
+    if (upstrand->order == ngx_http_upstrand_order_hash
+        || upstrand->order == ngx_http_upstrand_order_least_time)
+    {
+        return;
+    }
+
+    if (upstrand->order == ngx_http_upstrand_order_p2c) {
+        if (u_nelts > 0) {
+            *start_cur = ngx_http_upstrand_p2c(&upstrand->upstreams);
+        }
+        if (bu_nelts > 0) {
+            *start_bcur = ngx_http_upstrand_p2c(&upstrand->b_upstreams);
+        }
+
+    /* the failover order after the weighted start is the normal rotation */
+    } else if (upstrand->weighted) {
+        if (upstrand->shm != NULL
+            && upstrand->weights_gen != upstrand->shm->weights_gen)
+        {
+            ngx_http_upstrand_reload_weights(upstrand);
+        }
+
+        if (u_nelts > 0) {
+            *start_cur = ngx_http_upstrand_alias_sample(upstrand->alias,
+                                                        u_nelts);
+        }
+        if (bu_nelts > 0) {
+            *start_bcur = ngx_http_upstrand_alias_sample(upstrand->b_alias,
+                                                         bu_nelts);
+        }
+
+    } else if (upstrand->order_per_request &&
+               upstrand->order == ngx_http_upstrand_order_start_random)
+    {
+        if (u_nelts > 0) {
+            *start_cur = ngx_http_upstrand_random(u_nelts);
+        }
+        if (bu_nelts > 0) {
+            *start_bcur = ngx_http_upstrand_random(bu_nelts);
+        }
+
+    } else if (upstrand->order_global) {
+        /* the cursors are shared between all workers, only the cycle that
+         * gets started is advanced */
+        if (u_nelts > 0) {
+            *start_cur = (ngx_atomic_uint_t)
+                    ngx_atomic_fetch_add(&upstrand->shm->cur, 1) % u_nelts;
+            if (bu_nelts > 0) {
+                *start_bcur = upstrand->shm->b_cur % bu_nelts;
+            }
+        } else if (bu_nelts > 0) {
+            *start_bcur = (ngx_atomic_uint_t)
+                    ngx_atomic_fetch_add(&upstrand->shm->b_cur, 1) % bu_nelts;
+        }
+
+    } else {
+        *start_cur = upstrand->cur;
+        *start_bcur = upstrand->b_cur;
+
+        if (!upstrand->order_per_request) {
+            if (u_nelts > 0) {
+                upstrand->cur = (upstrand->cur + 1) % u_nelts;
+            } else if (bu_nelts > 0) {
+                upstrand->b_cur = (upstrand->b_cur + 1) % bu_nelts;
+            }
+        }
+    }
+
+    if (upstrand->slow_start) {
+        if (u_nelts > 0) {
+            *start_cur = ngx_http_upstrand_warm_start(&upstrand->upstreams,
+                                                      *start_cur);
+        }
+        if (bu_nelts > 0) {
+            *start_bcur = ngx_http_upstrand_warm_start(&upstrand->b_upstreams,
+                                                       *start_bcur);
+        }
+    }
+}
+
+
+/* a recovering upstream rejected as the start passes its turn to the next
+ * one, it still takes part in the failover cycle */
+
+static ngx_int_t
+ngx_http_upstrand_warm_start(ngx_array_t *upstreams, ngx_int_t start)
+{
+    ngx_uint_t                          i, n;
+    ngx_http_upstrand_upstream_conf_t  *elts = upstreams->elts;
+
+    n = upstreams->nelts;
+
+    for (i = 0; i < n; i++) {
+        if (ngx_http_upstrand_is_warm(&elts[(start + i) % n])) {
+            return (start + i) % n;
+        }
+    }
+
+    return start;
+}
+
+
+static ngx_uint_t
+ngx_http_upstrand_p2c(ngx_array_t *upstreams)
+{
+    ngx_uint_t                          i, j, n;
+    time_t                              now;
+    ngx_http_upstrand_upstream_conf_t  *elts = upstreams->elts;
+
+    n = upstreams->nelts;
+
+    if (n == 1) {
+        return 0;
+    }
+
+    /* two distinct random choices */
+    i = ngx_http_upstrand_random(n);
+    j = ngx_http_upstrand_random(n - 1);
+    if (j >= i) {
+        j++;
+    }
+
+    now = ngx_time();
+
+    /* half-open upstreams are not probed here, this is done when walking
+     * through the cycle */
+    if (!ngx_http_upstrand_is_available(&elts[i], now)) {
+        return j;
+    }
+
+    if (!ngx_http_upstrand_is_available(&elts[j], now)) {
+        return i;
+    }
+
+    return elts[j].state->inflight < elts[i].state->inflight ? j : i;
+}
+
+
+static ngx_int_t
+ngx_http_upstrand_inflight_start(ngx_http_upstrand_request_ctx_t *ctx,
+                                 ngx_http_upstrand_request_common_ctx_t *common)
+{
+    ngx_pool_cleanup_t                       *cln;
+    ngx_http_upstrand_request_common_ctx_t  **hop;
+
+    /* hops that have not reached the upstream finalizer are released when
+     * the request terminates */
+    if (ctx->inflight.elts == NULL) {
+        if (ngx_array_init(&ctx->inflight, ctx->r->pool, 2,
+                           sizeof(ngx_http_upstrand_request_common_ctx_t *))
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        cln = ngx_pool_cleanup_add(ctx->r->pool, 0);
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+
+        cln->handler = ngx_http_upstrand_inflight_cleanup;
+        cln->data = ctx;
+    }
+
+    hop = ngx_array_push(&ctx->inflight);
+    if (hop == NULL) {
+        return NGX_ERROR;
+    }
+
+    *hop = common;
+
+    common->inflight = 1;
+    ngx_http_upstrand_inflight_add(common->upstream, 1);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstrand_inflight_cleanup(void *data)
+{
+    ngx_http_upstrand_request_ctx_t  *ctx = data;
+
+    ngx_uint_t                                i;
+    ngx_http_upstrand_request_common_ctx_t  **hops;
+
+    hops = ctx->inflight.elts;
+
+    for (i = 0; i < ctx->inflight.nelts; i++) {
+        if (hops[i]->inflight) {
+            ngx_http_upstrand_inflight_add(hops[i]->upstream, -1);
+            hops[i]->inflight = 0;
+        }
+    }
+}
+
+
+static void
+ngx_http_upstrand_pass_inflight_cleanup(void *data)
+{
+    ngx_http_upstrand_pass_peer_data_t  *pd = data;
+
+    if (pd->inflight != NULL) {
+        ngx_http_upstrand_inflight_add(pd->inflight, -1);
+        pd->inflight = NULL;
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstrand_member_orders(ngx_http_request_t *r,
+                                ngx_http_upstrand_conf_t *upstrand,
+                                ngx_int_t *start_cur, ngx_int_t *start_bcur,
+                                ngx_http_upstrand_order_t **u_order,
+                                ngx_http_upstrand_order_t **bu_order)
+{
+    ngx_str_t   key;
+    uint32_t    hash;
+
+    if (upstrand->order == ngx_http_upstrand_order_least_time) {
+        if (ngx_http_upstrand_least_time_order(r->pool, &upstrand->upstreams,
+                                               upstrand->slow_start,
+                                               start_cur, u_order)
+                != NGX_OK
+            || ngx_http_upstrand_least_time_order(r->pool,
+                                                  &upstrand->b_upstreams,
+                                                  upstrand->slow_start,
+                                                  start_bcur, bu_order)
+                != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        return NGX_OK;
+    }
+
+    if (upstrand->order != ngx_http_upstrand_order_hash) {
+        return NGX_OK;
+    }
+
+    if (ngx_http_complex_value(r, upstrand->hash_key, &key) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    hash = ngx_crc32_long(key.data, key.len);
+
+    if (ngx_http_upstrand_hash_order(r->pool, upstrand->ring,
+                                     upstrand->upstreams.nelts, hash,
+                                     start_cur, u_order)
+            != NGX_OK
+        || ngx_http_upstrand_hash_order(r->pool, upstrand->b_ring,
+                                        upstrand->b_upstreams.nelts, hash,
+                                        start_bcur, bu_order)
+            != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstrand_hash_order(ngx_pool_t *pool,
+                             ngx_http_upstrand_hash_ring_t *ring,
+                             ngx_uint_t nelts, uint32_t hash, ngx_int_t *start,
+                             ngx_http_upstrand_order_t **order)
+{
+    ngx_uint_t                  lo, hi, mid;
+    ngx_http_upstrand_order_t  *o;
+
+    if (nelts == 0) {
+        return NGX_OK;
+    }
+
+    /* without the ring, keys of a skipped upstream move to the next one, and
+     * this is the normal rotation */
+    if (ring == NULL) {
+        *start = hash % nelts;
+        return NGX_OK;
+    }
+
+    o = ngx_http_upstrand_order_alloc(pool, nelts);
+    if (o == NULL) {
+        return NGX_ERROR;
+    }
+
+    lo = 0;
+    hi = ring->npoints;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+
+        if (ring->points[mid].hash < hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    o->points = ring->points;
+    o->npoints = ring->npoints;
+    o->point = lo % ring->npoints;
+
+    *order = o;
+
+    return NGX_OK;
+}
+
+
+/* the failover order goes from faster to slower upstreams, a recovering
+ * upstream rejected as the start passes its turn to the next one in the order
+ * and still takes part in the failover */
+
+static ngx_int_t
+ngx_http_upstrand_least_time_order(ngx_pool_t *pool, ngx_array_t *upstreams,
+                                   ngx_uint_t slow_start, ngx_int_t *start,
+                                   ngx_http_upstrand_order_t **order)
+{
+    ngx_uint_t                  i;
+    ngx_http_upstrand_order_t  *o;
+
+    if (upstreams->nelts == 0) {
+        return NGX_OK;
+    }
+
+    o = ngx_http_upstrand_order_alloc(pool, upstreams->nelts);
+    if (o == NULL) {
+        return NGX_ERROR;
+    }
+
+    o->upstreams = upstreams->elts;
+    o->now = ngx_time();
+
+    *order = o;
+
+    if (!slow_start) {
+        return NGX_OK;
+    }
+
+    for (i = 0; i < upstreams->nelts; i++) {
+        if (ngx_http_upstrand_is_warm(
+                            ngx_http_upstrand_member(o->upstreams, o, i)))
+        {
+            *start = i;
+            break;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_http_upstrand_order_t *
+ngx_http_upstrand_order_alloc(ngx_pool_t *pool, ngx_uint_t nelts)
+{
+    size_t                      size;
+    ngx_http_upstrand_order_t  *o;
+
+    size = (nelts + (8 * sizeof(uintptr_t) - 1)) / (8 * sizeof(uintptr_t))
+           * sizeof(uintptr_t);
+
+    o = ngx_palloc(pool, sizeof(ngx_http_upstrand_order_t)
+                         + nelts * sizeof(ngx_uint_t) + size);
+    if (o == NULL) {
+        return NULL;
+    }
+
+    o->points = NULL;
+    o->npoints = 0;
+    o->point = 0;
+    o->upstreams = NULL;
+    o->nelts = nelts;
+    o->now = 0;
+    o->nresolved = 0;
+    o->elts = (ngx_uint_t *) (o + 1);
+    o->visited = (uintptr_t *) (o->elts + nelts);
+    ngx_memzero(o->visited, size);
+
+    return o;
+}
+
+
+static void
+ngx_http_upstrand_feed_header_time(ngx_http_upstrand_conf_t *upstrand,
+                                   ngx_http_upstrand_upstream_conf_t *u,
+                                   ngx_uint_t failed, ngx_str_t *value)
+{
+    ngx_int_t  sample;
+
+    if (failed) {
+        if (upstrand->order == ngx_http_upstrand_order_least_time) {
+            ngx_http_upstrand_update_header_time(u, -1);
+        }
+        if (upstrand->outlier_detection) {
+            ngx_http_upstrand_outlier_record(u, 1, 0);
+        }
+        return;
+    }
+
+    sample = ngx_http_upstrand_parse_time(value);
+
+    if (sample == NGX_ERROR) {
+        return;
+    }
+
+    if (upstrand->order == ngx_http_upstrand_order_least_time) {
+        ngx_http_upstrand_update_header_time(u, sample * 1000);
+    }
+
+    if (upstrand->outlier_detection) {
+        ngx_http_upstrand_outlier_record(u, 0, sample);
+    }
+}
+
+
+/* returns milliseconds */
+
+static ngx_int_t
+ngx_http_upstrand_parse_time(ngx_str_t *value)
+{
+    u_char  *p, *last;
+
+    if (value->len == 0) {
+        return NGX_ERROR;
+    }
+
+    /* the value lists all peers tried in the upstream, the last of them is
+     * the one that has responded */
+    last = value->data + value->len;
+
+    for (p = last; p > value->data && *(p - 1) != ' '; p--) {
+        /* void */
+    }
+
+    return ngx_atofp(p, last - p, 3);
+}
+
+
+static void
+ngx_http_upstrand_hist_reset(ngx_http_upstrand_conf_t *upstrand)
+{
+    time_t                              now;
+    ngx_uint_t                          i, k;
+    ngx_atomic_uint_t                   last;
+    ngx_array_t                        *upstreams;
+    ngx_http_upstrand_upstream_conf_t  *elts;
+
+    if (upstrand->histogram_reset == 0) {
+        return;
+    }
+
+    now = ngx_time();
+    last = upstrand->counters->hist_reset;
+
+    if (now - (time_t) last < upstrand->histogram_reset
+        || !ngx_atomic_cmp_set(&upstrand->counters->hist_reset, last,
+                               (ngx_atomic_uint_t) now))
+    {
+        return;
+    }
+
+    /* samples which are being added concurrently may get lost */
+    ngx_memzero((void *) &upstrand->counters->hops_hist,
+                sizeof(ngx_http_upstrand_histogram_t));
+
+    for (k = 0; k < 2; k++) {
+        upstreams = k == 0 ? &upstrand->upstreams : &upstrand->b_upstreams;
+        elts = upstreams->elts;
+
+        for (i = 0; i < upstreams->nelts; i++) {
+            ngx_memzero((void *) &elts[i].state->header_time_hist,
+                        sizeof(ngx_http_upstrand_histogram_t));
+            ngx_memzero((void *) &elts[i].state->response_time_hist,
+                        sizeof(ngx_http_upstrand_histogram_t));
+        }
+    }
+}
+
+
+/* outliers are searched at most once a second in all workers */
+
+static void
+ngx_http_upstrand_outlier_check(ngx_pool_t *pool,
+                                ngx_http_upstrand_conf_t *upstrand)
+{
+    time_t             now;
+    ngx_atomic_uint_t  last;
+
+    now = ngx_time();
+
+    if (upstrand->shm != NULL) {
+        last = upstrand->shm->outlier_check;
+
+        if ((time_t) last >= now
+            || !ngx_atomic_cmp_set(&upstrand->shm->outlier_check, last,
+                                   (ngx_atomic_uint_t) now))
+        {
+            return;
+        }
+
+    } else {
+        if (upstrand->outlier_check >= now) {
+            return;
+        }
+
+        upstrand->outlier_check = now;
+    }
+
+    ngx_http_upstrand_outlier_sweep(pool, upstrand, &upstrand->upstreams, now);
+    ngx_http_upstrand_outlier_sweep(pool, upstrand, &upstrand->b_upstreams,
+                                    now);
+}
+
+
+static void
+ngx_http_upstrand_outlier_sweep(ngx_pool_t *pool,
+                                ngx_http_upstrand_conf_t *upstrand,
+                                ngx_array_t *upstreams, time_t now)
+{
+    ngx_uint_t                          i, n, nvalid, nejected, max_ejected;
+    ngx_uint_t                          median_errors, median_latency;
+    ngx_uint_t                         *errors, *latency, *valid;
+    ngx_uint_t                         *sorted_errors, *sorted_latency;
+    ngx_uint_t                          outlier;
+    ngx_atomic_uint_t                   ejections;
+    ngx_http_upstrand_upstream_conf_t  *elts = upstreams->elts;
+    ngx_http_upstream_main_conf_t      *umcf;
+    ngx_http_upstream_srv_conf_t      **uscfp;
+
+    n = upstreams->nelts;
+
+    if (n < 2) {
+        return;
+    }
+
+    errors = ngx_palloc(pool, 5 * n * sizeof(ngx_uint_t));
+    if (errors == NULL) {
+        return;
+    }
+
+    latency = errors + n;
+    valid = latency + n;
+
+    /* copies of the values of the judged upstreams get sorted when searching
+     * for the medians */
+    sorted_errors = valid + n;
+    sorted_latency = sorted_errors + n;
+
+    nvalid = 0;
+    nejected = 0;
+
+    for (i = 0; i < n; i++) {
+        valid[i] = 0;
+
+        if ((time_t) elts[i].state->ejected_until > now) {
+            nejected++;
+            continue;
+        }
+
+        if (ngx_http_upstrand_outlier_stats(&elts[i], &errors[i], &latency[i])
+            == NGX_OK)
+        {
+            valid[i] = 1;
+            sorted_errors[nvalid] = errors[i];
+            sorted_latency[nvalid] = latency[i];
+            nvalid++;
+        }
+    }
+
+    if (nvalid < 2) {
+        return;
+    }
+
+    median_errors = ngx_http_upstrand_median(sorted_errors, nvalid);
+    median_latency = ngx_http_upstrand_median(sorted_latency, nvalid);
+
+    umcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                               ngx_http_upstream_module);
+    uscfp = umcf->upstreams.elts;
+
+    max_ejected = ngx_max(n * upstrand->outlier_max_ejected / 100, 1);
+
+    for (i = 0; i < n; i++) {
+        if (!valid[i]) {
+            continue;
+        }
+
+        outlier = 0;
+
+        if (upstrand->outlier_errors > 0
+            && errors[i] >= UPSTRAND_OUTLIER_MIN_ERRORS
+            && errors[i] > upstrand->outlier_errors * median_errors)
+        {
+            outlier = 1;
+        }
+
+        if (upstrand->outlier_latency > 0
+            && latency[i] > upstrand->outlier_latency
+                                * ngx_max(median_latency, 1))
+        {
+            outlier = 1;
+        }
+
+        ejections = elts[i].state->ejections;
+
+        if (!outlier) {
+            /* a healthy upstream gradually earns back short ejections */
+            if (ejections > 0) {
+                (void) ngx_atomic_cmp_set(&elts[i].state->ejections,
+                                          ejections, ejections - 1);
+            }
+            continue;
+        }
+
+        if (nejected >= max_ejected) {
+            continue;
+        }
+
+        if (ejections < UPSTRAND_OUTLIER_MAX_EJECTIONS) {
+            (void) ngx_atomic_fetch_add(&elts[i].state->ejections, 1);
+            ejections++;
+        }
+
+        elts[i].state->ejected_until = (ngx_atomic_uint_t)
+                (now + upstrand->outlier_interval * (time_t) ejections);
+
+        /* the upstream gets judged by fresh outcomes after the ejection */
+        ngx_memzero((void *) elts[i].state->outcomes,
+                    sizeof(elts[i].state->outcomes));
+
+        ngx_http_upstrand_slow_start(&elts[i], (ngx_msec_t)
+                    (upstrand->outlier_interval * (time_t) ejections * 1000));
+
+        nejected++;
+
+        ngx_log_error(NGX_LOG_WARN, pool->log, 0,
+                      "upstream \"%V\" in upstrand \"%V\" is ejected as an "
+                      "outlier for %T seconds", &uscfp[elts[i].index]->host,
+                      &upstrand->name,
+                      upstrand->outlier_interval * (time_t) ejections);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstrand_outlier_stats(ngx_http_upstrand_upstream_conf_t *u,
+                                ngx_uint_t *errors, ngx_uint_t *latency)
+{
+    ngx_uint_t         i, j, n, failures, nlatency;
+    ngx_msec_t         times[UPSTRAND_OUTLIER_WINDOW], time;
+    ngx_atomic_uint_t  outcome;
+
+    n = 0;
+    failures = 0;
+    nlatency = 0;
+
+    for (i = 0; i < UPSTRAND_OUTLIER_WINDOW; i++) {
+        outcome = u->state->outcomes[i];
+
+        if (outcome == 0) {
+            continue;
+        }
+
+        n++;
+
+        if (outcome & 1) {
+            failures++;
+            continue;
+        }
+
+        /* insertion sort of the few header times */
+        time = outcome >> 2;
+
+        for (j = nlatency; j > 0 && times[j - 1] > time; j--) {
+            times[j] = times[j - 1];
+        }
+
+        times[j] = time;
+        nlatency++;
+    }
+
+    if (n < UPSTRAND_OUTLIER_MIN_SAMPLES) {
+        return NGX_DECLINED;
+    }
+
+    *errors = failures * 1000 / n;
+
+    /* the 95th percentile */
+    *latency = nlatency == 0 ? 0 : times[(nlatency * 95 - 1) / 100];
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_http_upstrand_median(ngx_uint_t *values, ngx_uint_t n)
+{
+    ngx_qsort(values, n, sizeof(ngx_uint_t), ngx_http_upstrand_cmp_uint);
+
+    return values[(n - 1) / 2];
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_upstrand_cmp_uint(const void *one, const void *two)
+{
+    ngx_uint_t  first, second;
+
+    first = *(ngx_uint_t *) one;
+    second = *(ngx_uint_t *) two;
+
+    return (first > second) - (first < second);
+}
+
+
+static ngx_int_t
+ngx_http_upstrand_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v,
+    uintptr_t data)
+{
+    ngx_http_upstrand_conf_t  *upstrand = (ngx_http_upstrand_conf_t *) data;
+
+    ngx_uint_t                                i;
+    ngx_http_combined_upstreams_loc_conf_t   *lcf;
+    ngx_http_upstrand_request_ctx_t          *ctx, *parent = NULL;
+    ngx_http_upstrand_subrequest_ctx_t       *sr_ctx, *nest = NULL;
+    ngx_http_upstrand_request_common_ctx_t   *common;
+    ngx_http_upstrand_upstream_conf_t        *u_elts, *bu_elts;
+    ngx_uint_t                                u_nelts, bu_nelts;
+    ngx_http_upstream_main_conf_t            *umcf;
+    ngx_http_upstream_srv_conf_t            **uscfp;
+    ngx_http_upstream_conf_t                 *u;
+    time_t                                    now;
+    ngx_http_upstrand_walk_t                  w;
+
+    u_elts = upstrand->upstreams.elts;
+    bu_elts = upstrand->b_upstreams.elts;
+    u_nelts = upstrand->upstreams.nelts;
+    bu_nelts = upstrand->b_upstreams.nelts;
+
+    ctx = ngx_http_upstrand_get_request_ctx(r, &common);
+
+    if (ctx != NULL && r != ctx->r
+        && ngx_http_get_module_ctx(r, ngx_http_combined_upstreams_module)
+            == NULL)
+    {
+        /* a new hop belongs to the upstrand of the request it was cloned
+         * from */
+        parent = ngx_http_upstrand_get_request_ctx(r->parent, &common);
+        if (parent != NULL && common != NULL) {
+            ctx = parent;
+        }
+        parent = NULL;
+        common = NULL;
+    }
+
+    if (ctx != NULL
+        && (ctx->upstrand->name.len != upstrand->name.len
+            || ngx_strncmp(ctx->upstrand->name.data, upstrand->name.data,
+                           upstrand->name.len) != 0))
+    {
+        /* a failover subrequest may start a nested upstrand */
+        if (common != NULL && common->intercepted && r != ctx->r) {
+            nest = ngx_http_get_upstrand_subrequest_ctx(r, ctx->r);
+        }
+
+        if (nest == NULL || nest->nested != NULL) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "accessing multiple upstrand variables in a single "
+                          "request is prohibited (original upstrand is \"%V\", "
+                          "new upstrand is \"%V\")",
+                          &ctx->upstrand->name, &upstrand->name);
+            return NGX_ERROR;
+        }
+
+        parent = ctx;
+        ctx = NULL;
+
+    } else if (common != NULL) {
+        goto was_accessed;
+    }
+
+    /* location must be protected from interceptions by error_page,
+     * this is achieved by setting error_page flag for the request */
+    r->error_page = 1;
+
+    lcf = ngx_http_get_module_loc_conf(r, ngx_http_combined_upstreams_module);
+
+    if (!lcf->upstrand_gw_modules_checked) {
+        for (i = 0; i < UPSTRAND_EFFECTIVE_GW_MODULES_SIZE; i++) {
+            /* FIXME: this is a dirty hack: getting proxy module's location
+             * configuration as an upstream configuration is safe only if the
+             * upstream configuration is the first field of the location
+             * configuration; fortunately, this is true for proxy, uwsgi,
+             * fastcgi, scgi, and grpc modules */
+            u = r->loc_conf[ngx_http_upstrand_gw_modules[i]];
+            /* location must be protected against X-Accel-Redirect headers */
+            u->ignore_headers |= NGX_HTTP_UPSTREAM_IGN_XA_REDIRECT;
+        }
+        lcf->upstrand_gw_modules_checked = 1;
+    }
+
+    if (ctx == NULL) {
+        ctx = ngx_pcalloc(r->main->pool,
+                          sizeof(ngx_http_upstrand_request_ctx_t));
+        if (ctx == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx->r = r;
+        ctx->upstrand = upstrand;
+        ctx->parent = parent;
+        if (ngx_array_init(&ctx->status_data, r->pool, 1,
+                           sizeof(ngx_http_upstrand_status_data_t)) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+        ngx_http_upstrand_start_cursors(upstrand, &ctx->start_cur,
+                                        &ctx->start_bcur);
+        if (ngx_http_upstrand_member_orders(r, upstrand, &ctx->start_cur,
+                                            &ctx->start_bcur, &ctx->u_order,
+                                            &ctx->bu_order)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+        ctx->cur = ctx->start_cur;
+        ctx->b_cur = ctx->start_bcur;
+
+        if (u_nelts == 0) {
+            ctx->backup_cycle = 1;
+        }
+
+        /* ctx->start_time will be reset to the value of the upstream's first
+         * peer's start_time in ngx_http_upstrand_response_header_filter() */
+        ctx->start_time = ngx_current_msec;
+
+        ngx_http_upstrand_count(&upstrand->counters->requests);
+
+        if (nest != NULL) {
+            nest->nested = ctx;
+
+        } else {
+            ngx_http_set_ctx(r->main, ctx, ngx_http_combined_upstreams_module);
+        }
+
+        if (upstrand->order == ngx_http_upstrand_order_broadcast) {
+            if (ngx_http_upstrand_broadcast_start(r, ctx) != NGX_OK) {
+                return NGX_ERROR;
+            }
+            common = &ctx->common;
+            goto done;
+        }
+
+    } else if (r != ctx->r) {
+
+        sr_ctx = ngx_pcalloc(r->pool,
+                             sizeof(ngx_http_upstrand_subrequest_ctx_t));
+        if (sr_ctx == NULL) {
+            return NGX_ERROR;
+        }
+        ngx_http_set_ctx(r, sr_ctx, ngx_http_combined_upstreams_module);
+        sr_ctx->ctx = ctx;
+
+        if (ctx->backup_cycle) {
+            if (bu_nelts > 0) {
+                ctx->b_cur = (ctx->b_cur + 1) % bu_nelts;
+            }
+        } else if (u_nelts > 0) {
+            ctx->cur = (ctx->cur + 1) % u_nelts;
+            if (ctx->cur == ctx->start_cur) {
+                ctx->backup_cycle = 1;
+            }
+        }
+    }
+
+    w.u_elts = u_elts;
+    w.bu_elts = bu_elts;
+    w.u_order = ctx->u_order;
+    w.bu_order = ctx->bu_order;
+    w.u_nelts = u_nelts;
+    w.bu_nelts = bu_nelts;
+    w.start_cur = ctx->start_cur;
+    w.start_bcur = ctx->start_bcur;
+    w.cur = ctx->cur;
+    w.b_cur = ctx->b_cur;
+    w.backup_cycle = ctx->backup_cycle;
+    w.all_blacklisted = ctx->all_blacklisted;
+    w.force_last = 0;
+
+    now = ngx_time();
+
+    ngx_http_upstrand_walk(&w, now);
+
+    ctx->cur = w.cur;
+    ctx->b_cur = w.b_cur;
+    ctx->backup_cycle = w.backup_cycle;
+    ctx->all_blacklisted = w.all_blacklisted;
+
+    if (ctx->all_blacklisted) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "all upstreams in upstrand \"%V\" are blacklisted, "
+                      "reopening the least recently failed one",
+                      &upstrand->name);
+
+        ngx_http_upstrand_count(&upstrand->counters->all_blacklisted);
+
+        /* this hop is the last one as all the upstreams have been walked */
+        if (bu_nelts > 0) {
+            ctx->b_cur = ngx_http_upstrand_least_recently_failed(bu_elts,
+                                                    ctx->bu_order, bu_nelts);
+            ngx_http_upstrand_breaker_reopen(
+                ngx_http_upstrand_member(bu_elts, ctx->bu_order, ctx->b_cur),
+                now);
+        } else {
+            ctx->cur = ngx_http_upstrand_least_recently_failed(u_elts,
+                                                    ctx->u_order, u_nelts);
+            ngx_http_upstrand_breaker_reopen(
+                ngx_http_upstrand_member(u_elts, ctx->u_order, ctx->cur),
+                now);
+        }
+    }
+
+    if (r != ctx->r) {
+        sr_ctx = ngx_http_get_upstrand_subrequest_ctx(r, ctx->r);
+        if (sr_ctx == NULL) {
+            return NGX_ERROR;
+        }
+    }
+    common = r == ctx->r ? &ctx->common : &sr_ctx->common;
+
+    if (w.force_last ||
+        (bu_nelts == 0 &&
+         (u_nelts == 0
+          || (ctx->cur + 1) % u_nelts == (ngx_uint_t) ctx->start_cur)) ||
+        (ctx->backup_cycle &&
+         (bu_nelts == 0
+          || (ctx->b_cur + 1) % bu_nelts == (ngx_uint_t) ctx->start_bcur)))
+    {
+        common->last = 1;
+        ctx->last_spawned = 1;
+    }
+
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+    uscfp = umcf->upstreams.elts;
+
+    if (ctx->backup_cycle && bu_nelts > 0) {
+        common->upstream = ngx_http_upstrand_member(bu_elts, ctx->bu_order,
+                                                    ctx->b_cur);
+    } else {
+        common->upstream = ngx_http_upstrand_member(u_elts, ctx->u_order,
+                                                    ctx->cur);
+    }
+    common->upstream_name = uscfp[common->upstream->index]->host;
+
+    if (upstrand->order == ngx_http_upstrand_order_p2c
+        && ngx_http_upstrand_inflight_start(ctx, common) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (r == ctx->r) {
+        upstrand->hedge_requests++;
+
+        /* let the counters decay to keep the budget adaptive */
+        if (upstrand->hedge_requests > 65536) {
+            upstrand->hedge_requests /= 2;
+            upstrand->hedges /= 2;
+        }
+
+        if (upstrand->hedge_after && !common->last
+            && !r->request_body_no_buffering
+            && (!(r->method & (NGX_HTTP_POST|NGX_HTTP_LOCK|NGX_HTTP_PATCH))
+                || upstrand->retry_non_idempotent))
+        {
+            ngx_pool_cleanup_t  *cln;
+
+            cln = ngx_pool_cleanup_add(r->pool, 0);
+            if (cln == NULL) {
+                return NGX_ERROR;
+            }
+
+            cln->handler = ngx_http_upstrand_hedge_cleanup;
+            cln->data = ctx;
+
+            ctx->hedge.handler = ngx_http_upstrand_hedge_handler;
+            ctx->hedge.data = ctx;
+            ctx->hedge.log = r->connection->log;
+
+            ngx_add_timer(&ctx->hedge, upstrand->hedge_after);
+        }
+    }
+
+    goto done;
+
+was_accessed:
+
+    if (r != ctx->r) {
+        sr_ctx = ngx_http_get_upstrand_subrequest_ctx(r, ctx->r);
+        if (sr_ctx == NULL) {
+            return NGX_ERROR;
+        }
+    }
+    common = r == ctx->r ? &ctx->common : &sr_ctx->common;
+
+done:
+
+    ctx->cur_upstream = common->upstream_name;
+
+    v->valid = 1;
+    v->not_found = 0;
+    v->len = common->upstream_name.len;
+    v->data = common->upstream_name.data;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_get_dynamic_upstrand_value(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t  data)
+{
+    ngx_uint_t                                i;
+    ngx_str_t                                 name;
+    ngx_array_t                              *upstrand_cands;
+    ngx_http_upstrand_conf_t                 *upstrand;
+    ngx_http_upstrand_var_handle_t           *upstrand_cands_elts;
+    ngx_http_variable_value_t                *found;
+    ngx_http_combined_upstreams_loc_conf_t   *lcf;
+    ngx_http_combined_upstreams_main_conf_t  *mcf;
+
+    lcf = ngx_http_get_module_loc_conf(r, ngx_http_combined_upstreams_module);
+
+    if (lcf->dyn_upstrand_slots == NULL
+        || lcf->dyn_upstrand_slots[data] == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    mcf = ngx_http_get_module_main_conf(r, ngx_http_combined_upstreams_module);
+
+    upstrand_cands = lcf->dyn_upstrand_slots[data];
+    upstrand_cands_elts = upstrand_cands->elts;
+
+    for (i = 0; i < upstrand_cands->nelts; i++) {
+        if (upstrand_cands_elts[i].index == NGX_ERROR) {
+            name = upstrand_cands_elts[i].key;
+        } else {
+            found = ngx_http_get_indexed_variable(r,
+                                                upstrand_cands_elts[i].index);
+            if (found == NULL || found->len == 0) {
+                continue;
+            }
+
+            name.len = found->len;
+            name.data = found->data;
+        }
+
+        upstrand = ngx_http_upstrand_find(r, mcf, &name);
+
+        if (upstrand == NULL) {
+            v->len = 0;
+            v->data = (u_char *) "";
+            v->valid = 0;
+            v->no_cacheable = 0;
+            v->not_found = 1;
+            return NGX_OK;
+        }
+
+        return ngx_http_upstrand_variable(r, v, (uintptr_t) upstrand);
+    }
+
+    v->len = 0;
+    v->data = (u_char *) "";
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    return NGX_OK;
+}
+
+
+/* the upstrand names in the hash are lowercase, long candidates cannot match
+ * any of them */
+
+static ngx_http_upstrand_conf_t *
+ngx_http_upstrand_find(ngx_http_request_t *r,
+    ngx_http_combined_upstreams_main_conf_t *mcf, ngx_str_t *name)
+{
+    u_char      *low, buf[UPSTRAND_NAME_BUF_SIZE];
+    ngx_uint_t   key;
+
+    if (name->len > mcf->upstrand_name_max_len) {
+        return NULL;
+    }
+
+    low = buf;
+
+    if (name->len > UPSTRAND_NAME_BUF_SIZE) {
+        low = ngx_pnalloc(r->pool, name->len);
+        if (low == NULL) {
+            return NULL;
+        }
+    }
+
+    key = ngx_hash_strlow(low, name->data, name->len);
+
+    return ngx_hash_find(&mcf->upstrands_hash, key, low, name->len);
+}
+
+
+ngx_int_t
+ngx_http_get_upstrand_path_var_value(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t  data)
+{
+    size_t                                   len;
+    ngx_http_upstrand_request_ctx_t         *ctx;
+    ngx_http_upstrand_request_common_ctx_t  *common;
+    ngx_http_upstrand_status_data_t         *upstreams;
+
+    /* a nested upstrand reports its own hops */
+    ctx = ngx_http_upstrand_get_request_ctx(r, &common);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_upstrand_get_rendered_var(ctx, UPSTRAND_PATH_VAR, v)) {
+        return NGX_OK;
+    }
+
+    upstreams = ctx->status_data.elts;
+
+    len = ngx_http_upstrand_path_len(upstreams, ctx->status_data.nelts);
+
+    v->data = (u_char *) "";
+
+    if (len > 0) {
+        v->data = ngx_pnalloc(r->pool, len);
+        if (v->data == NULL) {
+            return NGX_ERROR;
+        }
+
+        (void) ngx_http_upstrand_render_path(v->data, upstreams,
+                                             ctx->status_data.nelts);
+    }
+
+    v->len = len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    ngx_http_upstrand_set_rendered_var(ctx, UPSTRAND_PATH_VAR, v);
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_get_upstrand_status_var_value(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t  data)
+{
+    size_t                                   len;
+    ngx_http_upstrand_request_ctx_t         *ctx;
+    ngx_http_upstrand_request_common_ctx_t  *common;
+    ngx_http_upstrand_status_data_t         *upstreams;
+    ngx_uint_t                               idx = data;
+
+    if (idx >= UPSTREAM_VARS_SIZE) {
+        return NGX_ERROR;
+    }
+
+    ctx = ngx_http_upstrand_get_request_ctx(r, &common);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_upstrand_get_rendered_var(ctx, idx, v)) {
+        return NGX_OK;
+    }
+
+    upstreams = ctx->status_data.elts;
+
+    len = ngx_http_upstrand_status_len(upstreams, ctx->status_data.nelts, idx);
+
+    v->data = (u_char *) "";
+
+    if (len > 0) {
+        v->data = ngx_pnalloc(r->pool, len);
+        if (v->data == NULL) {
+            return NGX_ERROR;
+        }
+
+        (void) ngx_http_upstrand_render_status(v->data, upstreams,
+                                               ctx->status_data.nelts, idx);
+    }
+
+    v->len = len;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    ngx_http_upstrand_set_rendered_var(ctx, idx, v);
+
+    return NGX_OK;
+}
+
+
+/* the names of the fields are the names of the upstream variables without
+ * prefix upstream_, empty values are skipped */
+
+ngx_int_t
+ngx_http_get_upstrand_trace_json_var_value(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t  data)
+{
+    u_char                                  *p;
+    ngx_uint_t                               i, j;
+    size_t                                   len;
+    ngx_str_t                               *value;
+    ngx_http_upstrand_request_ctx_t         *ctx;
+    ngx_http_upstrand_request_common_ctx_t  *common;
+    ngx_http_upstrand_status_data_t         *upstreams;
+
+    ctx = ngx_http_upstrand_get_request_ctx(r, &common);
+    if (ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_upstrand_get_rendered_var(ctx, UPSTRAND_TRACE_JSON_VAR, v)) {
+        return NGX_OK;
+    }
+
+    upstreams = ctx->status_data.elts;
+
+    len = sizeof("[]") - 1;
+
+    for (i = 0; i < ctx->status_data.nelts; i++) {
+        len += sizeof(",{\"upstream\":\"\"}") - 1 + upstreams[i].upstream.len
+               + ngx_escape_json(NULL, upstreams[i].upstream.data,
+                                 upstreams[i].upstream.len);
+
+        for (j = 0; j < UPSTREAM_VARS_SIZE; j++) {
+            value = &upstreams[i].data[j];
+
+            if (value->len == 0) {
+                continue;
+            }
+
+            len += sizeof(",\"\":\"\"") - 1 + upstream_vars[j].len - 9
+                   + value->len
+                   + ngx_escape_json(NULL, value->data, value->len);
+        }
+    }
+
+    p = ngx_pnalloc(r->pool, len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->data = p;
+
+    *p++ = '[';
+
+    for (i = 0; i < ctx->status_data.nelts; i++) {
+        p = ngx_cpymem(p, i == 0 ? "{\"upstream\":\"" : ",{\"upstream\":\"",
+                       i == 0 ? 13 : 14);
+        p = (u_char *) ngx_escape_json(p, upstreams[i].upstream.data,
+                                       upstreams[i].upstream.len);
+        *p++ = '"';
+
+        for (j = 0; j < UPSTREAM_VARS_SIZE; j++) {
+            value = &upstreams[i].data[j];
+
+            if (value->len == 0) {
+                continue;
+            }
+
+            p = ngx_sprintf(p, ",\"%*s\":\"", upstream_vars[j].len - 9,
+                            upstream_vars[j].data + 9);
+            p = (u_char *) ngx_escape_json(p, value->data, value->len);
+            *p++ = '"';
+        }
+
+        *p++ = '}';
+    }
+
+    *p++ = ']';
+
+    v->len = p - v->data;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    ngx_http_upstrand_set_rendered_var(ctx, UPSTRAND_TRACE_JSON_VAR, v);
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_http_upstrand_get_rendered_var(ngx_http_upstrand_request_ctx_t *ctx,
+                                   ngx_uint_t idx, ngx_http_variable_value_t *v)
+{
+    ngx_http_upstrand_rendered_var_t  *rendered = &ctx->rendered[idx];
+
+    if (rendered->value.data == NULL || rendered->gen != ctx->status_gen) {
+        return 0;
+    }
+
+    v->len = rendered->value.len;
+    v->data = rendered->value.data;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+
+    return 1;
+}
+
+
+static void
+ngx_http_upstrand_set_rendered_var(ngx_http_upstrand_request_ctx_t *ctx,
+                                   ngx_uint_t idx, ngx_http_variable_value_t *v)
+{
+    ctx->rendered[idx].value.len = v->len;
+    ctx->rendered[idx].value.data = v->data;
+    ctx->rendered[idx].gen = ctx->status_gen;
+}
+
+
+char *
+ngx_http_upstrand_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_combined_upstreams_main_conf_t  *mcf = conf;
+
+    char                                     *rv;
+    ngx_str_t                                *value, name;
+    ngx_conf_t                                save;
+    ngx_http_variable_t                      *var;
+    ngx_str_t                                 var_name;
+    ngx_http_upstrand_conf_t                 *upstrand, **upstrandp;
+    ngx_http_upstrand_conf_ctx_t              ctx;
+    ngx_http_upstrand_upstream_state_t       *state;
+    ngx_http_upstrand_counters_t             *counters;
+    ngx_http_upstream_main_conf_t            *umcf;
+    ngx_uint_t                                u_nelts, bu_nelts;
+    size_t                                    members_size;
+
+    upstrand = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstrand_conf_t));
+    if (upstrand == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    /* upstrands are referred by pointers from variables and shared memory
+     * zones, and therefore they must not move when the array grows */
+    upstrandp = ngx_array_push(&mcf->upstrands);
+    if (upstrandp == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    *upstrandp = upstrand;
+
+    if (ngx_array_init(&upstrand->upstreams, cf->pool, 1,
+                       sizeof(ngx_http_upstrand_upstream_conf_t))
+            != NGX_OK
+        || ngx_array_init(&upstrand->b_upstreams, cf->pool, 1,
+                          sizeof(ngx_http_upstrand_upstream_conf_t))
+            != NGX_OK
+        || ngx_array_init(&upstrand->next_upstream_statuses, cf->pool, 1,
+                          sizeof(ngx_int_t))
+            != NGX_OK
+        || ngx_array_init(&upstrand->intercept_statuses, cf->pool, 1,
+                          sizeof(ngx_http_upstrand_intercept_status_data_t))
+            != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    upstrand->order = ngx_http_upstrand_order_normal;
+
+    value = cf->args->elts;
+    name = value[1];
+    upstrand->name = name;
+
+    var_name.len = name.len + 9;
+    var_name.data = ngx_pnalloc(cf->pool, var_name.len);
+    if (var_name.data == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memcpy(var_name.data, "upstrand_", 9);
+    ngx_memcpy(var_name.data + 9, name.data, name.len);
+
+    if (cf->args->nelts == 3
+        && ngx_http_upstrand_zone(cf, upstrand, &value[2]) != NGX_CONF_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    var = ngx_http_add_variable(cf, &var_name,
+                            NGX_HTTP_VAR_CHANGEABLE|NGX_HTTP_VAR_NOCACHEABLE);
+    if (var == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    var->get_handler = ngx_http_upstrand_variable;
+    var->data = (uintptr_t) upstrand;
+
+    /* bitmaps of upstreams registered in the upstrand let skip duplicates
+     * without scanning the registered upstreams; upstreams cannot be added
+     * inside the upstrand block, and therefore the bitmaps do not grow */
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+    members_size = (umcf->upstreams.nelts + (8 * sizeof(uintptr_t) - 1))
+                   / (8 * sizeof(uintptr_t)) * sizeof(uintptr_t);
+
+    ctx.members = ngx_pcalloc(cf->temp_pool, members_size);
+    ctx.b_members = ngx_pcalloc(cf->temp_pool, members_size);
+    if (ctx.members == NULL || ctx.b_members == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ctx.upstrand = upstrand;
+    ctx.cf = &save;
+    ctx.order_done = 0;
+    ctx.broadcast_policy_done = 0;
+
+    save = *cf;
+    cf->ctx = &ctx;
+    cf->handler = ngx_http_upstrand;
+    cf->handler_conf = conf;
+
+    rv = ngx_conf_parse(cf, NULL);
+
+    *cf = save;
+
+    if (rv != NGX_CONF_OK) {
+        return rv;
+    }
+
+    u_nelts = upstrand->upstreams.nelts;
+    bu_nelts = upstrand->b_upstreams.nelts;
+
+    if (u_nelts == 0 && bu_nelts == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "no upstream registered in "
+                           "upstrand \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    /* the state gets re-bound to the shared memory zone when the zone is
+     * initialized */
+    state = ngx_pcalloc(cf->pool, (u_nelts + bu_nelts)
+                        * sizeof(ngx_http_upstrand_upstream_state_t));
+    if (state == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    counters = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstrand_counters_t));
+    if (counters == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_http_upstrand_bind_state(upstrand, state, counters);
+
+    if (upstrand->shm_zone) {
+        upstrand->shm_signature = ngx_http_upstrand_signature(cf, upstrand);
+
+    } else if (upstrand->order_global) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "global order requires "
+                           "a zone in upstrand \"%V\"", &name);
+        return NGX_CONF_ERROR;
+
+    } else if (upstrand->health_check) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "health_check requires "
+                           "a zone in upstrand \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (upstrand->order == ngx_http_upstrand_order_broadcast) {
+        if (u_nelts == 0 || bu_nelts > 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "broadcast order requires "
+                               "normal and no backup upstreams in upstrand "
+                               "\"%V\"", &name);
+            return NGX_CONF_ERROR;
+        }
+
+        if (upstrand->intercept_statuses.nelts > 0 || upstrand->hedge_after) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "broadcast order is not "
+                               "compatible with intercept_statuses and "
+                               "hedge_after in upstrand \"%V\"", &name);
+            return NGX_CONF_ERROR;
+        }
+
+    } else if (ctx.broadcast_policy_done) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "broadcast_policy requires "
+                           "broadcast order in upstrand \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (upstrand->weighted) {
+        if (upstrand->order != ngx_http_upstrand_order_normal
+            && upstrand->order != ngx_http_upstrand_order_start_random)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "weights are compatible "
+                               "only with the default and start_random "
+                               "orders in upstrand \"%V\"", &name);
+            return NGX_CONF_ERROR;
+        }
+
+        if (u_nelts > 0) {
+            upstrand->alias = ngx_http_upstrand_alias_table(cf,
+                                                        &upstrand->upstreams);
+            if (upstrand->alias == NULL) {
+                return NGX_CONF_ERROR;
+            }
+        }
+
+        if (bu_nelts > 0) {
+            upstrand->b_alias = ngx_http_upstrand_alias_table(cf,
+                                                        &upstrand->b_upstreams);
+            if (upstrand->b_alias == NULL) {
+                return NGX_CONF_ERROR;
+            }
+        }
+    }
+
+    if (upstrand->hash_consistent) {
+        if (u_nelts > 0) {
+            upstrand->ring = ngx_http_upstrand_hash_ring(cf,
+                                                        &upstrand->upstreams);
+            if (upstrand->ring == NULL) {
+                return NGX_CONF_ERROR;
+            }
+        }
+
+        if (bu_nelts > 0) {
+            upstrand->b_ring = ngx_http_upstrand_hash_ring(cf,
+                                                        &upstrand->b_upstreams);
+            if (upstrand->b_ring == NULL) {
+                return NGX_CONF_ERROR;
+            }
+        }
+    }
+
+    if (upstrand->order == ngx_http_upstrand_order_start_random &&
+        !upstrand->order_per_request)
+    {
+        if (u_nelts > 0) {
+            upstrand->cur = ngx_http_upstrand_random(u_nelts);
+        }
+        if (bu_nelts > 0) {
+            upstrand->b_cur = ngx_http_upstrand_random(bu_nelts);
+        }
+    }
+
+    return rv;
+}
+
+
+static char *
+ngx_http_upstrand(ngx_conf_t *cf, ngx_command_t *dummy, void *conf)
+{
+    ngx_uint_t                     i;
+    ngx_str_t                     *value;
+    ngx_http_upstrand_conf_ctx_t  *ctx;
+
+    value = cf->args->elts;
+    ctx = cf->ctx;
+
+    if (cf->args->nelts == 1) {
+        if (value[0].len == 26 &&
+            ngx_strncmp(value[0].data, "next_upstream_discard_body", 26) == 0)
+        {
+            if (ctx->upstrand->next_upstream_discard_body) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "duplicate upstrand directive \"%V\"", &value[0]);
+                return NGX_CONF_ERROR;
+            }
+
+            ctx->upstrand->next_upstream_discard_body = 1;
+            return NGX_CONF_OK;
+        }
+    }
+
+    if (cf->args->nelts < 6) {
+        if (value[0].len == 12 &&
+            ngx_strncmp(value[0].data, "health_check", 12) == 0)
+        {
+            ngx_int_t                          n;
+            ngx_str_t                          interval;
+            ngx_uint_t                         done[4] = {0, 0, 0, 0};
+            ngx_http_upstrand_health_check_t  *hc;
+
+            if (ctx->upstrand->health_check != NULL) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "duplicate upstrand directive \"%V\"", &value[0]);
+                return NGX_CONF_ERROR;
+            }
+
+            hc = ngx_pcalloc(cf->pool,
+                             sizeof(ngx_http_upstrand_health_check_t));
+            if (hc == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            hc->upstrand = ctx->upstrand;
+            ngx_str_set(&hc->uri, "/");
+            hc->interval = 5000;
+            hc->fails = 1;
+            hc->passes = 1;
+
+            for (i = 1; i < cf->args->nelts; i++) {
+
+                if (value[i].len > 4 &&
+                    ngx_strncmp(value[i].data, "uri=", 4) == 0
+                    && value[i].data[4] == '/')
+                {
+                    if (done[0]++ > 0) {
+                        goto invalid;
+                    }
+
+                    hc->uri.data = value[i].data + 4;
+                    hc->uri.len = value[i].len - 4;
+                    continue;
+                }
+
+                if (value[i].len > 9 &&
+                    ngx_strncmp(value[i].data, "interval=", 9) == 0)
+                {
+                    interval.data = value[i].data + 9;
+                    interval.len = value[i].len - 9;
+
+                    hc->interval = ngx_parse_time(&interval, 0);
+
+                    if (done[1]++ > 0
+                        || hc->interval == (ngx_msec_t) NGX_ERROR
+                        || hc->interval == 0)
+                    {
+                        goto invalid;
+                    }
+
+                    continue;
+                }
+
+                if (value[i].len > 6 &&
+                    ngx_strncmp(value[i].data, "fails=", 6) == 0)
+                {
+                    n = ngx_atoi(value[i].data + 6, value[i].len - 6);
+
+                    if (done[2]++ > 0 || n == NGX_ERROR || n == 0) {
+                        goto invalid;
+                    }
+
+                    hc->fails = n;
+                    continue;
+                }
+
+                if (value[i].len > 7 &&
+                    ngx_strncmp(value[i].data, "passes=", 7) == 0)
+                {
+                    n = ngx_atoi(value[i].data + 7, value[i].len - 7);
+
+                    if (done[3]++ > 0 || n == NGX_ERROR || n == 0) {
+                        goto invalid;
+                    }
+
+                    hc->passes = n;
+                    continue;
+                }
+
+                goto invalid;
+            }
+
+            ctx->upstrand->health_check = hc;
+            return NGX_CONF_OK;
+        }
+    }
+
+    if (cf->args->nelts > 1 && cf->args->nelts < 6) {
+        if (value[0].len == 17 &&
+            ngx_strncmp(value[0].data, "outlier_detection", 17) == 0)
+        {
+            ngx_int_t   n;
+            ngx_str_t   interval;
+            ngx_uint_t  done[4] = {0, 0, 0, 0};
+
+            if (ctx->upstrand->outlier_detection) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "duplicate upstrand directive \"%V\"", &value[0]);
+                return NGX_CONF_ERROR;
+            }
+
+            ctx->upstrand->outlier_interval = 30;
+            ctx->upstrand->outlier_max_ejected = 10;
+
+            for (i = 1; i < cf->args->nelts; i++) {
+
+                if (value[i].len > 7 &&
+                    ngx_strncmp(value[i].data, "errors=", 7) == 0)
+                {
+                    n = ngx_atoi(value[i].data + 7, value[i].len - 7);
+
+                    if (done[0]++ > 0 || n == NGX_ERROR || n == 0) {
+                        goto invalid;
+                    }
+
+                    ctx->upstrand->outlier_errors = n;
+                    continue;
+                }
+
+                if (value[i].len > 8 &&
+                    ngx_strncmp(value[i].data, "latency=", 8) == 0)
+                {
+                    n = ngx_atoi(value[i].data + 8, value[i].len - 8);
+
+                    if (done[1]++ > 0 || n == NGX_ERROR || n == 0) {
+                        goto invalid;
+                    }
+
+                    ctx->upstrand->outlier_latency = n;
+                    continue;
+                }
+
+                if (value[i].len > 9 &&
+                    ngx_strncmp(value[i].data, "interval=", 9) == 0)
+                {
+                    interval.data = value[i].data + 9;
+                    interval.len = value[i].len - 9;
+
+                    ctx->upstrand->outlier_interval =
+                            ngx_parse_time(&interval, 1);
+
+                    if (done[2]++ > 0
+                        || ctx->upstrand->outlier_interval == NGX_ERROR
+                        || ctx->upstrand->outlier_interval == 0)
+                    {
+                        goto invalid;
+                    }
+
+                    continue;
+                }
+
+                if (value[i].len > 13 &&
+                    ngx_strncmp(value[i].data, "max_ejected=", 12) == 0
+                    && value[i].data[value[i].len - 1] == '%')
+                {
+                    n = ngx_atoi(value[i].data + 12, value[i].len - 13);
+
+                    if (done[3]++ > 0 || n == NGX_ERROR || n == 0 || n > 100)
+                    {
+                        goto invalid;
+                    }
+
+                    ctx->upstrand->outlier_max_ejected = n;
+                    continue;
+                }
+
+                goto invalid;
+            }
+
+            if (done[0] + done[1] == 0) {
+                goto invalid;
+            }
+
+            ctx->upstrand->outlier_detection = 1;
+            return NGX_CONF_OK;
+        }
+    }
+
+    if (cf->args->nelts == 2 || cf->args->nelts == 3) {
+        if (value[0].len == 11 &&
+            ngx_strncmp(value[0].data, "hedge_after", 11) == 0)
+        {
+            ngx_msec_t  hedge_after;
+            ngx_int_t   budget = 10;
+
+            if (ctx->upstrand->hedge_after) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "duplicate upstrand directive \"%V\"", &value[0]);
+                return NGX_CONF_ERROR;
+            }
+
+            hedge_after = ngx_parse_time(&value[1], 0);
+
+            if (hedge_after == (ngx_msec_t) NGX_ERROR || hedge_after == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "bad timeout value: \"%V\"", &value[1]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (cf->args->nelts == 3) {
+                if (value[2].len < 9
+                    || ngx_strncmp(value[2].data, "budget=", 7) != 0
+                    || value[2].data[value[2].len - 1] != '%')
+                {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                    "bad upstrand directive \"%V\" content",
+                                    &value[0]);
+                    return NGX_CONF_ERROR;
+                }
+
+                budget = ngx_atoi(value[2].data + 7, value[2].len - 8);
+
+                if (budget == NGX_ERROR || budget == 0 || budget > 100) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                       "bad hedge budget \"%V\"", &value[2]);
+                    return NGX_CONF_ERROR;
+                }
+            }
+
+            ctx->upstrand->hedge_after = hedge_after;
+            ctx->upstrand->hedge_budget = budget;
+            return NGX_CONF_OK;
+        }
+    }
+
+    if (cf->args->nelts == 2) {
+        if (value[0].len == 21 &&
+            ngx_strncmp(value[0].data, "next_upstream_timeout", 21) == 0)
+        {
+            time_t  timeout;
+
+            if (ctx->upstrand->next_upstream_timeout) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "duplicate upstrand directive \"%V\"", &value[0]);
+                return NGX_CONF_ERROR;
+            }
+
+            timeout = ngx_parse_time(&value[1], 1);
+
+            if (timeout == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "bad timeout value: \"%V\"", &value[1]);
+                return NGX_CONF_ERROR;
+            }
+
+            ctx->upstrand->next_upstream_timeout = timeout * 1000;
+            return NGX_CONF_OK;
+        }
+
+        if (value[0].len == 15 &&
+            ngx_strncmp(value[0].data, "histogram_reset", 15) == 0)
+        {
+            time_t  interval;
+
+            if (ctx->upstrand->histogram_reset) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "duplicate upstrand directive \"%V\"", &value[0]);
+                return NGX_CONF_ERROR;
+            }
+
+            interval = ngx_parse_time(&value[1], 1);
+
+            if (interval == NGX_ERROR || interval == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "bad interval value: \"%V\"", &value[1]);
+                return NGX_CONF_ERROR;
+            }
+
+            ctx->upstrand->histogram_reset = interval;
+            return NGX_CONF_OK;
+        }
+
+        if (value[0].len == 16 &&
+            ngx_strncmp(value[0].data, "broadcast_policy", 16) == 0)
+        {
+            if (ctx->broadcast_policy_done) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "duplicate upstrand directive \"%V\"", &value[0]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (value[1].len == 9 &&
+                ngx_strncmp(value[1].data, "first_2xx", 9) == 0)
+            {
+                ctx->upstrand->broadcast_policy =
+                        ngx_http_upstrand_broadcast_first_2xx;
+
+            } else if (value[1].len == 5 &&
+                       ngx_strncmp(value[1].data, "worst", 5) == 0)
+            {
+                ctx->upstrand->broadcast_policy =
+                        ngx_http_upstrand_broadcast_worst;
+
+            } else if (value[1].len == 3 &&
+                       ngx_strncmp(value[1].data, "all", 3) == 0)
+            {
+                ctx->upstrand->broadcast_policy =
+                        ngx_http_upstrand_broadcast_all;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "bad upstrand directive \"%V\" content",
+                                   &value[0]);
+                return NGX_CONF_ERROR;
+            }
+
+            ctx->broadcast_policy_done = 1;
+            return NGX_CONF_OK;
+        }
+    }
+
+    if (cf->args->nelts > 1 && cf->args->nelts < 5) {
+        if (value[0].len == 5 && ngx_strncmp(value[0].data, "order", 5) == 0) {
+            ngx_uint_t  done[3] = {0, 0, 0};
+
+            if (ctx->order_done) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "duplicate upstrand directive \"%V\"",
+                                   &value[0]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (cf->args->nelts > 2 && value[1].len == 4
+                && ngx_strncmp(value[1].data, "hash", 4) == 0)
+            {
+                ngx_http_compile_complex_value_t  ccv;
+
+                if (cf->args->nelts == 4) {
+                    if (value[3].len != 10
+                        || ngx_strncmp(value[3].data, "consistent", 10) != 0)
+                    {
+                        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                    "bad upstrand directive \"%V\" content",
+                                    &value[0]);
+                        return NGX_CONF_ERROR;
+                    }
+                    ctx->upstrand->hash_consistent = 1;
+                }
+
+                ctx->upstrand->hash_key = ngx_palloc(cf->pool,
+                                            sizeof(ngx_http_complex_value_t));
+                if (ctx->upstrand->hash_key == NULL) {
+                    return NGX_CONF_ERROR;
+                }
+
+                ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+                /* variables must be registered in the http configuration */
+                ccv.cf = ctx->cf;
+                ccv.value = &value[2];
+                ccv.complex_value = ctx->upstrand->hash_key;
+
+                if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+                    return NGX_CONF_ERROR;
+                }
+
+                ctx->upstrand->order = ngx_http_upstrand_order_hash;
+                ctx->order_done = 1;
+                return NGX_CONF_OK;
+            }
+
+            for (i = 1; i < cf->args->nelts; i++) {
+
+                if (value[i].len == 12 &&
+                    ngx_strncmp(value[i].data, "start_random", 12) == 0)
+                {
+                    if (done[0]++ > 0) {
+                        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                    "bad upstrand directive \"%V\" content",
+                                    &value[0]);
+                        return NGX_CONF_ERROR;
+                    }
+                    ctx->upstrand->order = ngx_http_upstrand_order_start_random;
+                }
+
+                if (value[i].len == 9 &&
+                    ngx_strncmp(value[i].data, "broadcast", 9) == 0)
+                {
+                    if (done[0]++ > 0) {
+                        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                    "bad upstrand directive \"%V\" content",
+                                    &value[0]);
+                        return NGX_CONF_ERROR;
+                    }
+                    ctx->upstrand->order = ngx_http_upstrand_order_broadcast;
+                }
+
+                if (value[i].len == 10 &&
+                    ngx_strncmp(value[i].data, "least_time", 10) == 0)
+                {
+                    if (done[0]++ > 0) {
+                        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                    "bad upstrand directive \"%V\" content",
+                                    &value[0]);
+                        return NGX_CONF_ERROR;
+                    }
+                    ctx->upstrand->order = ngx_http_upstrand_order_least_time;
+                }
+
+                if (value[i].len == 3 &&
+                    ngx_strncmp(value[i].data, "p2c", 3) == 0)
+                {
+                    if (done[0]++ > 0) {
+                        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                    "bad upstrand directive \"%V\" content",
+                                    &value[0]);
+                        return NGX_CONF_ERROR;
+                    }
+                    ctx->upstrand->order = ngx_http_upstrand_order_p2c;
+                }
+
+                if (value[i].len == 11 &&
+                    ngx_strncmp(value[i].data, "per_request", 11) == 0)
+                {
+                    if (done[1]++ > 0) {
+                        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                    "bad upstrand directive \"%V\" content",
+                                    &value[0]);
+                        return NGX_CONF_ERROR;
+                    }
+                    ctx->upstrand->order_per_request = 1;
+                }
+
+                if (value[i].len == 6 &&
+                    ngx_strncmp(value[i].data, "global", 6) == 0)
+                {
+                    if (done[2]++ > 0) {
+                        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                    "bad upstrand directive \"%V\" content",
+                                    &value[0]);
+                        return NGX_CONF_ERROR;
+                    }
+                    ctx->upstrand->order_global = 1;
+                }
+            }
+
+            if (done[0] + done[1] + done[2] != cf->args->nelts - 1
+                || (done[1] > 0 && done[2] > 0)
+                || (ctx->upstrand->order != ngx_http_upstrand_order_normal
+                    && ctx->upstrand->order
+                            != ngx_http_upstrand_order_start_random
+                    && done[1] + done[2] > 0))
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "bad upstrand directive \"%V\" content",
+                                   &value[0]);
+                return NGX_CONF_ERROR;
+            }
+
+            ctx->order_done = 1;
+            return NGX_CONF_OK;
+        }
+    }
+
+    if (cf->args->nelts > 1 && cf->args->nelts < 8) {
+        if (value[0].len == 8 && ngx_strncmp(value[0].data, "upstream", 8) == 0)
+        {
+            ngx_uint_t                         done[5] = {0, 0, 0, 0, 0};
+            ngx_int_t                          weight;
+            ngx_http_upstrand_upstream_conf_t  uconf;
+
+            ngx_memzero(&uconf, sizeof(ngx_http_upstrand_upstream_conf_t));
+            uconf.weight = 1;
+
+            for (i = 2; i < cf->args->nelts; i++) {
+
+                if (value[i].len == 6 &&
+                    ngx_strncmp(value[i].data, "backup", 6) == 0)
+                {
+                    if (done[0]++ > 0) {
+                        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                           "bad upstrand directive \"%V\" "
+                                           "content", &value[0]);
+                        return NGX_CONF_ERROR;
+                    }
+                }
+
+                if (value[i].len > 19 &&
+                    ngx_strncmp(value[i].data, "blacklist_interval=", 19) == 0)
+                {
+                    ngx_str_t  interval = value[i];
+
+                    if (done[1]++ > 0) {
+                        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                           "bad upstrand directive \"%V\" "
+                                           "content", &value[0]);
+                        return NGX_CONF_ERROR;
+                    }
+
+                    interval.data += 19;
+                    interval.len -= 19;
+
+                    uconf.blacklist_interval = ngx_parse_time(&interval, 1);
+
+                    if (uconf.blacklist_interval == NGX_ERROR) {
+                        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                "bad blacklist interval: \"%V\"", &interval);
+                        return NGX_CONF_ERROR;
+                    }
+
+                }
+
+                if (value[i].len > 23 &&
+                    ngx_strncmp(value[i].data, "blacklist_max_interval=", 23)
+                        == 0)
+                {
+                    ngx_str_t  interval = value[i];
+
+                    if (done[3]++ > 0) {
+                        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                           "bad upstrand directive \"%V\" "
+                                           "content", &value[0]);
+                        return NGX_CONF_ERROR;
+                    }
+
+                    interval.data += 23;
+                    interval.len -= 23;
+
+                    uconf.blacklist_max_interval = ngx_parse_time(&interval, 1);
+
+                    if (uconf.blacklist_max_interval == NGX_ERROR) {
+                        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                "bad blacklist interval: \"%V\"", &interval);
+                        return NGX_CONF_ERROR;
+                    }
+
+                }
+
+                if (value[i].len > 11 &&
+                    ngx_strncmp(value[i].data, "slow_start=", 11) == 0)
+                {
+                    ngx_str_t  period = value[i];
+
+                    if (done[4]++ > 0) {
+                        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                           "bad upstrand directive \"%V\" "
+                                           "content", &value[0]);
+                        return NGX_CONF_ERROR;
+                    }
+
+                    period.data += 11;
+                    period.len -= 11;
+
+                    uconf.slow_start = ngx_parse_time(&period, 0);
+
+                    if (uconf.slow_start == (ngx_msec_t) NGX_ERROR) {
+                        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                "bad slow start period: \"%V\"", &period);
+                        return NGX_CONF_ERROR;
+                    }
+
+                    if (uconf.slow_start > 0) {
+                        ctx->upstrand->slow_start = 1;
+                    }
+                }
+
+                if (value[i].len > 7 &&
+                    ngx_strncmp(value[i].data, "weight=", 7) == 0)
+                {
+                    if (done[2]++ > 0) {
+                        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                           "bad upstrand directive \"%V\" "
+                                           "content", &value[0]);
+                        return NGX_CONF_ERROR;
+                    }
+
+                    weight = ngx_atoi(value[i].data + 7, value[i].len - 7);
+
+                    if (weight == NGX_ERROR) {
+                        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                           "bad weight \"%V\"", &value[i]);
+                        return NGX_CONF_ERROR;
+                    }
+
+                    if (weight != 1) {
+                        ctx->upstrand->weighted = 1;
+                    }
+
+                    uconf.weight = weight;
+                }
+            }
+
+            if (done[0] + done[1] + done[2] + done[3] + done[4]
+                    != cf->args->nelts - 2
+                || ((done[3] > 0 || done[4] > 0) && done[1] == 0))
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "bad upstrand directive \"%V\" content",
+                                   &value[0]);
+                return NGX_CONF_ERROR;
+            }
+
+            /* without the max interval, the open interval does not grow */
+            if (uconf.blacklist_max_interval < uconf.blacklist_interval) {
+                uconf.blacklist_max_interval = uconf.blacklist_interval;
+            }
+
+            if (done[0] == 0) {
+                return ngx_http_upstrand_add_upstream(ctx->cf,
+                            &ctx->upstrand->upstreams, ctx->members,
+                            &value[1], &uconf);
+            }
+
+            return ngx_http_upstrand_add_upstream(ctx->cf,
+                        &ctx->upstrand->b_upstreams, ctx->b_members,
+                        &value[1], &uconf);
+        }
+    }
+
+    if (value[0].len == 22 &&
+        ngx_strncmp(value[0].data, "next_upstream_statuses", 22) == 0)
+    {
+        ngx_int_t  *status;
+
+        if (cf->args->nelts < 2) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "bad upstrand directive \"%V\" content",
+                               &value[0]);
+            return NGX_CONF_ERROR;
+        }
+
+        for (i = 1; i < cf->args->nelts; i++) {
+            ngx_uint_t  invalid_status = 0;
+
+            if (value[i].len == 14 &&
+                ngx_strncmp(value[i].data, "non_idempotent", 14) == 0)
+            {
+                ctx->upstrand->retry_non_idempotent = 1;
+                continue;
+            }
+
+            status = ngx_array_push(&ctx->upstrand->next_upstream_statuses);
+            if (status == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            *status = ngx_atoi(value[i].data, value[i].len);
+
+            if (*status == NGX_ERROR) {
+
+                if (value[i].len == 3 &&
+                    ngx_strncmp(value[i].data + 1, "xx", 2) == 0)
+                {
+                    switch (value[i].data[0]) {
+                    case '4':
+                        *status = -4;
+                        break;
+                    case '5':
+                        *status = -5;
+                        break;
+                    default:
+                        invalid_status = 1;
+                        break;
+                    }
+
+                } else if (value[i].len == 5 &&
+                           ngx_strncmp(value[i].data, "error", 5) == 0)
+                {
+                    *status = -101;
+
+                } else if (value[i].len == 7 &&
+                           ngx_strncmp(value[i].data, "timeout", 7) == 0)
+                {
+                    *status = -102;
+
+                } else {
+                    invalid_status = 1;
+
+                }
+
+                if (invalid_status) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                       "invalid status \"%V\"", &value[i]);
+                    return NGX_CONF_ERROR;
+                }
+            }
+        }
+
+        return NGX_CONF_OK;
+    }
+
+    if (value[0].len == 18 &&
+        ngx_strncmp(value[0].data, "intercept_statuses", 18) == 0)
+    {
+        ngx_http_upstrand_intercept_status_data_t  *status;
+
+        if (cf->args->nelts < 3) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "bad upstrand directive \"%V\" content",
+                               &value[0]);
+            return NGX_CONF_ERROR;
+        }
+
+        for (i = 1; i < cf->args->nelts - 1; i++) {
+            ngx_uint_t  invalid_status = 0;
+
+            status = ngx_array_push(&ctx->upstrand->intercept_statuses);
+            if (status == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            status->uri = value[cf->args->nelts - 1];
+            status->value = ngx_atoi(value[i].data, value[i].len);
+
+            if (status->value == NGX_ERROR) {
+
+                if (value[i].len == 3 &&
+                    ngx_strncmp(value[i].data + 1, "xx", 2) == 0)
+                {
+                    switch (value[i].data[0]) {
+                    case '4':
+                        status->value = -4;
+                        break;
+                    case '5':
+                        status->value = -5;
+                        break;
+                    default:
+                        invalid_status = 1;
+                        break;
+                    }
+
+                } else {
+                    invalid_status = 1;
+
+                }
+
+                if (invalid_status) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                       "invalid status \"%V\"", &value[i]);
+                    return NGX_CONF_ERROR;
+                }
+            }
+        }
+
+        return NGX_CONF_OK;
+    }
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "bad upstrand directive \"%V\"",
+                       &value[0]);
+
+    return NGX_CONF_ERROR;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "bad upstrand directive \"%V\" content", &value[0]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+char *
+ngx_http_dynamic_upstrand(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_combined_upstreams_loc_conf_t   *lcf = conf;
+
+    ngx_uint_t                                i;
+    ngx_str_t                                *value;
+    ngx_http_variable_t                      *v;
+    ngx_http_upstrand_var_list_elem_t        *resvar;
+    ngx_http_combined_upstreams_main_conf_t  *mcf;
+
+    value = cf->args->elts;
+
+    if (value[1].len < 2 || value[1].data[0] != '$') {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid variable name \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    value[1].len--;
+    value[1].data++;
+
+    resvar = ngx_array_push(&lcf->dyn_upstrands);
+    if (resvar == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_array_init(&resvar->data, cf->pool, cf->args->nelts - 2,
+                       sizeof(ngx_http_upstrand_var_handle_t)) != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 2; i < cf->args->nelts; i++) {
+        ngx_http_upstrand_var_handle_t  *res;
+        ngx_int_t                        index = NGX_ERROR;
+        ngx_uint_t                       isvar;
+
+        res = ngx_array_push(&resvar->data);
+        if (res == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        isvar = value[i].len > 1 && value[i].data[0] == '$' ? 1 : 0;
+        if (!isvar) {
+            res->index = index;
+            res->key = value[i];
+            break;
+        }
+
+        value[i].len--;
+        value[i].data++;
+
+        index = ngx_http_get_variable_index(cf, &value[i]);
+        if (index == NGX_ERROR) {
+            return NGX_CONF_ERROR;
+        }
+
+        res->index = index;
+        res->key = value[i];
+    }
+
+    v = ngx_http_add_variable(cf, &value[1], NGX_HTTP_VAR_CHANGEABLE);
+    if (v == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    /* every dynamic upstrand variable gets a slot in the lookup tables of
+     * locations */
+    if (v->get_handler != ngx_http_get_dynamic_upstrand_value) {
+        mcf = ngx_http_conf_get_module_main_conf(cf,
+                                        ngx_http_combined_upstreams_module);
+
+        v->data = mcf->dyn_upstrand_slots++;
+        v->get_handler = ngx_http_get_dynamic_upstrand_value;
+    }
+
+    resvar->slot = v->data;
+
+    return NGX_CONF_OK;
+}
+
+
+ngx_int_t
+ngx_http_dynamic_upstrand_merge(ngx_conf_t *cf,
+    ngx_http_combined_upstreams_loc_conf_t *prev,
+    ngx_http_combined_upstreams_loc_conf_t *conf)
+{
+    /* the main level has no parent to be merged with */
+    if (prev->dyn_upstrand_slots == NULL
+        && ngx_http_dynamic_upstrand_slots(cf, prev, NULL) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    return ngx_http_dynamic_upstrand_slots(cf, conf, prev->dyn_upstrand_slots);
+}
+
+
+/* locations without own dynamic upstrands share the lookup table of the
+ * parent location, otherwise own dynamic upstrands override the inherited
+ * ones */
+
+static ngx_int_t
+ngx_http_dynamic_upstrand_slots(ngx_conf_t *cf,
+    ngx_http_combined_upstreams_loc_conf_t *lcf, ngx_array_t **inherited)
+{
+    ngx_uint_t                                i;
+    ngx_array_t                             **slots;
+    ngx_http_upstrand_var_list_elem_t        *elts;
+    ngx_http_combined_upstreams_main_conf_t  *mcf;
+
+    if (lcf->dyn_upstrands.nelts == 0) {
+        lcf->dyn_upstrand_slots = inherited;
+        return NGX_OK;
+    }
+
+    mcf = ngx_http_conf_get_module_main_conf(cf,
+                                    ngx_http_combined_upstreams_module);
+
+    slots = ngx_pcalloc(cf->pool,
+                        mcf->dyn_upstrand_slots * sizeof(ngx_array_t *));
+    if (slots == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (inherited != NULL) {
+        ngx_memcpy(slots, inherited,
+                   mcf->dyn_upstrand_slots * sizeof(ngx_array_t *));
+    }
+
+    elts = lcf->dyn_upstrands.elts;
+
+    /* the first declaration of a variable in a location wins */
+    for (i = lcf->dyn_upstrands.nelts; i > 0; i--) {
+        slots[elts[i - 1].slot] = &elts[i - 1].data;
+    }
+
+    lcf->dyn_upstrand_slots = slots;
+
+    return NGX_OK;
+}
+
+
+char *
+ngx_http_upstrand_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_str_t                      *value, *arg;
+    ngx_url_t                       u;
+    ngx_array_t                    *args, *save;
+    ngx_command_t                  *pcmd;
+    ngx_http_upstream_srv_conf_t   *uscf;
+    ngx_http_upstrand_pass_conf_t  *pcf;
+    char                           *rv;
+
+    static const ngx_str_t  scheme = ngx_string("http://");
+    static const ngx_str_t  prefix = ngx_string("upstrand.");
+
+    value = cf->args->elts;
+
+    args = ngx_array_create(cf->pool, 2, sizeof(ngx_str_t));
+    if (args == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    arg = ngx_array_push_n(args, 2);
+    if (arg == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_str_set(&arg[0], "proxy_pass");
+
+    /* the upstrand is exposed to the proxy module as an implicit upstream
+     * "upstrand.<name>" whose balancer walks through the upstrand's upstreams
+     * inside a single upstream request */
+    arg[1].len = scheme.len + prefix.len + value[1].len;
+    arg[1].data = ngx_pnalloc(cf->pool, arg[1].len);
+    if (arg[1].data == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memcpy(arg[1].data, scheme.data, scheme.len);
+    ngx_memcpy(arg[1].data + scheme.len, prefix.data, prefix.len);
+    ngx_memcpy(arg[1].data + scheme.len + prefix.len, value[1].data,
+               value[1].len);
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url.len = arg[1].len - scheme.len;
+    u.url.data = arg[1].data + scheme.len;
+    u.default_port = 80;
+    u.no_resolve = 1;
+
+    uscf = ngx_http_upstream_add(cf, &u, 0);
+    if (uscf == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (uscf->peer.init_upstream != ngx_http_upstrand_pass_init_upstream) {
+        if (uscf->peer.init_upstream != NULL
+            || uscf->flags & NGX_HTTP_UPSTREAM_CREATE)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "upstream \"%V\" is already defined", &u.host);
+            return NGX_CONF_ERROR;
+        }
+
+        pcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstrand_pass_conf_t));
+        if (pcf == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        pcf->name = value[1];
+
+        uscf->peer.init_upstream = ngx_http_upstrand_pass_init_upstream;
+        uscf->peer.data = pcf;
+    }
+
+    for (pcmd = ngx_http_proxy_module.commands; pcmd->name.len; pcmd++) {
+        if (pcmd->name.len == arg[0].len
+            && ngx_strncmp(pcmd->name.data, arg[0].data, arg[0].len) == 0)
+        {
+            break;
+        }
+    }
+
+    if (pcmd->name.len == 0) {
+        return NGX_CONF_ERROR;
+    }
+
+    save = cf->args;
+    cf->args = args;
+
+    rv = pcmd->set(cf, pcmd, ngx_http_conf_get_module_loc_conf(cf,
+                                                    ngx_http_proxy_module));
+
+    cf->args = save;
+
+    return rv;
+}
+
+
+static ngx_int_t
+ngx_http_upstrand_pass_init_upstream(ngx_conf_t *cf,
+                                     ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_uint_t                                i;
+    ngx_http_combined_upstreams_main_conf_t  *mcf;
+    ngx_http_upstrand_conf_t                **upstrands;
+    ngx_http_upstrand_pass_conf_t            *pcf = us->peer.data;
+
+    if (us->flags & NGX_HTTP_UPSTREAM_CREATE) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "upstream \"%V\" in %s:%ui clashes with upstrand_pass",
+                      &us->host, us->file_name, us->line);
+        return NGX_ERROR;
+    }
+
+    mcf = ngx_http_conf_get_module_main_conf(cf,
+                                    ngx_http_combined_upstreams_module);
+    upstrands = mcf->upstrands.elts;
+
+    for (i = 0; i < mcf->upstrands.nelts; i++) {
+        if (upstrands[i]->name.len == pcf->name.len
+            && ngx_strncmp(upstrands[i]->name.data, pcf->name.data,
+                           pcf->name.len) == 0)
+        {
+            pcf->upstrand = upstrands[i];
+            break;
+        }
+    }
+
+    if (pcf->upstrand == NULL) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "upstrand \"%V\" is not found", &pcf->name);
+        return NGX_ERROR;
+    }
+
+    if (pcf->upstrand->order == ngx_http_upstrand_order_broadcast) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "broadcast upstrand \"%V\" cannot be used in "
+                      "upstrand_pass", &pcf->name);
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_http_upstrand_pass_init_peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstrand_pass_init_peer(ngx_http_request_t *r,
+                                 ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_uint_t                           i, u_nelts, rank, min_rank;
+    ngx_atomic_uint_t                    min;
+    ngx_http_upstrand_pass_conf_t       *pcf = us->peer.data;
+    ngx_http_upstrand_pass_peer_data_t  *pd;
+    ngx_http_upstrand_conf_t            *upstrand;
+    ngx_http_upstrand_upstream_conf_t   *u;
+
+    upstrand = pcf->upstrand;
+
+    pd = ngx_pcalloc(r->pool, sizeof(ngx_http_upstrand_pass_peer_data_t));
+    if (pd == NULL) {
+        return NGX_ERROR;
+    }
+
+    pd->r = r;
+    pd->upstrand = upstrand;
+
+    if (upstrand->order == ngx_http_upstrand_order_p2c) {
+        ngx_pool_cleanup_t  *cln;
+
+        cln = ngx_pool_cleanup_add(r->pool, 0);
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+
+        cln->handler = ngx_http_upstrand_pass_inflight_cleanup;
+        cln->data = pd;
+    }
+
+    ngx_http_upstrand_count(&upstrand->counters->requests);
+
+    ngx_http_upstrand_start_cursors(upstrand, &pd->start_cur, &pd->start_bcur);
+
+    if (ngx_http_upstrand_member_orders(r, upstrand, &pd->start_cur,
+                                        &pd->start_bcur, &pd->u_order,
+                                        &pd->bu_order)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_upstrand_pass_find_upstream(pd) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "all upstreams in upstrand \"%V\" are blacklisted, "
+                      "reopening the least recently failed one",
+                      &upstrand->name);
+
+        ngx_http_upstrand_count(&upstrand->counters->all_blacklisted);
+
+        u_nelts = upstrand->upstreams.nelts;
+        min = (ngx_atomic_uint_t) -1;
+        min_rank = (ngx_uint_t) -1;
+
+        for (i = 0; i < u_nelts + upstrand->b_upstreams.nelts; i++) {
+            u = ngx_http_upstrand_pass_step_upstream(pd, i);
+            rank = ngx_http_upstrand_admin_rank(u);
+
+            if (rank < min_rank
+                || (rank == min_rank
+                    && u->state->blacklist_last_occurrence < min))
+            {
+                min_rank = rank;
+                min = u->state->blacklist_last_occurrence;
+                pd->step = i;
+            }
+        }
+
+        pd->cur_upstream = ngx_http_upstrand_pass_step_upstream(pd, pd->step);
+        ngx_http_upstrand_breaker_reopen(pd->cur_upstream, ngx_time());
+    }
+
+    return ngx_http_upstrand_pass_init_upstream_peer(pd);
+}
+
+
+static ngx_http_upstrand_upstream_conf_t *
+ngx_http_upstrand_pass_step_upstream(ngx_http_upstrand_pass_peer_data_t *pd,
+                                     ngx_uint_t step)
+{
+    ngx_http_upstrand_upstream_conf_t  *u_elts, *bu_elts;
+    ngx_uint_t                          u_nelts, bu_nelts;
+
+    u_elts = pd->upstrand->upstreams.elts;
+    bu_elts = pd->upstrand->b_upstreams.elts;
+    u_nelts = pd->upstrand->upstreams.nelts;
+    bu_nelts = pd->upstrand->b_upstreams.nelts;
+
+    if (step < u_nelts) {
+        return ngx_http_upstrand_member(u_elts, pd->u_order,
+                                        (pd->start_cur + step) % u_nelts);
+    }
+
+    return ngx_http_upstrand_member(bu_elts, pd->bu_order,
+                            (pd->start_bcur + step - u_nelts) % bu_nelts);
+}
+
+
+static ngx_int_t
+ngx_http_upstrand_pass_find_upstream(ngx_http_upstrand_pass_peer_data_t *pd)
+{
+    ngx_http_upstrand_upstream_conf_t  *u;
+    ngx_uint_t                          u_nelts, bu_nelts;
+    time_t                              now = ngx_time();
+
+    u_nelts = pd->upstrand->upstreams.nelts;
+    bu_nelts = pd->upstrand->b_upstreams.nelts;
+
+    /* steps run through the normal cycle and then through the backup cycle,
+     * each starting from its own cursor */
+    for ( /* void */ ; pd->step < u_nelts + bu_nelts; pd->step++) {
+        u = ngx_http_upstrand_pass_step_upstream(pd, pd->step);
+
+        if (!ngx_http_upstrand_is_blacklisted(u, now)) {
+            pd->cur_upstream = u;
+            return NGX_OK;
+        }
+    }
+
+    return NGX_DECLINED;
+}
+
+
+static ngx_int_t
+ngx_http_upstrand_pass_init_upstream_peer(
+    ngx_http_upstrand_pass_peer_data_t *pd)
+{
+    ngx_http_upstream_t                 *u;
+    ngx_http_upstream_main_conf_t       *umcf;
+    ngx_http_upstream_srv_conf_t       **uscfp, *uscf;
+
+    u = pd->r->upstream;
+
+    umcf = ngx_http_get_module_main_conf(pd->r, ngx_http_upstream_module);
+    uscfp = umcf->upstreams.elts;
+    uscf = uscfp[pd->cur_upstream->index];
+
+    if (uscf->peer.init(pd->r, uscf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_upstrand_count(&pd->upstrand->counters->hops);
+    ngx_http_upstrand_count(&pd->cur_upstream->state->hops);
+
+    pd->hops++;
+
+    if (pd->upstrand->order == ngx_http_upstrand_order_p2c) {
+        ngx_http_upstrand_pass_inflight_cleanup(pd);
+        ngx_http_upstrand_inflight_add(pd->cur_upstream, 1);
+        pd->inflight = pd->cur_upstream;
+    }
+
+    pd->data = u->peer.data;
+    pd->get = u->peer.get;
+    pd->free = u->peer.free;
+
+    u->peer.data = pd;
+    u->peer.get = ngx_http_upstrand_pass_get_peer;
+    u->peer.free = ngx_http_upstrand_pass_free_peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstrand_pass_next_upstream(ngx_http_upstrand_pass_peer_data_t *pd,
+                                     ngx_uint_t failed)
+{
+    if (failed && pd->cur_upstream->blacklist_interval > 0) {
+        ngx_http_upstrand_breaker_fail(pd->cur_upstream, ngx_time());
+    }
+
+    if (failed && pd->upstrand->order == ngx_http_upstrand_order_least_time) {
+        ngx_http_upstrand_update_header_time(pd->cur_upstream, -1);
+    }
+
+    if (failed && pd->upstrand->outlier_detection) {
+        ngx_http_upstrand_outlier_record(pd->cur_upstream, 1, 0);
+        ngx_http_upstrand_outlier_check(pd->r->pool, pd->upstrand);
+    }
+
+    pd->step++;
+
+    if (ngx_http_upstrand_pass_find_upstream(pd) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    return ngx_http_upstrand_pass_init_upstream_peer(pd);
+}
+
+
+static void
+ngx_http_upstrand_pass_record_hops(ngx_http_upstrand_pass_peer_data_t *pd)
+{
+    ngx_http_upstrand_hist_reset(pd->upstrand);
+    ngx_http_upstrand_hist_add(&pd->upstrand->counters->hops_hist, pd->hops);
+}
+
+
+static ngx_int_t
+ngx_http_upstrand_pass_get_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstrand_pass_peer_data_t  *pd = data;
+
+    ngx_int_t                            rc;
+
+    for ( ;; ) {
+        rc = pd->get(pc, pd->data);
+
+        if (rc != NGX_BUSY) {
+            return rc;
+        }
+
+        /* all peers of the upstream are down, the next upstream in the
+         * upstrand may still have live peers */
+        if (ngx_http_upstrand_pass_next_upstream(pd, 0) != NGX_OK) {
+            return NGX_BUSY;
+        }
+    }
+}
+
+
+static void
+ngx_http_upstrand_pass_free_peer(ngx_peer_connection_t *pc, void *data,
+                                 ngx_uint_t state)
+{
+    ngx_http_upstrand_pass_peer_data_t  *pd = data;
+
+    ngx_uint_t                           max_tries;
+    ngx_http_upstream_state_t           *us;
+
+    pd->free(pc, pd->data, state);
+
+    if (!(state & (NGX_PEER_FAILED|NGX_PEER_NEXT))) {
+        ngx_http_upstrand_pass_inflight_cleanup(pd);
+
+        if (pd->cur_upstream->blacklist_interval > 0) {
+            ngx_http_upstrand_breaker_succeed(pd->cur_upstream);
+        }
+
+        us = pd->r->upstream->state;
+
+        if (pd->upstrand->order == ngx_http_upstrand_order_least_time
+            && us != NULL && us->header_time != (ngx_msec_t) -1)
+        {
+            ngx_http_upstrand_update_header_time(pd->cur_upstream,
+                                                 us->header_time * 1000);
+        }
+
+        if (pd->upstrand->outlier_detection
+            && us != NULL && us->header_time != (ngx_msec_t) -1)
+        {
+            ngx_http_upstrand_outlier_record(pd->cur_upstream, 0,
+                                             us->header_time);
+            ngx_http_upstrand_outlier_check(pd->r->pool, pd->upstrand);
+        }
+
+        if (us != NULL && us->header_time != (ngx_msec_t) -1) {
+            ngx_http_upstrand_hist_add(
+                        &pd->cur_upstream->state->header_time_hist,
+                        us->header_time);
+        }
+
+        ngx_http_upstrand_pass_record_hops(pd);
+
+        return;
+    }
+
+    pd->tries++;
+
+    /* proxy_next_upstream_tries applies to the whole upstrand */
+    max_tries = pd->r->upstream->conf->next_upstream_tries;
+
+    if (max_tries && pd->tries >= max_tries) {
+        ngx_http_upstrand_pass_record_hops(pd);
+        pc->tries = 0;
+        return;
+    }
+
+    if (pc->tries > 0) {
+        return;
+    }
+
+    if (ngx_http_upstrand_pass_next_upstream(pd, state & NGX_PEER_FAILED)
+        != NGX_OK)
+    {
+        ngx_http_upstrand_pass_record_hops(pd);
+        pc->tries = 0;
+        return;
+    }
+
+    if (max_tries && pc->tries > max_tries - pd->tries) {
+        pc->tries = max_tries - pd->tries;
+    }
+}
+
+
+char *
+ngx_http_upstrand_request_body_replay(ngx_conf_t *cf, ngx_command_t *cmd,
+                                      void *conf)
+{
+    ngx_http_combined_upstreams_loc_conf_t  *lcf = conf;
+
+    ngx_str_t                               *value;
+    ssize_t                                  size;
+
+    if (lcf->upstrand_request_body_replay != NGX_CONF_UNSET_SIZE) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (value[1].len == 3 && ngx_strncmp(value[1].data, "off", 3) == 0) {
+        lcf->upstrand_request_body_replay = 0;
+        return NGX_CONF_OK;
+    }
+
+    size = ngx_parse_size(&value[1]);
+
+    if (size == NGX_ERROR || size == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "bad size value: \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    lcf->upstrand_request_body_replay = size;
+
+    return NGX_CONF_OK;
+}
+
+
+char *
+ngx_http_upstrand_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_combined_upstreams_loc_conf_t  *lcf = conf;
+
+    ngx_str_t                               *value;
+    ngx_http_core_loc_conf_t                *clcf;
+
+    if (lcf->upstrand_status_format) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    lcf->upstrand_status_format = UPSTRAND_STATUS_JSON;
+
+    if (cf->args->nelts == 2) {
+        if (value[1].len == 10
+            && ngx_strncmp(value[1].data, "prometheus", 10) == 0)
+        {
+            lcf->upstrand_status_format = UPSTRAND_STATUS_PROMETHEUS;
+
+        } else if (value[1].len != 4
+                   || ngx_strncmp(value[1].data, "json", 4) != 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "bad status format \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_upstrand_status_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstrand_status_handler(ngx_http_request_t *r)
+{
+    size_t                                     len, line;
+    time_t                                     now;
+    ngx_int_t                                  rc;
+    ngx_uint_t                                 i, nelts;
+    ngx_buf_t                                 *b;
+    ngx_chain_t                                out;
+    ngx_http_combined_upstreams_main_conf_t   *mcf;
+    ngx_http_combined_upstreams_loc_conf_t    *lcf;
+    ngx_http_upstrand_conf_t                 **upstrands;
+    ngx_http_upstrand_upstream_conf_t         *elts;
+    ngx_http_upstream_main_conf_t             *umcf;
+    ngx_http_upstream_srv_conf_t             **uscfp;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    mcf = ngx_http_get_module_main_conf(r, ngx_http_combined_upstreams_module);
+    lcf = ngx_http_get_module_loc_conf(r, ngx_http_combined_upstreams_module);
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+
+    upstrands = mcf->upstrands.elts;
+    uscfp = umcf->upstreams.elts;
+
+    /* every metric takes a line in the output, the Prometheus format adds
+     * a line per metric family, a histogram takes a line per bucket plus
+     * two lines for its sum and count */
+    len = 32 * UPSTRAND_STATUS_LINE_SIZE;
+
+    for (i = 0; i < mcf->upstrands.nelts; i++) {
+        line = UPSTRAND_STATUS_LINE_SIZE + upstrands[i]->name.len;
+        len += 2 * line * (sizeof(ngx_http_upstrand_counter_metrics)
+                           / sizeof(ngx_http_upstrand_metric_t) + 8
+                           + UPSTRAND_HIST_BUCKETS + 2);
+
+        elts = upstrands[i]->upstreams.elts;
+        for (nelts = 0; nelts < upstrands[i]->upstreams.nelts; nelts++) {
+            len += (8 + 2 * (UPSTRAND_HIST_BUCKETS + 2))
+                   * (line + uscfp[elts[nelts].index]->host.len);
+        }
+
+        elts = upstrands[i]->b_upstreams.elts;
+        for (nelts = 0; nelts < upstrands[i]->b_upstreams.nelts; nelts++) {
+            len += (8 + 2 * (UPSTRAND_HIST_BUCKETS + 2))
+                   * (line + uscfp[elts[nelts].index]->host.len);
+        }
+    }
+
+    b = ngx_create_temp_buf(r->pool, len);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    now = ngx_time();
+
+    if (lcf->upstrand_status_format == UPSTRAND_STATUS_PROMETHEUS) {
+        ngx_str_set(&r->headers_out.content_type,
+                    "text/plain; version=0.0.4");
+
+        b->last = ngx_http_upstrand_status_prometheus(b->last, upstrands,
+                                                      mcf->upstrands.nelts,
+                                                      uscfp, now);
+
+    } else {
+        ngx_str_set(&r->headers_out.content_type, "application/json");
+
+        *b->last++ = '{';
+
+        for (i = 0; i < mcf->upstrands.nelts; i++) {
+            if (i > 0) {
+                *b->last++ = ',';
+            }
+
+            b->last = ngx_http_upstrand_status_json(b->last, upstrands[i],
+                                                    uscfp, now);
+        }
+
+        *b->last++ = '}';
+        *b->last++ = LF;
+    }
+
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static u_char *
+ngx_http_upstrand_status_json(u_char *p, ngx_http_upstrand_conf_t *upstrand,
+                              ngx_http_upstream_srv_conf_t **uscfp, time_t now)
+{
+    ngx_str_t                           hops = ngx_string("hops");
+    ngx_uint_t                          i, j, k, nelts;
+    ngx_atomic_uint_t                   cur, b_cur;
+    ngx_array_t                        *upstreams;
+    ngx_http_upstrand_metric_t         *metric;
+    ngx_http_upstrand_upstream_conf_t  *elts;
+
+    p = ngx_sprintf(p, "\"%V\":{", &upstrand->name);
+
+    for (metric = ngx_http_upstrand_counter_metrics; metric->name.len;
+         metric++)
+    {
+        p = ngx_sprintf(p, "\"%V\":%uA,", &metric->name,
+                        ngx_http_upstrand_metric_value(upstrand->counters,
+                                                       metric));
+    }
+
+    p = ngx_sprintf(p, "\"next_upstream\":{");
+
+    for (metric = ngx_http_upstrand_next_upstream_metrics; metric->name.len;
+         metric++)
+    {
+        p = ngx_sprintf(p, "%s\"%V\":%uA",
+                        metric == ngx_http_upstrand_next_upstream_metrics ?
+                                "" : ",",
+                        &metric->name,
+                        ngx_http_upstrand_metric_value(upstrand->counters,
+                                                       metric));
+    }
+
+    ngx_http_upstrand_status_cursors(upstrand, &cur, &b_cur);
+
+    p = ngx_sprintf(p, "},\"cur\":%uA,\"b_cur\":%uA,\"upstreams\":[",
+                    cur, b_cur);
+
+    for (k = 0; k < 2; k++) {
+        upstreams = k == 0 ? &upstrand->upstreams : &upstrand->b_upstreams;
+        elts = upstreams->elts;
+        nelts = upstreams->nelts;
+
+        for (i = 0; i < nelts; i++) {
+            if (i > 0 || (k == 1 && upstrand->upstreams.nelts > 0)) {
+                *p++ = ',';
+            }
+
+            p = ngx_sprintf(p, "{\"name\":\"%V\",\"backup\":%s",
+                            &uscfp[elts[i].index]->host,
+                            k == 0 ? "false" : "true");
+
+            for (metric = ngx_http_upstrand_member_metrics; metric->name.len;
+                 metric++)
+            {
+                p = ngx_sprintf(p, ",\"%V\":%uA", &metric->name,
+                                ngx_http_upstrand_metric_value(elts[i].state,
+                                                               metric));
+            }
+
+            for (j = 0; ngx_http_upstrand_member_gauges[j].name.len; j++) {
+                p = ngx_sprintf(p, ",\"%V\":%uA",
+                                &ngx_http_upstrand_member_gauges[j].name,
+                                ngx_http_upstrand_member_gauge(&elts[i], j,
+                                                               now));
+            }
+
+            for (metric = ngx_http_upstrand_member_histograms;
+                 metric->name.len; metric++)
+            {
+                p = ngx_http_upstrand_hist_json(p, &metric->name,
+                            ngx_http_upstrand_metric_hist(elts[i].state,
+                                                          metric));
+            }
+
+            *p++ = '}';
+        }
+    }
+
+    *p++ = ']';
+
+    p = ngx_http_upstrand_hist_json(p, &hops, &upstrand->counters->hops_hist);
+
+    *p++ = '}';
+
+    return p;
+}
+
+
+/* the lines of a metric family must be grouped in the Prometheus format */
+
+static u_char *
+ngx_http_upstrand_status_prometheus(u_char *p,
+                                    ngx_http_upstrand_conf_t **upstrands,
+                                    ngx_uint_t nelts,
+                                    ngx_http_upstream_srv_conf_t **uscfp,
+                                    time_t now)
+{
+    ngx_str_t                           hops = ngx_string("hops");
+    ngx_uint_t                          i, j, k, n;
+    ngx_atomic_uint_t                   cur, b_cur;
+    ngx_array_t                        *upstreams;
+    ngx_http_upstrand_metric_t         *metric;
+    ngx_http_upstrand_upstream_conf_t  *elts;
+
+    for (metric = ngx_http_upstrand_counter_metrics; metric->name.len;
+         metric++)
+    {
+        p = ngx_sprintf(p, "# TYPE upstrand_%V_total counter\n",
+                        &metric->name);
+
+        for (i = 0; i < nelts; i++) {
+            p = ngx_sprintf(p, "upstrand_%V_total{upstrand=\"%V\"} %uA\n",
+                            &metric->name, &upstrands[i]->name,
+                            ngx_http_upstrand_metric_value(
+                                            upstrands[i]->counters, metric));
+        }
+    }
+
+    p = ngx_sprintf(p, "# TYPE upstrand_cursor gauge\n");
+
+    for (i = 0; i < nelts; i++) {
+        ngx_http_upstrand_status_cursors(upstrands[i], &cur, &b_cur);
+
+        p = ngx_sprintf(p, "upstrand_cursor{upstrand=\"%V\",cycle=\"normal\"} "
+                        "%uA\n", &upstrands[i]->name, cur);
+        p = ngx_sprintf(p, "upstrand_cursor{upstrand=\"%V\",cycle=\"backup\"} "
+                        "%uA\n", &upstrands[i]->name, b_cur);
+    }
+
+    p = ngx_sprintf(p, "# TYPE upstrand_next_upstream_total counter\n");
+
+    for (i = 0; i < nelts; i++) {
+        for (metric = ngx_http_upstrand_next_upstream_metrics;
+             metric->name.len; metric++)
+        {
+            p = ngx_sprintf(p, "upstrand_next_upstream_total{upstrand=\"%V\","
+                            "class=\"%V\"} %uA\n", &upstrands[i]->name,
+                            &metric->name,
+                            ngx_http_upstrand_metric_value(
+                                            upstrands[i]->counters, metric));
+        }
+    }
+
+    for (metric = ngx_http_upstrand_member_metrics; metric->name.len;
+         metric++)
+    {
+        p = ngx_sprintf(p, "# TYPE upstrand_upstream_%V_total counter\n",
+                        &metric->name);
+
+        for (i = 0; i < nelts; i++) {
+            for (k = 0; k < 2; k++) {
+                upstreams = k == 0 ? &upstrands[i]->upstreams :
+                                     &upstrands[i]->b_upstreams;
+                elts = upstreams->elts;
+
+                for (n = 0; n < upstreams->nelts; n++) {
+                    p = ngx_sprintf(p, "upstrand_upstream_%V_total"
+                                    "{upstrand=\"%V\",upstream=\"%V\"} %uA\n",
+                                    &metric->name, &upstrands[i]->name,
+                                    &uscfp[elts[n].index]->host,
+                                    ngx_http_upstrand_metric_value(
+                                                    elts[n].state, metric));
+                }
+            }
+        }
+    }
+
+    for (j = 0; ngx_http_upstrand_member_gauges[j].name.len; j++) {
+        p = ngx_sprintf(p, "# TYPE upstrand_upstream_%V gauge\n",
+                        &ngx_http_upstrand_member_gauges[j].name);
+
+        for (i = 0; i < nelts; i++) {
+            for (k = 0; k < 2; k++) {
+                upstreams = k == 0 ? &upstrands[i]->upstreams :
+                                     &upstrands[i]->b_upstreams;
+                elts = upstreams->elts;
+
+                for (n = 0; n < upstreams->nelts; n++) {
+                    p = ngx_sprintf(p, "upstrand_upstream_%V"
+                                    "{upstrand=\"%V\",upstream=\"%V\"} %uA\n",
+                                    &ngx_http_upstrand_member_gauges[j].name,
+                                    &upstrands[i]->name,
+                                    &uscfp[elts[n].index]->host,
+                                    ngx_http_upstrand_member_gauge(&elts[n], j,
+                                                                   now));
+                }
+            }
+        }
+    }
+
+    p = ngx_sprintf(p, "# TYPE upstrand_hops histogram\n");
+
+    for (i = 0; i < nelts; i++) {
+        p = ngx_http_upstrand_hist_prometheus(p, &hops, &upstrands[i]->name,
+                                              NULL,
+                                        &upstrands[i]->counters->hops_hist);
+    }
+
+    for (metric = ngx_http_upstrand_member_histograms; metric->name.len;
+         metric++)
+    {
+        p = ngx_sprintf(p, "# TYPE upstrand_upstream_%V_seconds histogram\n",
+                        &metric->name);
+
+        for (i = 0; i < nelts; i++) {
+            for (k = 0; k < 2; k++) {
+                upstreams = k == 0 ? &upstrands[i]->upstreams :
+                                     &upstrands[i]->b_upstreams;
+                elts = upstreams->elts;
+
+                for (n = 0; n < upstreams->nelts; n++) {
+                    p = ngx_http_upstrand_hist_prometheus(p, &metric->name,
+                                &upstrands[i]->name,
+                                &uscfp[elts[n].index]->host,
+                                ngx_http_upstrand_metric_hist(elts[n].state,
+                                                              metric));
+                }
+            }
+        }
+    }
+
+    return p;
+}
+
+
+/* the cursors are per worker unless the order is global */
+
+static void
+ngx_http_upstrand_status_cursors(ngx_http_upstrand_conf_t *upstrand,
+                                 ngx_atomic_uint_t *cur,
+                                 ngx_atomic_uint_t *b_cur)
+{
+    if (upstrand->order_global) {
+        *cur = upstrand->shm->cur;
+        *b_cur = upstrand->shm->b_cur;
+
+    } else {
+        *cur = upstrand->cur;
+        *b_cur = upstrand->b_cur;
+    }
+
+    if (upstrand->upstreams.nelts > 0) {
+        *cur %= upstrand->upstreams.nelts;
+    }
+
+    if (upstrand->b_upstreams.nelts > 0) {
+        *b_cur %= upstrand->b_upstreams.nelts;
+    }
+}
+
+
+char *
+ngx_http_upstrand_api(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_upstrand_api_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+/* GET lists upstrands or a single upstrand given in argument upstrand, POST
+ * changes the mode or the weight of the upstreams given in argument upstream
+ * and lists the upstrand */
+
+static ngx_int_t
+ngx_http_upstrand_api_handler(ngx_http_request_t *r)
+{
+    size_t                                     len;
+    ngx_int_t                                  rc;
+    ngx_uint_t                                 i, j, k, n;
+    ngx_str_t                                  name;
+    ngx_buf_t                                 *b;
+    ngx_chain_t                                out;
+    ngx_array_t                               *upstreams;
+    ngx_http_combined_upstreams_main_conf_t   *mcf;
+    ngx_http_upstrand_conf_t                 **upstrands, *upstrand = NULL;
+    ngx_http_upstrand_upstream_conf_t         *elts;
+    ngx_http_upstream_main_conf_t             *umcf;
+    ngx_http_upstream_srv_conf_t             **uscfp;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD|NGX_HTTP_POST))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    mcf = ngx_http_get_module_main_conf(r, ngx_http_combined_upstreams_module);
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    if (ngx_http_arg(r, (u_char *) "upstrand", 8, &name) == NGX_OK) {
+        upstrand = ngx_http_upstrand_find(r, mcf, &name);
+        if (upstrand == NULL) {
+            return NGX_HTTP_NOT_FOUND;
+        }
+    }
+
+    if (r->method == NGX_HTTP_POST) {
+        if (upstrand == NULL) {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+        rc = ngx_http_upstrand_api_update(r, upstrand, uscfp);
+
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
+    if (upstrand != NULL) {
+        upstrands = &upstrand;
+        n = 1;
+
+    } else {
+        upstrands = mcf->upstrands.elts;
+        n = mcf->upstrands.nelts;
+    }
+
+    len = sizeof("{}" CRLF);
+
+    for (i = 0; i < n; i++) {
+        len += upstrands[i]->name.len + 64;
+
+        for (k = 0; k < 2; k++) {
+            upstreams = k == 0 ? &upstrands[i]->upstreams
+                               : &upstrands[i]->b_upstreams;
+            elts = upstreams->elts;
+
+            for (j = 0; j < upstreams->nelts; j++) {
+                len += uscfp[elts[j].index]->host.len + 64 + NGX_INT_T_LEN;
+            }
+        }
+    }
+
+    b = ngx_create_temp_buf(r->pool, len);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    *b->last++ = '{';
+
+    for (i = 0; i < n; i++) {
+        if (i > 0) {
+            *b->last++ = ',';
+        }
+
+        b->last = ngx_http_upstrand_api_json(b->last, upstrands[i], uscfp);
+    }
+
+    *b->last++ = '}';
+    *b->last++ = LF;
+
+    ngx_str_set(&r->headers_out.content_type, "application/json");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static ngx_int_t
+ngx_http_upstrand_api_update(ngx_http_request_t *r,
+                             ngx_http_upstrand_conf_t *upstrand,
+                             ngx_http_upstream_srv_conf_t **uscfp)
+{
+    ngx_int_t                           mode = NGX_ERROR, weight = NGX_ERROR;
+    ngx_uint_t                          i, k, found = 0;
+    ngx_str_t                           name, value, *host;
+    ngx_array_t                        *upstreams;
+    ngx_http_upstrand_upstream_conf_t  *elts;
+
+    if (ngx_http_arg(r, (u_char *) "upstream", 8, &name) != NGX_OK) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    if (ngx_http_arg(r, (u_char *) "mode", 4, &value) == NGX_OK) {
+        for (i = 0; ngx_http_upstrand_admin_modes[i].len; i++) {
+            if (value.len == ngx_http_upstrand_admin_modes[i].len
+                && ngx_strncmp(value.data,
+                               ngx_http_upstrand_admin_modes[i].data,
+                               value.len) == 0)
+            {
+                mode = i;
+                break;
+            }
+        }
+
+        if (mode == NGX_ERROR) {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+    }
+
+    if (ngx_http_arg(r, (u_char *) "weight", 6, &value) == NGX_OK) {
+
+        /* NGX_DECLINED brings back the configured weight */
+        if (value.len == 7 && ngx_strncmp(value.data, "default", 7) == 0) {
+            weight = NGX_DECLINED;
+
+        } else {
+            weight = ngx_atoi(value.data, value.len);
+
+            if (weight < 0 || weight > UPSTRAND_API_MAX_WEIGHT) {
+                return NGX_HTTP_BAD_REQUEST;
+            }
+        }
+    }
+
+    if (mode == NGX_ERROR && weight == NGX_ERROR) {
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    /* changes in the worker's memory would not be seen by other workers */
+    if (upstrand->shm == NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "upstrand \"%V\" has no zone", &upstrand->name);
+        return NGX_HTTP_CONFLICT;
+    }
+
+    if (weight != NGX_ERROR && !upstrand->weighted) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "upstrand \"%V\" has no weights", &upstrand->name);
+        return NGX_HTTP_CONFLICT;
+    }
+
+    if (weight != NGX_ERROR
+        && ngx_http_upstrand_api_check_weight(upstrand, uscfp, &name, weight)
+           != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "all upstreams of a cycle in upstrand \"%V\" would "
+                      "have zero weights", &upstrand->name);
+        return NGX_HTTP_CONFLICT;
+    }
+
+    for (k = 0; k < 2; k++) {
+        upstreams = k == 0 ? &upstrand->upstreams : &upstrand->b_upstreams;
+        elts = upstreams->elts;
+
+        for (i = 0; i < upstreams->nelts; i++) {
+            host = &uscfp[elts[i].index]->host;
+
+            if (host->len != name.len
+                || ngx_strncasecmp(host->data, name.data, name.len) != 0)
+            {
+                continue;
+            }
+
+            if (mode != NGX_ERROR) {
+                if ((mode == UPSTRAND_ADMIN_UP
+                     || mode == UPSTRAND_ADMIN_WHITELISTED)
+                    && (elts[i].state->admin == UPSTRAND_ADMIN_DRAINED
+                        || elts[i].state->admin == UPSTRAND_ADMIN_BLACKLISTED))
+                {
+                    ngx_http_upstrand_slow_start(&elts[i], 0);
+                }
+
+                elts[i].state->admin = mode;
+            }
+
+            if (weight == NGX_DECLINED) {
+                elts[i].state->weight_set = 0;
+
+            } else if (weight != NGX_ERROR) {
+                elts[i].state->weight = weight;
+                ngx_memory_barrier();
+                elts[i].state->weight_set = 1;
+            }
+
+            found = 1;
+        }
+    }
+
+    if (!found) {
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    if (weight != NGX_ERROR) {
+        (void) ngx_atomic_fetch_add(&upstrand->shm->weights_gen, 1);
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                  "upstream \"%V\" in upstrand \"%V\" was updated by \"%V\"",
+                  &name, &upstrand->name, &r->args);
+
+    return NGX_OK;
+}
+
+
+/* the alias table cannot be built for a cycle whose weights are all zeros */
+
+static ngx_int_t
+ngx_http_upstrand_api_check_weight(ngx_http_upstrand_conf_t *upstrand,
+                                   ngx_http_upstream_srv_conf_t **uscfp,
+                                   ngx_str_t *name, ngx_int_t weight)
+{
+    ngx_uint_t                          i, k, total, found;
+    ngx_str_t                          *host;
+    ngx_array_t                        *upstreams;
+    ngx_http_upstrand_upstream_conf_t  *elts;
+
+    for (k = 0; k < 2; k++) {
+        upstreams = k == 0 ? &upstrand->upstreams : &upstrand->b_upstreams;
+        elts = upstreams->elts;
+
+        total = 0;
+        found = 0;
+
+        for (i = 0; i < upstreams->nelts; i++) {
+            host = &uscfp[elts[i].index]->host;
+
+            if (host->len != name->len
+                || ngx_strncasecmp(host->data, name->data, name->len) != 0)
+            {
+                total += ngx_http_upstrand_weight(&elts[i]);
+                continue;
+            }
+
+            total += weight == NGX_DECLINED ? elts[i].weight
+                                            : (ngx_uint_t) weight;
+            found = 1;
+        }
+
+        if (found && total == 0) {
+            return NGX_DECLINED;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static u_char *
+ngx_http_upstrand_api_json(u_char *p, ngx_http_upstrand_conf_t *upstrand,
+                           ngx_http_upstream_srv_conf_t **uscfp)
+{
+    ngx_uint_t                          i, k, mode;
+    ngx_array_t                        *upstreams;
+    ngx_http_upstrand_upstream_conf_t  *elts;
+
+    p = ngx_sprintf(p, "\"%V\":{\"zone\":%s,\"weighted\":%s,\"upstreams\":[",
+                    &upstrand->name, upstrand->shm ? "true" : "false",
+                    upstrand->weighted ? "true" : "false");
+
+    for (k = 0; k < 2; k++) {
+        upstreams = k == 0 ? &upstrand->upstreams : &upstrand->b_upstreams;
+        elts = upstreams->elts;
+
+        for (i = 0; i < upstreams->nelts; i++) {
+            if (i > 0 || (k == 1 && upstrand->upstreams.nelts > 0)) {
+                *p++ = ',';
+            }
+
+            mode = elts[i].state->admin;
+            if (mode > UPSTRAND_ADMIN_WHITELISTED) {
+                mode = UPSTRAND_ADMIN_UP;
+            }
+
+            p = ngx_sprintf(p, "{\"name\":\"%V\",\"backup\":%s,"
+                            "\"mode\":\"%V\",\"weight\":%ui}",
+                            &uscfp[elts[i].index]->host,
+                            k == 0 ? "false" : "true",
+                            &ngx_http_upstrand_admin_modes[mode],
+                            ngx_http_upstrand_weight(&elts[i]));
+        }
+    }
+
+    *p++ = ']';
+    *p++ = '}';
+
+    return p;
+}
+
+
+static ngx_atomic_uint_t
+ngx_http_upstrand_member_gauge(ngx_http_upstrand_upstream_conf_t *u,
+                               ngx_uint_t gauge, time_t now)
+{
+    switch (gauge) {
+
+    case 0:
+        return u->state->failures > 0;
+
+    case 1:
+        return (time_t) u->state->ejected_until > now;
+
+    case 2:
+        return u->state->hc_down;
+
+    default:
+        return u->state->inflight;
+    }
+}
+
+
+static u_char *
+ngx_http_upstrand_hist_json(u_char *p, ngx_str_t *name,
+                            ngx_http_upstrand_histogram_t *hist)
+{
+    ngx_uint_t  i;
+
+    p = ngx_sprintf(p, ",\"%V_histogram\":{\"buckets\":[", name);
+
+    for (i = 0; i < UPSTRAND_HIST_BUCKETS; i++) {
+        p = ngx_sprintf(p, i == 0 ? "%uA" : ",%uA", hist->buckets[i]);
+    }
+
+    return ngx_sprintf(p, "],\"sum\":%uA,\"count\":%uA}",
+                       hist->sum, hist->count);
+}
+
+
+/* Prometheus buckets are cumulative, member histograms hold times which are
+ * exposed in seconds */
+
+static u_char *
+ngx_http_upstrand_hist_prometheus(u_char *p, ngx_str_t *name,
+                                  ngx_str_t *upstrand, ngx_str_t *upstream,
+                                  ngx_http_upstrand_histogram_t *hist)
+{
+    u_char              le[NGX_INT_T_LEN + 16];
+    ngx_uint_t          i, bound;
+    ngx_atomic_uint_t   total = 0;
+
+    for (i = 0; i < UPSTRAND_HIST_BUCKETS; i++) {
+        total += hist->buckets[i];
+        bound = (ngx_uint_t) 1 << i;
+
+        if (i == UPSTRAND_HIST_BUCKETS - 1) {
+            ngx_sprintf(le, "+Inf%Z");
+
+        } else if (upstream != NULL) {
+            ngx_sprintf(le, "%ui.%03ui%Z", bound / 1000, bound % 1000);
+
+        } else {
+            ngx_sprintf(le, "%ui%Z", bound);
+        }
+
+        if (upstream == NULL) {
+            p = ngx_sprintf(p, "upstrand_%V_bucket{upstrand=\"%V\",le=\"%s\"} "
+                            "%uA\n", name, upstrand, le, total);
+
+        } else {
+            p = ngx_sprintf(p, "upstrand_upstream_%V_seconds_bucket"
+                            "{upstrand=\"%V\",upstream=\"%V\",le=\"%s\"} "
+                            "%uA\n", name, upstrand, upstream, le, total);
+        }
+    }
 
-    char                                     *rv;
-    ngx_str_t                                *value, name;
-    ngx_conf_t                                save;
-    ngx_http_variable_t                      *var;
-    ngx_str_t                                 var_name;
-    ngx_http_upstrand_conf_t                 *upstrand;
-    ngx_http_upstrand_conf_ctx_t              ctx;
-    ngx_uint_t                                u_nelts, bu_nelts;
+    if (upstream == NULL) {
+        return ngx_sprintf(p, "upstrand_%V_sum{upstrand=\"%V\"} %uA\n"
+                           "upstrand_%V_count{upstrand=\"%V\"} %uA\n",
+                           name, upstrand, hist->sum,
+                           name, upstrand, hist->count);
+    }
 
-    upstrand = ngx_array_push(&mcf->upstrands);
-    if (upstrand == NULL) {
+    return ngx_sprintf(p, "upstrand_upstream_%V_seconds_sum"
+                       "{upstrand=\"%V\",upstream=\"%V\"} %uA.%03uA\n"
+                       "upstrand_upstream_%V_seconds_count"
+                       "{upstrand=\"%V\",upstream=\"%V\"} %uA\n",
+                       name, upstrand, upstream,
+                       hist->sum / 1000, hist->sum % 1000,
+                       name, upstrand, upstream, hist->count);
+}
+
+
+static ngx_http_upstrand_alias_t *
+ngx_http_upstrand_alias_table(ngx_conf_t *cf, ngx_array_t *upstreams)
+{
+    ngx_uint_t                          i, n, total;
+    ngx_uint_t                         *p;
+    ngx_http_upstrand_alias_t          *alias;
+    ngx_http_upstrand_upstream_conf_t  *elts = upstreams->elts;
+
+    n = upstreams->nelts;
+
+    /* upstreams with zero weight only take part in failover, but some
+     * upstream must start requests */
+    total = 0;
+    for (i = 0; i < n; i++) {
+        total += elts[i].weight;
+    }
+
+    if (total == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "all upstreams of a cycle "
+                           "have zero weights");
+        return NULL;
+    }
+
+    alias = ngx_palloc(cf->pool, n * sizeof(ngx_http_upstrand_alias_t));
+    p = ngx_palloc(cf->temp_pool, 3 * n * sizeof(ngx_uint_t));
+    if (alias == NULL || p == NULL) {
+        return NULL;
+    }
+
+    ngx_http_upstrand_alias_build(alias, p, upstreams);
+
+    return alias;
+}
+
+
+/* p must have room for 3 * n elements */
+
+static void
+ngx_http_upstrand_alias_build(ngx_http_upstrand_alias_t *alias, ngx_uint_t *p,
+                              ngx_array_t *upstreams)
+{
+    ngx_uint_t                          i, n, l, g, total;
+    ngx_uint_t                         *small, *large;
+    ngx_uint_t                          nsmall = 0, nlarge = 0;
+    ngx_http_upstrand_upstream_conf_t  *elts = upstreams->elts;
+
+    n = upstreams->nelts;
+
+    small = p + n;
+    large = small + n;
+
+    total = 0;
+    for (i = 0; i < n; i++) {
+        total += ngx_http_upstrand_weight(&elts[i]);
+    }
+
+    /* weights are scaled by the number of upstreams so that the average
+     * scaled weight equals the total weight and everything stays integer */
+    for (i = 0; i < n; i++) {
+        p[i] = ngx_http_upstrand_weight(&elts[i]) * n;
+        alias[i].total = total;
+        alias[i].alias = i;
+
+        if (p[i] < total) {
+            small[nsmall++] = i;
+        } else {
+            large[nlarge++] = i;
+        }
+    }
+
+    while (nsmall > 0 && nlarge > 0) {
+        l = small[--nsmall];
+        g = large[--nlarge];
+
+        alias[l].prob = p[l];
+        alias[l].alias = g;
+
+        p[g] = p[g] + p[l] - total;
+
+        if (p[g] < total) {
+            small[nsmall++] = g;
+        } else {
+            large[nlarge++] = g;
+        }
+    }
+
+    while (nlarge > 0) {
+        alias[large[--nlarge]].prob = total;
+    }
+
+    /* not reachable with exact integer arithmetic */
+    while (nsmall > 0) {
+        alias[small[--nsmall]].prob = total;
+    }
+}
+
+
+/* weights changed in upstrand_api are applied by every worker on its own,
+ * when the allocation fails the old weights stay until the next request */
+
+static void
+ngx_http_upstrand_reload_weights(ngx_http_upstrand_conf_t *upstrand)
+{
+    ngx_uint_t          n, *p;
+    ngx_atomic_uint_t   gen;
+
+    gen = upstrand->shm->weights_gen;
+
+    n = ngx_max(upstrand->upstreams.nelts, upstrand->b_upstreams.nelts);
+
+    p = ngx_alloc(3 * n * sizeof(ngx_uint_t), ngx_cycle->log);
+    if (p == NULL) {
+        return;
+    }
+
+    if (upstrand->upstreams.nelts > 0) {
+        ngx_http_upstrand_alias_build(upstrand->alias, p,
+                                      &upstrand->upstreams);
+    }
+
+    if (upstrand->b_upstreams.nelts > 0) {
+        ngx_http_upstrand_alias_build(upstrand->b_alias, p,
+                                      &upstrand->b_upstreams);
+    }
+
+    ngx_free(p);
+
+    upstrand->weights_gen = gen;
+}
+
+
+static ngx_http_upstrand_hash_ring_t *
+ngx_http_upstrand_hash_ring(ngx_conf_t *cf, ngx_array_t *upstreams)
+{
+    ngx_uint_t                          i, j, n;
+    uint32_t                            base_hash, hash, prev_hash;
+    u_char                              prev_bytes[4];
+    ngx_str_t                          *host;
+    ngx_http_upstrand_hash_ring_t      *ring;
+    ngx_http_upstrand_hash_point_t     *point;
+    ngx_http_upstrand_upstream_conf_t  *elts = upstreams->elts;
+    ngx_http_upstream_main_conf_t      *umcf;
+    ngx_http_upstream_srv_conf_t      **uscfp;
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+    uscfp = umcf->upstreams.elts;
+
+    n = upstreams->nelts;
+
+    ring = ngx_palloc(cf->pool, sizeof(ngx_http_upstrand_hash_ring_t));
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    ring->points = ngx_palloc(cf->pool, n * UPSTRAND_HASH_POINTS
+                              * sizeof(ngx_http_upstrand_hash_point_t));
+    if (ring->points == NULL) {
+        return NULL;
+    }
+    ring->npoints = n * UPSTRAND_HASH_POINTS;
+
+    point = ring->points;
+
+    /* points depend only on names of upstreams, so that adding or removing
+     * an upstream does not move keys between the others */
+    for (i = 0; i < n; i++) {
+        host = &uscfp[elts[i].index]->host;
+
+        ngx_crc32_init(base_hash);
+        ngx_crc32_update(&base_hash, host->data, host->len);
+        ngx_crc32_update(&base_hash, (u_char *) "", 1);
+
+        prev_hash = 0;
+
+        for (j = 0; j < UPSTRAND_HASH_POINTS; j++) {
+            /* the byte order is fixed to get the same ring on all platforms */
+            prev_bytes[0] = (u_char) (prev_hash & 0xff);
+            prev_bytes[1] = (u_char) ((prev_hash >> 8) & 0xff);
+            prev_bytes[2] = (u_char) ((prev_hash >> 16) & 0xff);
+            prev_bytes[3] = (u_char) ((prev_hash >> 24) & 0xff);
+
+            hash = base_hash;
+            ngx_crc32_update(&hash, prev_bytes, 4);
+            ngx_crc32_final(hash);
+
+            point->hash = hash;
+            point->index = i;
+            point++;
+
+            prev_hash = hash;
+        }
+    }
+
+    ngx_qsort(ring->points, ring->npoints,
+              sizeof(ngx_http_upstrand_hash_point_t),
+              ngx_http_upstrand_cmp_hash_points);
+
+    return ring;
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_upstrand_cmp_hash_points(const void *one, const void *two)
+{
+    ngx_http_upstrand_hash_point_t  *first, *second;
+
+    first = (ngx_http_upstrand_hash_point_t *) one;
+    second = (ngx_http_upstrand_hash_point_t *) two;
+
+    if (first->hash < second->hash) {
+        return -1;
+    }
+
+    if (first->hash > second->hash) {
+        return 1;
+    }
+
+    /* equal hashes must not depend on the sort implementation */
+    return (first->index > second->index) - (first->index < second->index);
+}
+
+
+static char *
+ngx_http_upstrand_add_upstream(ngx_conf_t *cf, ngx_array_t *upstreams,
+    uintptr_t *members, ngx_str_t *name,
+    ngx_http_upstrand_upstream_conf_t *uconf)
+{
+    ngx_int_t                            found_idx;
+    uintptr_t                            m;
+    ngx_http_upstrand_upstream_conf_t   *u;
+    ngx_http_upstream_main_conf_t       *umcf;
+    ngx_http_upstream_srv_conf_t       **uscfp;
+
+#if (NGX_PCRE)
+    if (name->len > 1 && name->data[0] == '~') {
+        name->len -= 1;
+        name->data += 1;
+
+        return ngx_http_upstrand_regex_add_upstream(cf, upstreams, members,
+                                                    name, uconf);
+    }
+#endif
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+    uscfp = umcf->upstreams.elts;
+
+    found_idx = ngx_http_combined_upstreams_find_upstream(cf, name);
+
+    if (found_idx == NGX_ERROR) {
         return NGX_CONF_ERROR;
     }
-    ngx_memzero(upstrand, sizeof(ngx_http_upstrand_conf_t));
 
-    if (ngx_array_init(&upstrand->upstreams, cf->pool, 1,
-                       sizeof(ngx_http_upstrand_upstream_conf_t))
-            != NGX_OK
-        || ngx_array_init(&upstrand->b_upstreams, cf->pool, 1,
-                          sizeof(ngx_http_upstrand_upstream_conf_t))
-            != NGX_OK
-        || ngx_array_init(&upstrand->next_upstream_statuses, cf->pool, 1,
-                          sizeof(ngx_int_t))
-            != NGX_OK
-        || ngx_array_init(&upstrand->intercept_statuses, cf->pool, 1,
-                          sizeof(ngx_http_upstrand_intercept_status_data_t))
-            != NGX_OK)
+    if (found_idx == NGX_DECLINED) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "upstream \"%V\" is not found",
+                           name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (uscfp[found_idx]->peer.init_upstream
+        == ngx_http_upstrand_pass_init_upstream)
     {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "upstream \"%V\" is "
+                           "implicitly created by upstrand_pass", name);
         return NGX_CONF_ERROR;
     }
 
-    upstrand->order = ngx_http_upstrand_order_normal;
+    m = (uintptr_t) 1 << found_idx % (8 * sizeof(uintptr_t));
 
-    value = cf->args->elts;
-    name = value[1];
-    upstrand->name = name;
+    if (members[found_idx / (8 * sizeof(uintptr_t))] & m) {
+        return NGX_CONF_OK;
+    }
 
-    var_name.len = name.len + 9;
-    var_name.data = ngx_pnalloc(cf->pool, var_name.len);
-    if (var_name.data == NULL) {
+    u = ngx_array_push(upstreams);
+    if (u == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    *u = *uconf;
+    u->index = found_idx;
+    u->state = NULL;
+
+    members[found_idx / (8 * sizeof(uintptr_t))] |= m;
+
+    return NGX_CONF_OK;
+}
+
+
+#if (NGX_PCRE)
+
+/* the regex is matched once per upstream while reading the configuration,
+ * so it gets compiled with ngx_regex_compile() without registering captures
+ * as variables in the way ngx_http_regex_compile() does */
+
+static char *
+ngx_http_upstrand_regex_add_upstream(ngx_conf_t *cf, ngx_array_t *upstreams,
+    uintptr_t *members, ngx_str_t *name,
+    ngx_http_upstrand_upstream_conf_t *uconf)
+{
+    ngx_uint_t                           i, n;
+    uintptr_t                            m;
+    ngx_http_upstrand_upstream_conf_t   *u;
+    ngx_http_upstream_main_conf_t       *umcf;
+    ngx_http_upstream_srv_conf_t       **uscfp;
+    ngx_regex_compile_t                  rc;
+    u_char                               errstr[NGX_MAX_CONF_ERRSTR];
+
+    ngx_memzero(&rc, sizeof(ngx_regex_compile_t));
+    rc.pattern = *name;
+    rc.pool = cf->pool;
+    rc.err.len = NGX_MAX_CONF_ERRSTR;
+    rc.err.data = errstr;
+
+    if (ngx_regex_compile(&rc) != NGX_OK) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V", &rc.err);
+        return NGX_CONF_ERROR;
+    }
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        n = i / (8 * sizeof(uintptr_t));
+        m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+        /* registered upstreams need not be matched again */
+        if (members[n] & m) {
+            continue;
+        }
+
+        /* skip implicit upstreams of upstrand_pass */
+        if (uscfp[i]->peer.init_upstream
+            == ngx_http_upstrand_pass_init_upstream)
+        {
+            continue;
+        }
+
+        if (ngx_regex_exec(rc.regex, &uscfp[i]->host, NULL, 0)
+            == NGX_REGEX_NO_MATCHED)
+        {
+            continue;
+        }
+
+        u = ngx_array_push(upstreams);
+        if (u == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        *u = *uconf;
+        u->index = i;
+        u->state = NULL;
+
+        members[n] |= m;
+    }
+
+    return NGX_CONF_OK;
+}
+
+#endif
+
+
+static char *
+ngx_http_upstrand_zone(ngx_conf_t *cf, ngx_http_upstrand_conf_t *upstrand,
+                       ngx_str_t *value)
+{
+    u_char                    *p;
+    ssize_t                    size;
+    ngx_str_t                  name, s;
+    ngx_http_upstrand_conf_t  *bound;
+
+    if (value->len <= 5 || ngx_strncmp(value->data, "zone=", 5) != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                           value);
+        return NGX_CONF_ERROR;
+    }
+
+    name.data = value->data + 5;
+
+    p = ngx_strlchr(name.data, value->data + value->len, ':');
+    if (p == NULL || p == name.data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid zone \"%V\"",
+                           value);
+        return NGX_CONF_ERROR;
+    }
+
+    name.len = p - name.data;
+
+    s.data = p + 1;
+    s.len = value->data + value->len - s.data;
+
+    size = ngx_parse_size(&s);
+
+    if (size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid zone size \"%V\"",
+                           value);
+        return NGX_CONF_ERROR;
+    }
+
+    if (size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "zone \"%V\" is too small",
+                           value);
+        return NGX_CONF_ERROR;
+    }
+
+    upstrand->shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                        &ngx_http_combined_upstreams_module);
+    if (upstrand->shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    bound = upstrand->shm_zone->data;
+
+    if (bound != NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "zone \"%V\" is already "
+                           "bound to upstrand \"%V\"", &name, &bound->name);
         return NGX_CONF_ERROR;
     }
 
-    ngx_memcpy(var_name.data, "upstrand_", 9);
-    ngx_memcpy(var_name.data + 9, name.data, name.len);
+    upstrand->shm_zone->init = ngx_http_upstrand_init_zone;
+    upstrand->shm_zone->data = upstrand;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstrand_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_upstrand_conf_t  *oupstrand = data;
+
+    size_t                     len;
+    ngx_uint_t                 nelts;
+    ngx_slab_pool_t           *shpool;
+    ngx_http_upstrand_shm_t   *shm;
+    ngx_http_upstrand_conf_t  *upstrand;
+
+    upstrand = shm_zone->data;
+    nelts = upstrand->upstreams.nelts + upstrand->b_upstreams.nelts;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    /* keep the state after reload if the upstrand's upstreams did not
+     * change, otherwise allocate a new generation of the state: the previous
+     * generations are still used by old workers and get freed on later
+     * reloads when all their workers have exited */
+    if (oupstrand && oupstrand->shm->nelts == nelts
+        && oupstrand->shm->signature == upstrand->shm_signature)
+    {
+        upstrand->shm = oupstrand->shm;
+        ngx_http_upstrand_bind_state(upstrand, upstrand->shm->state,
+                                     &upstrand->shm->counters);
+
+        ngx_http_upstrand_reset_weights(oupstrand, upstrand);
+
+        ngx_shmtx_lock(&shpool->mutex);
+        ngx_http_upstrand_free_generations(shpool, upstrand->shm);
+        ngx_shmtx_unlock(&shpool->mutex);
+
+        return NGX_OK;
+    }
+
+    if (shm_zone->shm.exists) {
+        upstrand->shm = shpool->data;
+        ngx_http_upstrand_bind_state(upstrand, upstrand->shm->state,
+                                     &upstrand->shm->counters);
+
+        return NGX_OK;
+    }
+
+    if (oupstrand == NULL) {
+        len = sizeof(" in upstrand zone \"\"") + shm_zone->shm.name.len;
+
+        shpool->log_ctx = ngx_slab_alloc(shpool, len);
+        if (shpool->log_ctx == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_sprintf(shpool->log_ctx, " in upstrand zone \"%V\"%Z",
+                    &shm_zone->shm.name);
+    }
+
+    ngx_shmtx_lock(&shpool->mutex);
 
-    var = ngx_http_add_variable(cf, &var_name,
-                            NGX_HTTP_VAR_CHANGEABLE|NGX_HTTP_VAR_NOCACHEABLE);
-    if (var == NULL) {
-        return NGX_CONF_ERROR;
+    if (oupstrand != NULL) {
+        ngx_http_upstrand_free_generations(shpool, oupstrand->shm);
     }
 
-    var->get_handler = ngx_http_upstrand_variable;
-    var->data = (uintptr_t) upstrand;
+    len = sizeof(ngx_http_upstrand_shm_t)
+          + (nelts - 1) * sizeof(ngx_http_upstrand_upstream_state_t);
 
-    ctx.upstrand = upstrand;
-    ctx.cf = &save;
-    ctx.order_done = 0;
+    shm = ngx_slab_calloc_locked(shpool, len);
 
-    save = *cf;
-    cf->ctx = &ctx;
-    cf->handler = ngx_http_upstrand;
-    cf->handler_conf = conf;
+    ngx_shmtx_unlock(&shpool->mutex);
 
-    rv = ngx_conf_parse(cf, NULL);
+    if (shm == NULL) {
+        return NGX_ERROR;
+    }
 
-    *cf = save;
+    shm->signature = upstrand->shm_signature;
+    shm->nelts = nelts;
+    shm->prev = oupstrand != NULL ? oupstrand->shm : NULL;
 
-    if (rv != NGX_CONF_OK) {
-        return rv;
+    if (upstrand->order == ngx_http_upstrand_order_start_random) {
+        if (upstrand->upstreams.nelts > 0) {
+            shm->cur = ngx_http_upstrand_random(upstrand->upstreams.nelts);
+        }
+        if (upstrand->b_upstreams.nelts > 0) {
+            shm->b_cur = ngx_http_upstrand_random(
+                                            upstrand->b_upstreams.nelts);
+        }
     }
 
-    u_nelts = upstrand->upstreams.nelts;
-    bu_nelts = upstrand->b_upstreams.nelts;
+    shpool->data = shm;
 
-    if (u_nelts == 0 && bu_nelts == 0) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "no upstream registered in "
-                           "upstrand \"%V\"", &name);
-        return NGX_CONF_ERROR;
-    }
+    upstrand->shm = shm;
+    ngx_http_upstrand_bind_state(upstrand, shm->state, &shm->counters);
 
-    if (upstrand->order == ngx_http_upstrand_order_start_random &&
-        !upstrand->order_per_request)
-    {
-        if (u_nelts > 0) {
-            upstrand->cur = ngx_random() % u_nelts;
-        }
-        if (bu_nelts > 0) {
-            upstrand->b_cur = ngx_random() % bu_nelts;
+    return NGX_OK;
+}
+
+
+/* a weight edited in the configuration takes over the weight set in
+ * upstrand_api: the upstreams of both upstrands are the same and go in the
+ * same order as the signatures of the upstrands match */
+
+static void
+ngx_http_upstrand_reset_weights(ngx_http_upstrand_conf_t *oupstrand,
+                                ngx_http_upstrand_conf_t *upstrand)
+{
+    ngx_uint_t                          i, k, reset = 0;
+    ngx_array_t                        *upstreams, *oupstreams;
+    ngx_http_upstrand_upstream_conf_t  *elts, *oelts;
+
+    for (k = 0; k < 2; k++) {
+        upstreams = k == 0 ? &upstrand->upstreams : &upstrand->b_upstreams;
+        oupstreams = k == 0 ? &oupstrand->upstreams : &oupstrand->b_upstreams;
+        elts = upstreams->elts;
+        oelts = oupstreams->elts;
+
+        for (i = 0; i < upstreams->nelts; i++) {
+            if (elts[i].state->weight_set && elts[i].weight != oelts[i].weight)
+            {
+                elts[i].state->weight_set = 0;
+                reset = 1;
+            }
         }
     }
 
-    return rv;
+    if (reset) {
+        (void) ngx_atomic_fetch_add(&upstrand->shm->weights_gen, 1);
+    }
 }
 
 
-static char *
-ngx_http_upstrand(ngx_conf_t *cf, ngx_command_t *dummy, void *conf)
+/* frees generations older than shm whose workers have all exited, must be
+ * called with the zone locked; a generation that has not been used yet may be
+ * waiting for its workers to start, and therefore it is kept */
+
+static void
+ngx_http_upstrand_free_generations(ngx_slab_pool_t *shpool,
+                                   ngx_http_upstrand_shm_t *shm)
 {
-    ngx_uint_t                     i;
-    ngx_str_t                     *value;
-    ngx_http_upstrand_conf_ctx_t  *ctx;
+    ngx_http_upstrand_shm_t  *gen;
 
-    value = cf->args->elts;
-    ctx = cf->ctx;
+    while (shm->prev != NULL) {
+        gen = shm->prev;
 
-    if (cf->args->nelts == 2) {
-        if (value[0].len == 21 &&
-            ngx_strncmp(value[0].data, "next_upstream_timeout", 21) == 0)
+        if (ngx_http_upstrand_shm_prune_workers(shpool, gen) > 0
+            || !gen->used)
         {
-            time_t  timeout;
+            shm = gen;
+            continue;
+        }
 
-            if (ctx->upstrand->next_upstream_timeout) {
-                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                    "duplicate upstrand directive \"%V\"", &value[0]);
-                return NGX_CONF_ERROR;
-            }
+        shm->prev = gen->prev;
+        ngx_slab_free_locked(shpool, gen);
+    }
+}
 
-            timeout = ngx_parse_time(&value[1], 1);
 
-            if (timeout == NGX_ERROR) {
-                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                                   "bad timeout value: \"%V\"", &value[1]);
-                return NGX_CONF_ERROR;
+/* forgets workers that have exited or crashed and returns the number of
+ * workers that are still running, must be called with the zone locked; the
+ * in-flight requests of a crashed worker will never finish, so its shares
+ * get subtracted from the in-flight counters */
+
+static ngx_uint_t
+ngx_http_upstrand_shm_prune_workers(ngx_slab_pool_t *shpool,
+                                    ngx_http_upstrand_shm_t *shm)
+{
+    ngx_uint_t                        i, n = 0;
+    ngx_http_upstrand_shm_worker_t  **w, *worker;
+
+    w = &shm->workers;
+
+    while (*w != NULL) {
+        worker = *w;
+
+        if (kill(worker->pid, 0) == -1 && ngx_errno == NGX_ESRCH) {
+            for (i = 0; i < shm->nelts; i++) {
+                (void) ngx_atomic_fetch_add(&shm->state[i].inflight,
+                                -(ngx_atomic_int_t) worker->inflight[i]);
             }
 
-            ctx->upstrand->next_upstream_timeout = timeout * 1000;
-            return NGX_CONF_OK;
+            *w = worker->next;
+            ngx_slab_free_locked(shpool, worker);
+            continue;
         }
+
+        n++;
+        w = &worker->next;
     }
 
-    if (cf->args->nelts == 2 || cf->args->nelts == 3) {
-        if (value[0].len == 5 && ngx_strncmp(value[0].data, "order", 5) == 0) {
-            ngx_uint_t  done[2] = {0, 0};
+    return n;
+}
 
-            if (ctx->order_done) {
-                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                                   "duplicate upstrand directive \"%V\"",
-                                   &value[0]);
-                return NGX_CONF_ERROR;
-            }
 
-            for (i = 1; i < cf->args->nelts; i++) {
+static ngx_int_t
+ngx_http_upstrand_shm_add_worker(ngx_http_upstrand_conf_t *upstrand)
+{
+    ngx_uint_t                           i, u_nelts;
+    ngx_slab_pool_t                     *shpool;
+    ngx_http_upstrand_shm_worker_t      *worker;
+    ngx_http_upstrand_upstream_conf_t   *u_elts, *bu_elts;
 
-                if (value[i].len == 12 &&
-                    ngx_strncmp(value[i].data, "start_random", 12) == 0)
-                {
-                    if (done[0]++ > 0) {
-                        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                                    "bad upstrand directive \"%V\" content",
-                                    &value[0]);
-                        return NGX_CONF_ERROR;
-                    }
-                    ctx->upstrand->order = ngx_http_upstrand_order_start_random;
-                }
+    shpool = (ngx_slab_pool_t *) upstrand->shm_zone->shm.addr;
 
-                if (value[i].len == 11 &&
-                    ngx_strncmp(value[i].data, "per_request", 11) == 0)
-                {
-                    if (done[1]++ > 0) {
-                        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                                    "bad upstrand directive \"%V\" content",
-                                    &value[0]);
-                        return NGX_CONF_ERROR;
-                    }
-                    ctx->upstrand->order_per_request = 1;
-                }
-            }
+    ngx_shmtx_lock(&shpool->mutex);
 
-            if (done[0] + done[1] != cf->args->nelts - 1) {
-                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                                   "bad upstrand directive \"%V\" content",
-                                   &value[0]);
-                return NGX_CONF_ERROR;
-            }
+    (void) ngx_http_upstrand_shm_prune_workers(shpool, upstrand->shm);
 
-            ctx->order_done = 1;
-            return NGX_CONF_OK;
-        }
+    worker = ngx_slab_calloc_locked(shpool,
+                                    sizeof(ngx_http_upstrand_shm_worker_t)
+                                    + (upstrand->shm->nelts - 1)
+                                      * sizeof(ngx_atomic_t));
+    if (worker == NULL) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        return NGX_ERROR;
     }
 
-    if (cf->args->nelts > 1 && cf->args->nelts < 5) {
-        if (value[0].len == 8 && ngx_strncmp(value[0].data, "upstream", 8) == 0)
-        {
-            ngx_uint_t  done[2] = {0, 0};
-            time_t      blacklist_interval = 0;
+    worker->pid = ngx_pid;
+    worker->next = upstrand->shm->workers;
+    upstrand->shm->workers = worker;
+    upstrand->shm->used = 1;
 
-            for (i = 2; i < cf->args->nelts; i++) {
+    ngx_shmtx_unlock(&shpool->mutex);
 
-                if (value[i].len == 6 &&
-                    ngx_strncmp(value[i].data, "backup", 6) == 0)
-                {
-                    if (done[0]++ > 0) {
-                        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                                           "bad upstrand directive \"%V\" "
-                                           "content", &value[0]);
-                        return NGX_CONF_ERROR;
-                    }
-                }
+    /* the configuration is private to the worker after fork */
+    u_elts = upstrand->upstreams.elts;
+    bu_elts = upstrand->b_upstreams.elts;
+    u_nelts = upstrand->upstreams.nelts;
 
-                if (value[i].len > 19 &&
-                    ngx_strncmp(value[i].data, "blacklist_interval=", 19) == 0)
-                {
-                    ngx_str_t  interval = value[i];
+    for (i = 0; i < u_nelts; i++) {
+        u_elts[i].worker_inflight = &worker->inflight[i];
+    }
 
-                    if (done[1]++ > 0) {
-                        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                                           "bad upstrand directive \"%V\" "
-                                           "content", &value[0]);
-                        return NGX_CONF_ERROR;
-                    }
+    for (i = 0; i < upstrand->b_upstreams.nelts; i++) {
+        bu_elts[i].worker_inflight = &worker->inflight[u_nelts + i];
+    }
 
-                    interval.data += 19;
-                    interval.len -= 19;
+    return NGX_OK;
+}
 
-                    blacklist_interval = ngx_parse_time(&interval, 1);
 
-                    if (blacklist_interval == NGX_ERROR) {
-                        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                                "bad blacklist interval: \"%V\"", &interval);
-                        return NGX_CONF_ERROR;
-                    }
+static void
+ngx_http_upstrand_bind_state(ngx_http_upstrand_conf_t *upstrand,
+                             ngx_http_upstrand_upstream_state_t *state,
+                             ngx_http_upstrand_counters_t *counters)
+{
+    ngx_uint_t                          i;
+    ngx_http_upstrand_upstream_conf_t  *u_elts, *bu_elts;
+    ngx_uint_t                          u_nelts, bu_nelts;
 
-                }
-            }
+    u_elts = upstrand->upstreams.elts;
+    bu_elts = upstrand->b_upstreams.elts;
+    u_nelts = upstrand->upstreams.nelts;
+    bu_nelts = upstrand->b_upstreams.nelts;
 
-            if (done[0] + done[1] != cf->args->nelts - 2) {
-                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                                   "bad upstrand directive \"%V\" content",
-                                   &value[0]);
-                return NGX_CONF_ERROR;
-            }
+    for (i = 0; i < u_nelts; i++) {
+        u_elts[i].state = &state[i];
+    }
 
-            return ngx_http_upstrand_add_upstream(ctx->cf,
-                        done[0] == 0 ? &ctx->upstrand->upstreams :
-                                       &ctx->upstrand->b_upstreams, &value[1],
-                        blacklist_interval);
-        }
+    for (i = 0; i < bu_nelts; i++) {
+        bu_elts[i].state = &state[u_nelts + i];
     }
 
-    if (value[0].len == 22 &&
-        ngx_strncmp(value[0].data, "next_upstream_statuses", 22) == 0)
-    {
-        ngx_int_t  *status;
+    upstrand->counters = counters;
+}
 
-        if (cf->args->nelts < 2) {
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                               "bad upstrand directive \"%V\" content",
-                               &value[0]);
-            return NGX_CONF_ERROR;
-        }
 
-        for (i = 1; i < cf->args->nelts; i++) {
-            ngx_uint_t  invalid_status = 0;
+static uint32_t
+ngx_http_upstrand_signature(ngx_conf_t *cf, ngx_http_upstrand_conf_t *upstrand)
+{
+    ngx_uint_t                           i;
+    uint32_t                             crc;
+    ngx_http_upstrand_upstream_conf_t   *u_elts, *bu_elts;
+    ngx_http_upstream_main_conf_t       *umcf;
+    ngx_http_upstream_srv_conf_t       **uscfp;
 
-            if (value[i].len == 14 &&
-                ngx_strncmp(value[i].data, "non_idempotent", 14) == 0)
-            {
-                ctx->upstrand->retry_non_idempotent = 1;
-                continue;
-            }
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+    uscfp = umcf->upstreams.elts;
 
-            status = ngx_array_push(&ctx->upstrand->next_upstream_statuses);
-            if (status == NULL) {
-                return NGX_CONF_ERROR;
-            }
+    u_elts = upstrand->upstreams.elts;
+    bu_elts = upstrand->b_upstreams.elts;
 
-            *status = ngx_atoi(value[i].data, value[i].len);
+    ngx_crc32_init(crc);
 
-            if (*status == NGX_ERROR) {
+    for (i = 0; i < upstrand->upstreams.nelts; i++) {
+        ngx_crc32_update(&crc, uscfp[u_elts[i].index]->host.data,
+                         uscfp[u_elts[i].index]->host.len);
+        ngx_crc32_update(&crc, (u_char *) "", 1);
+    }
 
-                if (value[i].len == 3 &&
-                    ngx_strncmp(value[i].data + 1, "xx", 2) == 0)
-                {
-                    switch (value[i].data[0]) {
-                    case '4':
-                        *status = -4;
-                        break;
-                    case '5':
-                        *status = -5;
-                        break;
-                    default:
-                        invalid_status = 1;
-                        break;
-                    }
+    ngx_crc32_update(&crc, (u_char *) "\n", 1);
 
-                } else if (value[i].len == 5 &&
-                           ngx_strncmp(value[i].data, "error", 5) == 0)
-                {
-                    *status = -101;
+    for (i = 0; i < upstrand->b_upstreams.nelts; i++) {
+        ngx_crc32_update(&crc, uscfp[bu_elts[i].index]->host.data,
+                         uscfp[bu_elts[i].index]->host.len);
+        ngx_crc32_update(&crc, (u_char *) "", 1);
+    }
 
-                } else if (value[i].len == 7 &&
-                           ngx_strncmp(value[i].data, "timeout", 7) == 0)
-                {
-                    *status = -102;
+    ngx_crc32_final(crc);
 
-                } else {
-                    invalid_status = 1;
+    return crc;
+}
 
-                }
 
-                if (invalid_status) {
-                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                                       "invalid status \"%V\"", &value[i]);
-                    return NGX_CONF_ERROR;
-                }
-            }
-        }
+ngx_int_t
+ngx_http_upstrand_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                                 i;
+    ngx_http_combined_upstreams_main_conf_t   *mcf;
+    ngx_http_upstrand_conf_t                 **upstrands;
 
-        return NGX_CONF_OK;
+    if (ngx_process != NGX_PROCESS_WORKER && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    mcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                        ngx_http_combined_upstreams_module);
+    if (mcf == NULL) {
+        return NGX_OK;
     }
 
-    if (value[0].len == 18 &&
-        ngx_strncmp(value[0].data, "intercept_statuses", 18) == 0)
-    {
-        ngx_http_upstrand_intercept_status_data_t  *status;
+    upstrands = mcf->upstrands.elts;
 
-        if (cf->args->nelts < 3) {
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                               "bad upstrand directive \"%V\" content",
-                               &value[0]);
-            return NGX_CONF_ERROR;
+    for (i = 0; i < mcf->upstrands.nelts; i++) {
+        if (upstrands[i]->shm != NULL
+            && ngx_http_upstrand_shm_add_worker(upstrands[i]) != NGX_OK)
+        {
+            return NGX_ERROR;
         }
 
-        for (i = 1; i < cf->args->nelts - 1; i++) {
-            ngx_uint_t  invalid_status = 0;
+        if (upstrands[i]->health_check == NULL) {
+            continue;
+        }
 
-            status = ngx_array_push(&ctx->upstrand->intercept_statuses);
-            if (status == NULL) {
-                return NGX_CONF_ERROR;
-            }
+        if (ngx_http_upstrand_hc_init(cycle, upstrands[i]->health_check)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
 
-            status->uri = value[cf->args->nelts - 1];
-            status->value = ngx_atoi(value[i].data, value[i].len);
+    return NGX_OK;
+}
 
-            if (status->value == NGX_ERROR) {
 
-                if (value[i].len == 3 &&
-                    ngx_strncmp(value[i].data + 1, "xx", 2) == 0)
-                {
-                    switch (value[i].data[0]) {
-                    case '4':
-                        status->value = -4;
-                        break;
-                    case '5':
-                        status->value = -5;
-                        break;
-                    default:
-                        invalid_status = 1;
-                        break;
-                    }
+static ngx_int_t
+ngx_http_upstrand_hc_init(ngx_cycle_t *cycle,
+                          ngx_http_upstrand_health_check_t *hc)
+{
+    ngx_http_upstrand_conf_t        *upstrand = hc->upstrand;
+    ngx_http_upstream_main_conf_t   *umcf;
+    ngx_http_upstream_srv_conf_t   **uscfp;
 
-                } else {
-                    invalid_status = 1;
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+    uscfp = umcf->upstreams.elts;
 
-                }
+    hc->probes = ngx_pcalloc(cycle->pool,
+                             (upstrand->upstreams.nelts
+                              + upstrand->b_upstreams.nelts)
+                             * sizeof(ngx_http_upstrand_hc_probe_t));
+    if (hc->probes == NULL) {
+        return NGX_ERROR;
+    }
 
-                if (invalid_status) {
-                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                                       "invalid status \"%V\"", &value[i]);
-                    return NGX_CONF_ERROR;
-                }
-            }
-        }
+    ngx_http_upstrand_hc_add_probes(hc, &upstrand->upstreams, uscfp);
+    ngx_http_upstrand_hc_add_probes(hc, &upstrand->b_upstreams, uscfp);
 
-        return NGX_CONF_OK;
-    }
+    hc->event.handler = ngx_http_upstrand_hc_handler;
+    hc->event.data = hc;
+    hc->event.log = cycle->log;
+    hc->event.cancelable = 1;
 
-    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "bad upstrand directive \"%V\"",
-                       &value[0]);
+    /* spread the first checks of the workers over the interval */
+    ngx_add_timer(&hc->event, (ngx_msec_t) ngx_random() % hc->interval + 1);
 
-    return NGX_CONF_ERROR;
+    return NGX_OK;
 }
 
 
-char *
-ngx_http_dynamic_upstrand(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+static void
+ngx_http_upstrand_hc_add_probes(ngx_http_upstrand_health_check_t *hc,
+                                ngx_array_t *upstreams,
+                                ngx_http_upstream_srv_conf_t **uscfp)
 {
-    ngx_http_combined_upstreams_loc_conf_t  *lcf = conf;
+    ngx_uint_t                          i;
+    ngx_http_upstrand_hc_probe_t       *probe;
+    ngx_http_upstrand_upstream_conf_t  *elts = upstreams->elts;
 
-    ngx_uint_t                               i;
-    ngx_str_t                               *value;
-    ngx_http_variable_t                     *v;
-    ngx_http_upstrand_var_list_elem_t       *resvar;
-    ngx_int_t                                v_idx;
-    ngx_uint_t                              *v_idx_ptr;
+    for (i = 0; i < upstreams->nelts; i++) {
+        /* implicit upstreams have no servers to check */
+        if (uscfp[elts[i].index]->servers == NULL
+            || uscfp[elts[i].index]->servers->nelts == 0)
+        {
+            continue;
+        }
 
-    value = cf->args->elts;
+        probe = &hc->probes[hc->nprobes++];
 
-    if (value[1].len < 2 || value[1].data[0] != '$') {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "invalid variable name \"%V\"", &value[1]);
-        return NGX_CONF_ERROR;
+        probe->hc = hc;
+        probe->upstream = &elts[i];
+        probe->uscf = uscfp[elts[i].index];
     }
+}
 
-    value[1].len--;
-    value[1].data++;
 
-    resvar = ngx_array_push(&lcf->dyn_upstrands);
-    if (resvar == NULL) {
-        return NGX_CONF_ERROR;
+/* the checks are run by a single worker which holds the lease in the shared
+ * memory zone of the upstrand, another worker takes it over when the leader
+ * stops renewing it */
+
+static void
+ngx_http_upstrand_hc_handler(ngx_event_t *ev)
+{
+    ngx_http_upstrand_health_check_t  *hc = ev->data;
+
+    ngx_uint_t                         i;
+    time_t                             now, ttl;
+    ngx_atomic_uint_t                  lease;
+    ngx_http_upstrand_shm_t           *shm = hc->upstrand->shm;
+
+    if (ngx_exiting || ngx_terminate || ngx_quit) {
+        return;
     }
 
-    if (ngx_array_init(&resvar->data, cf->pool, cf->args->nelts - 2,
-                       sizeof(ngx_http_upstrand_var_handle_t)) != NGX_OK)
-    {
-        return NGX_CONF_ERROR;
+    now = ngx_time();
+    ttl = (time_t) (hc->interval / 1000) * 3 + 1;
+
+    if (shm->hc_leader != (ngx_atomic_uint_t) ngx_pid) {
+        lease = shm->hc_lease;
+
+        if ((time_t) lease >= now
+            || !ngx_atomic_cmp_set(&shm->hc_lease, lease,
+                                   (ngx_atomic_uint_t) (now + ttl)))
+        {
+            goto next;
+        }
+
+        shm->hc_leader = ngx_pid;
+
+        ngx_log_error(NGX_LOG_INFO, ev->log, 0,
+                      "worker is leading health checks in upstrand \"%V\"",
+                      &hc->upstrand->name);
     }
 
-    for (i = 2; i < cf->args->nelts; i++) {
-        ngx_http_upstrand_var_handle_t  *res;
-        ngx_int_t                        index = NGX_ERROR;
-        ngx_uint_t                       isvar;
+    shm->hc_lease = now + ttl;
 
-        res = ngx_array_push(&resvar->data);
-        if (res == NULL) {
-            return NGX_CONF_ERROR;
+    for (i = 0; i < hc->nprobes; i++) {
+        if (!hc->probes[i].busy) {
+            ngx_http_upstrand_hc_start_probe(&hc->probes[i]);
         }
+    }
 
-        isvar = value[i].len > 1 && value[i].data[0] == '$' ? 1 : 0;
-        if (!isvar) {
-            res->index = index;
-            res->key = value[i];
+next:
+
+    ngx_add_timer(ev, hc->interval);
+}
+
+
+static void
+ngx_http_upstrand_hc_start_probe(ngx_http_upstrand_hc_probe_t *probe)
+{
+    ngx_int_t                    rc;
+    ngx_uint_t                   i, n;
+    ngx_connection_t            *c;
+    ngx_http_upstream_server_t  *servers, *server = NULL;
+
+    servers = probe->uscf->servers->elts;
+    n = probe->uscf->servers->nelts;
+
+    /* the servers of the upstream are probed in turn */
+    for (i = 0; i < n; i++) {
+        server = &servers[probe->next_server++ % n];
+
+        if (!server->down && server->naddrs > 0) {
             break;
         }
+    }
 
-        value[i].len--;
-        value[i].data++;
+    if (i == n) {
+        return;
+    }
 
-        index = ngx_http_get_variable_index(cf, &value[i]);
-        if (index == NGX_ERROR) {
-            return NGX_CONF_ERROR;
+    if (probe->request.data == NULL) {
+        probe->request.data = ngx_pnalloc(ngx_cycle->pool,
+                                          sizeof("GET  HTTP/1.0" CRLF) - 1
+                                          + probe->hc->uri.len
+                                          + sizeof("Host: " CRLF) - 1
+                                          + probe->uscf->host.len
+                                          + sizeof("Connection: close" CRLF)
+                                          - 1 + sizeof(CRLF) - 1);
+        if (probe->request.data == NULL) {
+            return;
         }
 
-        res->index = index;
-        res->key = value[i];
+        probe->request.len = ngx_sprintf(probe->request.data,
+                                         "GET %V HTTP/1.0" CRLF
+                                         "Host: %V" CRLF
+                                         "Connection: close" CRLF CRLF,
+                                         &probe->hc->uri, &probe->uscf->host)
+                             - probe->request.data;
     }
 
-    v = ngx_http_add_variable(cf, &value[1], NGX_HTTP_VAR_CHANGEABLE);
-    if (v == NULL) {
-        return NGX_CONF_ERROR;
-    }
+    ngx_memzero(&probe->pc, sizeof(ngx_peer_connection_t));
 
-    v_idx = ngx_http_get_variable_index(cf, &value[1]);
-    if (v_idx == NGX_ERROR) {
-        return NGX_CONF_ERROR;
-    }
+    probe->pc.sockaddr = server->addrs[0].sockaddr;
+    probe->pc.socklen = server->addrs[0].socklen;
+    probe->pc.name = &server->addrs[0].name;
+    probe->pc.get = ngx_event_get_peer;
+    probe->pc.log = probe->hc->event.log;
+    probe->pc.log_error = NGX_ERROR_ERR;
 
-    v_idx_ptr = ngx_palloc(cf->pool, sizeof(ngx_uint_t));
-    if (v_idx_ptr == NULL) {
-        return NGX_CONF_ERROR;
+    probe->sent = 0;
+    probe->received = 0;
+
+    rc = ngx_event_connect_peer(&probe->pc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_http_upstrand_hc_finalize_probe(probe, 0);
+        return;
     }
 
-    resvar->index = v_idx;
-    *v_idx_ptr = v_idx;
+    probe->busy = 1;
 
-    v->data = (uintptr_t) v_idx_ptr;
-    v->get_handler = ngx_http_get_dynamic_upstrand_value;
+    c = probe->pc.connection;
+    c->data = probe;
+    c->log = probe->pc.log;
+    c->read->handler = ngx_http_upstrand_hc_read_handler;
+    c->write->handler = ngx_http_upstrand_hc_write_handler;
 
-    return NGX_CONF_OK;
+    /* the whole probe must fit in the interval */
+    ngx_add_timer(c->write, probe->hc->interval);
+    ngx_add_timer(c->read, probe->hc->interval);
+
+    if (rc == NGX_OK) {
+        ngx_http_upstrand_hc_write_handler(c->write);
+    }
 }
 
 
-static char *
-ngx_http_upstrand_add_upstream(ngx_conf_t *cf, ngx_array_t *upstreams,
-    ngx_str_t *name, time_t blacklist_interval)
+static void
+ngx_http_upstrand_hc_write_handler(ngx_event_t *wev)
 {
-    ngx_uint_t                           i;
-    ngx_uint_t                           found_idx;
-    ngx_http_upstrand_upstream_conf_t   *u;
-    ngx_http_upstream_main_conf_t       *umcf;
-    ngx_http_upstream_srv_conf_t       **uscfp;
+    ssize_t                        n;
+    ngx_connection_t              *c = wev->data;
+    ngx_http_upstrand_hc_probe_t  *probe = c->data;
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, wev->log, NGX_ETIMEDOUT,
+                      "health check of upstream \"%V\" timed out",
+                      &probe->uscf->host);
+        ngx_http_upstrand_hc_finalize_probe(probe, 0);
+        return;
+    }
 
-#if (NGX_PCRE)
-    if (name->len > 1 && name->data[0] == '~') {
-        name->len -= 1;
-        name->data += 1;
+    while (probe->sent < probe->request.len) {
+        n = c->send(c, probe->request.data + probe->sent,
+                    probe->request.len - probe->sent);
+
+        if (n == NGX_ERROR) {
+            ngx_http_upstrand_hc_finalize_probe(probe, 0);
+            return;
+        }
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+                ngx_http_upstrand_hc_finalize_probe(probe, 0);
+            }
+            return;
+        }
 
-        return ngx_http_upstrand_regex_add_upstream(cf, upstreams, name,
-                                                    blacklist_interval);
+        probe->sent += n;
     }
-#endif
 
-    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
-    uscfp = umcf->upstreams.elts;
+    if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
 
-    found_idx = NGX_ERROR;
+    if (c->read->ready) {
+        ngx_http_upstrand_hc_read_handler(c->read);
+    }
+}
 
-    for (i = 0; i < umcf->upstreams.nelts; i++) {
-        if (uscfp[i]->host.len == name->len &&
-            ngx_strncasecmp(uscfp[i]->host.data, name->data, name->len) == 0) {
-            found_idx = i;
-            break;
-        }
+
+static void
+ngx_http_upstrand_hc_read_handler(ngx_event_t *rev)
+{
+    ssize_t                        n;
+    ngx_int_t                      status;
+    ngx_connection_t              *c = rev->data;
+    ngx_http_upstrand_hc_probe_t  *probe = c->data;
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, rev->log, NGX_ETIMEDOUT,
+                      "health check of upstream \"%V\" timed out",
+                      &probe->uscf->host);
+        ngx_http_upstrand_hc_finalize_probe(probe, 0);
+        return;
     }
 
-    if (found_idx == (ngx_uint_t) NGX_ERROR) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "upstream \"%V\" is not found",
-                           name);
-        return NGX_CONF_ERROR;
+    /* the response may come before the request has been sent completely */
+    if (probe->sent < probe->request.len) {
+        return;
     }
 
-    for (i = 0; i < upstreams->nelts; i++) {
-        ngx_http_upstrand_upstream_conf_t  *registered = upstreams->elts;
-        if (found_idx == registered[i].index) {
-            return NGX_CONF_OK;
+    while (probe->received < UPSTRAND_HC_BUF_SIZE) {
+        n = c->recv(c, probe->response + probe->received,
+                    UPSTRAND_HC_BUF_SIZE - probe->received);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                ngx_http_upstrand_hc_finalize_probe(probe, 0);
+            }
+            return;
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            break;
         }
+
+        probe->received += n;
     }
 
-    u = ngx_array_push(upstreams);
-    if (u == NULL) {
-        return NGX_CONF_ERROR;
+    /* the status line starts with "HTTP/1.x NNN" */
+    if (probe->received < 12
+        || ngx_strncmp(probe->response, "HTTP/1.", 7) != 0
+        || probe->response[8] != ' ')
+    {
+        ngx_http_upstrand_hc_finalize_probe(probe, 0);
+        return;
     }
 
-    u->index = found_idx;
-    u->blacklist_last_occurrence = 0;
-    u->blacklist_interval = blacklist_interval;
+    status = ngx_atoi(&probe->response[9], 3);
 
-    return NGX_CONF_OK;
+    ngx_http_upstrand_hc_finalize_probe(probe, status >= NGX_HTTP_OK
+                                        && status < NGX_HTTP_BAD_REQUEST);
 }
 
 
-#if (NGX_PCRE)
+/* the state is written only by the leader and therefore needs no atomic
+ * updates */
 
-static char *
-ngx_http_upstrand_regex_add_upstream(ngx_conf_t *cf, ngx_array_t *upstreams,
-    ngx_str_t *name, time_t blacklist_interval)
+static void
+ngx_http_upstrand_hc_finalize_probe(ngx_http_upstrand_hc_probe_t *probe,
+                                    ngx_uint_t passed)
 {
-    ngx_uint_t                           i, j;
-    ngx_http_upstrand_upstream_conf_t   *u;
-    ngx_http_upstream_main_conf_t       *umcf;
-    ngx_http_upstream_srv_conf_t       **uscfp;
-    ngx_regex_compile_t                  rc;
-    u_char                               errstr[NGX_MAX_CONF_ERRSTR];
-    ngx_http_regex_t                    *re;
+    ngx_http_upstrand_upstream_state_t  *state = probe->upstream->state;
 
-    ngx_memzero(&rc, sizeof(ngx_regex_compile_t));
-    rc.pattern = *name;
-    rc.err.len = NGX_MAX_CONF_ERRSTR;
-    rc.err.data = errstr;
+    if (probe->pc.connection != NULL) {
+        ngx_close_connection(probe->pc.connection);
+        probe->pc.connection = NULL;
+    }
 
-    re = ngx_http_regex_compile(cf, &rc);
+    probe->busy = 0;
 
-    if (re == NULL) {
-        return NGX_CONF_ERROR;
-    }
+    if (passed) {
+        state->hc_fails = 0;
 
-    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
-    uscfp = umcf->upstreams.elts;
+        if (state->hc_down && ++state->hc_passes >= probe->hc->passes) {
+            state->hc_down = 0;
+            state->hc_passes = 0;
 
-    for (i = 0; i < umcf->upstreams.nelts; i++) {
-        ngx_uint_t  is_registered = 0;
+            ngx_http_upstrand_slow_start(probe->upstream, 0);
 
-        if (ngx_regex_exec(re->regex, &uscfp[i]->host, NULL, 0)
-            != NGX_REGEX_NO_MATCHED)
-        {
-            for (j = 0; j < upstreams->nelts; j++) {
-                ngx_http_upstrand_upstream_conf_t  *registered =
-                        upstreams->elts;
+            ngx_log_error(NGX_LOG_NOTICE, probe->pc.log, 0,
+                          "upstream \"%V\" in upstrand \"%V\" has passed "
+                          "health checks", &probe->uscf->host,
+                          &probe->hc->upstrand->name);
+        }
 
-                if (i == registered[j].index) {
-                    is_registered = 1;
-                    break;
-                }
-            }
+        return;
+    }
 
-            if (is_registered) {
-                continue;
-            }
+    state->hc_passes = 0;
 
-            u = ngx_array_push(upstreams);
-            if (u == NULL) {
-                return NGX_CONF_ERROR;
-            }
+    if (!state->hc_down && ++state->hc_fails >= probe->hc->fails) {
+        state->hc_down = 1;
+        state->hc_fails = 0;
 
-            u->index = i;
-            u->blacklist_last_occurrence = 0;
-            u->blacklist_interval = blacklist_interval;
-        }
+        ngx_log_error(NGX_LOG_WARN, probe->pc.log, 0,
+                      "upstream \"%V\" in upstrand \"%V\" has failed "
+                      "health checks", &probe->uscf->host,
+                      &probe->hc->upstrand->name);
     }
-
-    return NGX_CONF_OK;
 }
 
-#endif
-
 
 static ngx_http_upstrand_subrequest_ctx_t*
 ngx_http_get_upstrand_subrequest_ctx(ngx_http_request_t *r,
@@ -1599,3 +6879,44 @@ ngx_http_get_upstrand_subrequest_ctx(ngx_http_request_t *r,
     return sr_ctx;
 }
 
+
+static ngx_http_upstrand_request_ctx_t *
+ngx_http_upstrand_get_request_ctx(ngx_http_request_t *r,
+    ngx_http_upstrand_request_common_ctx_t **common)
+{
+    ngx_http_upstrand_request_ctx_t     *ctx;
+    ngx_http_upstrand_subrequest_ctx_t  *sr_ctx;
+
+    *common = NULL;
+
+    ctx = ngx_http_get_module_ctx(r->main, ngx_http_combined_upstreams_module);
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    if (r == ctx->r) {
+        *common = &ctx->common;
+        return ctx;
+    }
+
+    sr_ctx = ngx_http_get_upstrand_subrequest_ctx(r, ctx->r);
+    if (sr_ctx == NULL) {
+        return ctx;
+    }
+
+    /* a failover subrequest which started a nested upstrand acts as its
+     * main request */
+    if (sr_ctx->nested != NULL) {
+        *common = &sr_ctx->nested->common;
+        return sr_ctx->nested;
+    }
+
+    if (sr_ctx->ctx != NULL) {
+        ctx = sr_ctx->ctx;
+    }
+
+    *common = &sr_ctx->common;
+
+    return ctx;
+}
+
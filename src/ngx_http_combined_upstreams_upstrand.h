@@ -23,37 +23,95 @@
 
 typedef enum {
     ngx_http_upstrand_order_normal = 0,
-    ngx_http_upstrand_order_start_random
+    ngx_http_upstrand_order_start_random,
+    ngx_http_upstrand_order_broadcast,
+    ngx_http_upstrand_order_least_time,
+    ngx_http_upstrand_order_hash,
+    ngx_http_upstrand_order_p2c
 } ngx_http_upstrand_order_e;
 
 
+typedef enum {
+    ngx_http_upstrand_broadcast_first_2xx = 0,
+    ngx_http_upstrand_broadcast_worst,
+    ngx_http_upstrand_broadcast_all
+} ngx_http_upstrand_broadcast_policy_e;
+
+
+typedef struct ngx_http_upstrand_shm_s  ngx_http_upstrand_shm_t;
+typedef struct ngx_http_upstrand_alias_s  ngx_http_upstrand_alias_t;
+typedef struct ngx_http_upstrand_hash_ring_s  ngx_http_upstrand_hash_ring_t;
+typedef struct ngx_http_upstrand_health_check_s
+    ngx_http_upstrand_health_check_t;
+typedef struct ngx_http_upstrand_counters_s  ngx_http_upstrand_counters_t;
+
+
 typedef struct {
-    ngx_str_t                  name;
-    ngx_array_t                upstreams;
-    ngx_array_t                b_upstreams;
-    ngx_array_t                next_upstream_statuses;
-    ngx_array_t                intercept_statuses;
-    ngx_msec_t                 next_upstream_timeout;
-    ngx_int_t                  cur;
-    ngx_int_t                  b_cur;
-    ngx_http_upstrand_order_e  order;
-    ngx_uint_t                 order_per_request:1;
-    ngx_uint_t                 retry_non_idempotent:1;
+    ngx_str_t                          name;
+    ngx_array_t                        upstreams;
+    ngx_array_t                        b_upstreams;
+    ngx_array_t                        next_upstream_statuses;
+    ngx_array_t                        intercept_statuses;
+    ngx_msec_t                         next_upstream_timeout;
+    ngx_msec_t                         hedge_after;
+    ngx_uint_t                         hedge_budget;
+    ngx_uint_t                         hedge_requests;
+    ngx_uint_t                         hedges;
+    ngx_shm_zone_t                    *shm_zone;
+    ngx_http_upstrand_shm_t           *shm;
+    uint32_t                           shm_signature;
+    ngx_int_t                          cur;
+    ngx_int_t                          b_cur;
+    ngx_http_upstrand_alias_t         *alias;
+    ngx_http_upstrand_alias_t         *b_alias;
+    ngx_atomic_uint_t                  weights_gen;
+    ngx_http_complex_value_t          *hash_key;
+    ngx_http_upstrand_hash_ring_t     *ring;
+    ngx_http_upstrand_hash_ring_t     *b_ring;
+    ngx_http_upstrand_health_check_t  *health_check;
+    ngx_http_upstrand_counters_t      *counters;
+    ngx_http_upstrand_order_e          order;
+    ngx_uint_t                         broadcast_policy;
+    ngx_uint_t                         outlier_errors;
+    ngx_uint_t                         outlier_latency;
+    time_t                             outlier_interval;
+    ngx_uint_t                         outlier_max_ejected;
+    time_t                             outlier_check;
+    time_t                             histogram_reset;
+    ngx_uint_t                         order_per_request:1;
+    ngx_uint_t                         order_global:1;
+    ngx_uint_t                         retry_non_idempotent:1;
+    ngx_uint_t                         next_upstream_discard_body:1;
+    ngx_uint_t                         weighted:1;
+    ngx_uint_t                         hash_consistent:1;
+    ngx_uint_t                         slow_start:1;
+    ngx_uint_t                         outlier_detection:1;
 } ngx_http_upstrand_conf_t;
 
 
 typedef struct {
     ngx_array_t                data;
-    ngx_int_t                  index;
+    ngx_uint_t                 slot;
 } ngx_http_upstrand_var_list_elem_t;
 
 
 ngx_int_t ngx_http_upstrand_init(ngx_conf_t *cf);
+ngx_int_t ngx_http_upstrand_init_process(ngx_cycle_t *cycle);
 char *ngx_http_dynamic_upstrand(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_int_t ngx_http_dynamic_upstrand_merge(ngx_conf_t *cf,
+    ngx_http_combined_upstreams_loc_conf_t *prev,
+    ngx_http_combined_upstreams_loc_conf_t *conf);
+char *ngx_http_upstrand_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_http_upstrand_request_body_replay(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+char *ngx_http_upstrand_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_http_upstrand_api(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 ngx_int_t ngx_http_get_upstrand_path_var_value(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 ngx_int_t ngx_http_get_upstrand_status_var_value(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
+ngx_int_t ngx_http_get_upstrand_trace_json_var_value(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
 char *ngx_http_upstrand_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 
 #endif /* NGX_HTTP_COMBINED_UPSTREAMS_UPSTRAND_H */
@@ -0,0 +1,623 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  ngx_http_combined_upstreams_upstrand_core.h
+ *
+ *    Description:  request independent hot paths of upstrands: walking
+ *                  through upstreams, matching response statuses and
+ *                  rendering status variables; they depend only on basic
+ *                  Nginx types and can be built outside of Nginx
+ *
+ *        Version:  2.3
+ *        Created:  17.10.2026 02:09:07
+ *
+ *         Author:  Alexey Radkov (), 
+ *        Company:  
+ *
+ * =============================================================================
+ */
+
+#ifndef NGX_HTTP_COMBINED_UPSTREAMS_UPSTRAND_CORE_H
+#define NGX_HTTP_COMBINED_UPSTREAMS_UPSTRAND_CORE_H
+
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define UPSTREAM_VARS_SIZE (sizeof(upstream_vars) / sizeof(upstream_vars[0]))
+
+/* number of recent hop outcomes kept for outlier detection */
+#define UPSTRAND_OUTLIER_WINDOW 32
+
+/* histogram buckets have upper bounds 1, 2, 4, ... 32768 and +Inf, times are
+ * measured in milliseconds */
+#define UPSTRAND_HIST_BUCKETS 17
+
+/* seconds without samples after which the remembered header time of an
+ * upstream halves */
+#define UPSTRAND_LEAST_TIME_DECAY 10
+
+/* administrative modes of upstreams set in upstrand_api */
+#define UPSTRAND_ADMIN_UP 0
+#define UPSTRAND_ADMIN_DRAINED 1
+#define UPSTRAND_ADMIN_BLACKLISTED 2
+#define UPSTRAND_ADMIN_WHITELISTED 3
+
+
+typedef struct {
+    ngx_atomic_t                             buckets[UPSTRAND_HIST_BUCKETS];
+    ngx_atomic_t                             sum;
+    ngx_atomic_t                             count;
+} ngx_http_upstrand_histogram_t;
+
+
+/* upstream state is kept either in the upstrand's shared memory zone or, when
+ * the zone is not configured, in the worker's configuration memory */
+typedef struct {
+    ngx_atomic_t                             blacklist_last_occurrence;
+    ngx_atomic_t                             failures;
+    ngx_atomic_t                             probe;
+    ngx_atomic_t                             recovered;
+    ngx_atomic_t                             header_time;
+    ngx_atomic_t                             header_time_sampled;
+    ngx_atomic_t                             inflight;
+    ngx_atomic_t                             ejected_until;
+    ngx_atomic_t                             ejections;
+    ngx_atomic_t                             outcome;
+    ngx_atomic_t                             outcomes[UPSTRAND_OUTLIER_WINDOW];
+    ngx_atomic_t                             hc_down;
+    ngx_atomic_t                             hc_fails;
+    ngx_atomic_t                             hc_passes;
+    ngx_atomic_t                             hops;
+    ngx_atomic_t                             next_upstream;
+    ngx_atomic_t                             blacklistings;
+    ngx_atomic_t                             admin;
+    ngx_atomic_t                             weight;
+    ngx_atomic_t                             weight_set;
+    ngx_http_upstrand_histogram_t            header_time_hist;
+    ngx_http_upstrand_histogram_t            response_time_hist;
+} ngx_http_upstrand_upstream_state_t;
+
+
+typedef struct {
+    time_t                                   blacklist_interval;
+    time_t                                   blacklist_max_interval;
+    ngx_msec_t                               slow_start;
+    ngx_http_upstrand_upstream_state_t      *state;
+    ngx_atomic_t                            *worker_inflight;
+    ngx_uint_t                               index;
+    ngx_uint_t                               weight;
+} ngx_http_upstrand_upstream_conf_t;
+
+
+typedef struct {
+    uint32_t                                 hash;
+    ngx_uint_t                               index;
+} ngx_http_upstrand_hash_point_t;
+
+
+/* the failover order of a request either along the consistent hash ring or,
+ * when there are no points, in ascending order of header times of upstreams:
+ * members get resolved lazily, so that a request that does not fail over
+ * never looks further than for its first member */
+typedef struct {
+    ngx_http_upstrand_hash_point_t          *points;
+    ngx_uint_t                               npoints;
+    ngx_uint_t                               point;
+    ngx_http_upstrand_upstream_conf_t       *upstreams;
+    ngx_uint_t                               nelts;
+    time_t                                   now;
+    ngx_uint_t                               nresolved;
+    ngx_uint_t                              *elts;
+    uintptr_t                               *visited;
+} ngx_http_upstrand_order_t;
+
+
+typedef struct {
+    ngx_int_t                                value;
+    ngx_str_t                                uri;
+} ngx_http_upstrand_intercept_status_data_t;
+
+
+static const ngx_str_t upstream_vars[] =
+{
+    ngx_string("upstream_addr"),
+    ngx_string("upstream_cache_status"),
+    ngx_string("upstream_connect_time"),
+    ngx_string("upstream_header_time"),
+    ngx_string("upstream_response_length"),
+    ngx_string("upstream_response_time"),
+    ngx_string("upstream_status")
+};
+
+
+typedef struct {
+    ngx_http_request_t                      *r;
+    ngx_str_t                                upstream;
+    ngx_str_t                                data[UPSTREAM_VARS_SIZE];
+} ngx_http_upstrand_status_data_t;
+
+
+/* the state of the walk through the normal and the backup cycles of an
+ * upstrand in a request */
+typedef struct {
+    ngx_http_upstrand_upstream_conf_t       *u_elts;
+    ngx_http_upstrand_upstream_conf_t       *bu_elts;
+    ngx_http_upstrand_order_t               *u_order;
+    ngx_http_upstrand_order_t               *bu_order;
+    ngx_uint_t                               u_nelts;
+    ngx_uint_t                               bu_nelts;
+    ngx_int_t                                start_cur;
+    ngx_int_t                                start_bcur;
+    ngx_int_t                                cur;
+    ngx_int_t                                b_cur;
+    ngx_uint_t                               backup_cycle:1;
+    ngx_uint_t                               all_blacklisted:1;
+    ngx_uint_t                               force_last:1;
+} ngx_http_upstrand_walk_t;
+
+
+/* an upstream with a blacklist interval is a circuit breaker: it is closed
+ * while the upstream does not fail, open during the blacklist interval after a
+ * failure, and half-open after the interval has elapsed until a single probe
+ * request either succeeds or fails; the open interval doubles with every
+ * failure of a probe up to the max blacklist interval */
+
+static ngx_inline time_t
+ngx_http_upstrand_open_interval(ngx_http_upstrand_upstream_conf_t *u,
+                                ngx_atomic_uint_t failures)
+{
+    time_t  interval = u->blacklist_interval;
+
+    while (--failures > 0 && interval < u->blacklist_max_interval) {
+        interval *= 2;
+    }
+
+    return ngx_max(ngx_min(interval, u->blacklist_max_interval),
+                   u->blacklist_interval);
+}
+
+
+static ngx_inline ngx_uint_t
+ngx_http_upstrand_is_available(ngx_http_upstrand_upstream_conf_t *u,
+                               time_t now)
+{
+    ngx_atomic_uint_t  failures;
+
+    /* lock-free reads: the state may be concurrently updated by other workers
+     * when it lives in a shared memory zone */
+    if ((time_t) u->state->ejected_until > now || u->state->hc_down) {
+        return 0;
+    }
+
+    failures = u->state->failures;
+
+    if (failures == 0) {
+        return 1;
+    }
+
+    if (now - (time_t) u->state->blacklist_last_occurrence
+        < ngx_http_upstrand_open_interval(u, failures))
+    {
+        return 0;
+    }
+
+    /* an unanswered probe gets replaced after the blacklist interval */
+    return now - (time_t) u->state->probe >= u->blacklist_interval;
+}
+
+
+static ngx_inline ngx_uint_t
+ngx_http_upstrand_is_blacklisted(ngx_http_upstrand_upstream_conf_t *u,
+                                 time_t now)
+{
+    ngx_atomic_uint_t  probe;
+
+    switch (u->state->admin) {
+
+    case UPSTRAND_ADMIN_WHITELISTED:
+        return 0;
+
+    case UPSTRAND_ADMIN_DRAINED:
+    case UPSTRAND_ADMIN_BLACKLISTED:
+        return 1;
+    }
+
+    if ((time_t) u->state->ejected_until > now || u->state->hc_down) {
+        return 1;
+    }
+
+    if (u->state->failures == 0) {
+        return 0;
+    }
+
+    probe = u->state->probe;
+
+    if (!ngx_http_upstrand_is_available(u, now)) {
+        return 1;
+    }
+
+    /* the breaker is half-open: the caller becomes the probe if no other
+     * worker has managed to become it */
+    return !ngx_atomic_cmp_set(&u->state->probe, probe,
+                               (ngx_atomic_uint_t) now);
+}
+
+
+/* drained upstreams are the best last resort when all upstreams are
+ * blacklisted, and forcibly blacklisted upstreams are the worst */
+
+static ngx_inline ngx_uint_t
+ngx_http_upstrand_admin_rank(ngx_http_upstrand_upstream_conf_t *u)
+{
+    switch (u->state->admin) {
+
+    case UPSTRAND_ADMIN_DRAINED:
+        return 0;
+
+    case UPSTRAND_ADMIN_BLACKLISTED:
+        return 2;
+
+    default:
+        return 1;
+    }
+}
+
+
+/* upstreams drained or blacklisted in upstrand_api are not available for
+ * starting requests either */
+
+static ngx_inline ngx_uint_t
+ngx_http_upstrand_is_startable(ngx_http_upstrand_upstream_conf_t *u,
+                               time_t now)
+{
+    switch (u->state->admin) {
+
+    case UPSTRAND_ADMIN_WHITELISTED:
+        return 1;
+
+    case UPSTRAND_ADMIN_DRAINED:
+    case UPSTRAND_ADMIN_BLACKLISTED:
+        return 0;
+    }
+
+    return ngx_http_upstrand_is_available(u, now);
+}
+
+
+/* the average header time of an upstream that has not been sampled for a while
+ * halves every UPSTRAND_LEAST_TIME_DECAY seconds, and therefore a penalized
+ * upstream eventually gets requests again and a chance to prove recovery */
+
+static ngx_inline ngx_atomic_uint_t
+ngx_http_upstrand_header_time(ngx_http_upstrand_upstream_conf_t *u,
+                              time_t now)
+{
+    time_t             elapsed;
+    ngx_atomic_uint_t  value;
+
+    value = u->state->header_time;
+    elapsed = now - (time_t) u->state->header_time_sampled;
+
+    if (elapsed < UPSTRAND_LEAST_TIME_DECAY) {
+        return value;
+    }
+
+    elapsed /= UPSTRAND_LEAST_TIME_DECAY;
+
+    return elapsed < (time_t) (8 * sizeof(ngx_atomic_uint_t)) ?
+            value >> elapsed : 0;
+}
+
+
+static ngx_inline ngx_uint_t
+ngx_http_upstrand_order_visit(ngx_http_upstrand_order_t *order,
+                              ngx_uint_t index)
+{
+    ngx_uint_t  bits = 8 * sizeof(uintptr_t);
+
+    if (order->visited[index / bits] & ((uintptr_t) 1 << index % bits)) {
+        return 0;
+    }
+
+    order->visited[index / bits] |= (uintptr_t) 1 << index % bits;
+
+    return 1;
+}
+
+
+/* upstreams that are available come first, then the least header time wins:
+ * upstreams that have never responded get probed first, ties go to the first
+ * configured upstream */
+
+static ngx_inline ngx_uint_t
+ngx_http_upstrand_order_fastest(ngx_http_upstrand_order_t *order)
+{
+    ngx_uint_t                          i, best = 0, bits;
+    ngx_uint_t                          rank, best_rank = 2;
+    ngx_atomic_uint_t                   value, min = (ngx_atomic_uint_t) -1;
+    ngx_http_upstrand_upstream_conf_t  *u;
+
+    bits = 8 * sizeof(uintptr_t);
+
+    for (i = 0; i < order->nelts; i++) {
+        if (order->visited[i / bits] & ((uintptr_t) 1 << i % bits)) {
+            continue;
+        }
+
+        u = &order->upstreams[i];
+        rank = !ngx_http_upstrand_is_startable(u, order->now);
+        value = ngx_http_upstrand_header_time(u, order->now);
+
+        if (rank < best_rank || (rank == best_rank && value < min)) {
+            best_rank = rank;
+            min = value;
+            best = i;
+
+            if (rank == 0 && value == 0) {
+                break;
+            }
+        }
+    }
+
+    return best;
+}
+
+
+static ngx_inline ngx_uint_t
+ngx_http_upstrand_order_index(ngx_http_upstrand_order_t *order, ngx_uint_t i)
+{
+    ngx_uint_t  index;
+
+    while (order->nresolved <= i) {
+
+        if (order->points == NULL) {
+            index = ngx_http_upstrand_order_fastest(order);
+            (void) ngx_http_upstrand_order_visit(order, index);
+
+        } else {
+            /* every upstream has points on the ring, and therefore the walk
+             * finds the next distinct upstream while there are unresolved
+             * ones */
+            index = order->points[order->point].index;
+            order->point = (order->point + 1) % order->npoints;
+
+            if (!ngx_http_upstrand_order_visit(order, index)) {
+                continue;
+            }
+        }
+
+        order->elts[order->nresolved++] = index;
+    }
+
+    return order->elts[i];
+}
+
+
+static ngx_inline ngx_http_upstrand_upstream_conf_t *
+ngx_http_upstrand_member(ngx_http_upstrand_upstream_conf_t *elts,
+                         ngx_http_upstrand_order_t *order, ngx_uint_t i)
+{
+    /* the order is a permutation of the upstreams when it is set */
+    return &elts[order == NULL ? i : ngx_http_upstrand_order_index(order, i)];
+}
+
+
+static ngx_inline ngx_uint_t
+ngx_http_upstrand_least_recently_failed(
+    ngx_http_upstrand_upstream_conf_t *elts, ngx_http_upstrand_order_t *order,
+    ngx_uint_t nelts)
+{
+    ngx_uint_t                          i, pos = 0;
+    ngx_uint_t                          rank, min_rank = (ngx_uint_t) -1;
+    ngx_atomic_uint_t                   value, min = (ngx_atomic_uint_t) -1;
+    ngx_http_upstrand_upstream_conf_t  *u;
+
+    for (i = 0; i < nelts; i++) {
+        u = ngx_http_upstrand_member(elts, order, i);
+        rank = ngx_http_upstrand_admin_rank(u);
+        value = u->state->blacklist_last_occurrence;
+
+        if (rank < min_rank || (rank == min_rank && value < min)) {
+            min_rank = rank;
+            min = value;
+            pos = i;
+        }
+    }
+
+    return pos;
+}
+
+
+/* skips blacklisted upstreams starting from the current ones, the cursor of
+ * the normal cycle may switch to the backup cycle; when all upstreams have
+ * been skipped, all_blacklisted gets set */
+
+static ngx_inline void
+ngx_http_upstrand_walk(ngx_http_upstrand_walk_t *w, time_t now)
+{
+    ngx_int_t  start_cur, start_bcur, cur_cur, cur_bcur, old;
+
+    start_cur = cur_cur = w->cur;
+    start_bcur = cur_bcur = w->b_cur;
+
+    for ( ;; ) {
+        if (w->backup_cycle) {
+            if (w->bu_nelts > 0) {
+                if (ngx_http_upstrand_is_blacklisted(
+                        ngx_http_upstrand_member(w->bu_elts, w->bu_order,
+                                                 cur_bcur), now))
+                {
+                    old = cur_bcur;
+
+                    cur_bcur = (cur_bcur + 1) % w->bu_nelts;
+                    if (cur_bcur == w->start_bcur) {
+                        w->force_last = 1;
+                    } else if (!w->force_last) {
+                        w->b_cur = old;
+                    }
+                    if (cur_bcur == start_bcur) {
+                        w->all_blacklisted = 1;
+                        break;
+                    }
+                } else {
+                    break;
+                }
+            } else {
+                w->all_blacklisted = 1;
+                break;
+            }
+        } else if (w->u_nelts > 0) {
+            if (ngx_http_upstrand_is_blacklisted(
+                    ngx_http_upstrand_member(w->u_elts, w->u_order, cur_cur),
+                    now))
+            {
+                old = cur_cur;
+
+                cur_cur = (cur_cur + 1) % w->u_nelts;
+                if (w->bu_nelts == 0 && cur_cur == w->start_cur) {
+                    w->force_last = 1;
+                } else if (!w->force_last) {
+                    w->cur = old;
+                }
+                if (cur_cur == start_cur) {
+                    w->backup_cycle = 1;
+                }
+            } else {
+                break;
+            }
+        }
+    }
+}
+
+
+/* statuses -4 and -5 stand for classes 4xx and 5xx, -101 and -102 stand for
+ * errors and timeouts of connecting to the upstream */
+
+static ngx_inline ngx_uint_t
+ngx_http_upstrand_is_next_upstream_status(ngx_int_t *statuses, ngx_uint_t n,
+                                          ngx_int_t status,
+                                          ngx_uint_t no_connection)
+{
+    ngx_uint_t  i;
+
+    for (i = 0; i < n; i++) {
+
+        if ((statuses[i] == -4 && status >= 400 && status < 500)
+            ||
+            (statuses[i] == -5 && status >= 500 && status < 600)
+            ||
+            statuses[i] == status
+            ||
+            (statuses[i] == -101
+             && status == NGX_HTTP_BAD_GATEWAY && no_connection)
+            ||
+            (statuses[i] == -102
+             && status == NGX_HTTP_GATEWAY_TIME_OUT && no_connection))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static ngx_inline ngx_int_t
+ngx_http_upstrand_intercept_statuses(ngx_array_t *statuses, ngx_int_t status,
+                                     ngx_str_t *uri)
+{
+    ngx_uint_t                                  i;
+    ngx_http_upstrand_intercept_status_data_t  *elts;
+
+    elts = statuses->elts;
+
+    for (i = 0; i < statuses->nelts; i++) {
+        if ((elts[i].value == -4 && status >= 400 && status < 500)
+            ||
+            (elts[i].value == -5 && status >= 500 && status < 600)
+            ||
+            elts[i].value == status)
+        {
+            *uri = elts[i].uri;
+            return NGX_OK;
+        }
+    }
+
+    return NGX_DECLINED;
+}
+
+
+/* upstrand_path looks like u1 -> u2 -> u3 */
+
+static ngx_inline size_t
+ngx_http_upstrand_path_len(ngx_http_upstrand_status_data_t *upstreams,
+                           ngx_uint_t n)
+{
+    size_t      len = 0;
+    ngx_uint_t  i;
+
+    for (i = 0; i < n; i++) {
+        len += upstreams[i].upstream.len + 4;
+    }
+
+    return len > 0 ? len - 4 : 0;
+}
+
+
+static ngx_inline u_char *
+ngx_http_upstrand_render_path(u_char *p,
+                              ngx_http_upstrand_status_data_t *upstreams,
+                              ngx_uint_t n)
+{
+    ngx_uint_t  i;
+
+    for (i = 0; i < n; i++) {
+        p = ngx_cpymem(p, upstreams[i].upstream.data,
+                       upstreams[i].upstream.len);
+        if (i < n - 1) {
+            p = ngx_cpymem(p, " -> ", 4);
+        }
+    }
+
+    return p;
+}
+
+
+/* upstrand_status and the like look like (u1) 502, (u2) 200 */
+
+static ngx_inline size_t
+ngx_http_upstrand_status_len(ngx_http_upstrand_status_data_t *upstreams,
+                             ngx_uint_t n, ngx_uint_t idx)
+{
+    size_t      len = 0;
+    ngx_uint_t  i;
+
+    for (i = 0; i < n; i++) {
+        len += upstreams[i].upstream.len + 4 + upstreams[i].data[idx].len;
+    }
+
+    return len > 0 ? len - 1 : 0;
+}
+
+
+static ngx_inline u_char *
+ngx_http_upstrand_render_status(u_char *p,
+                                ngx_http_upstrand_status_data_t *upstreams,
+                                ngx_uint_t n, ngx_uint_t idx)
+{
+    ngx_uint_t  i;
+
+    for (i = 0; i < n; i++) {
+        p = ngx_cpymem(p, i == 0 ? "(" : " (", i == 0 ? 1 : 2);
+        p = ngx_cpymem(p, upstreams[i].upstream.data,
+                       upstreams[i].upstream.len);
+        p = ngx_cpymem(p, ") ", 2);
+        p = ngx_cpymem(p, upstreams[i].data[idx].data,
+                       upstreams[i].data[idx].len);
+    }
+
+    return p;
+}
+
+#endif /* NGX_HTTP_COMBINED_UPSTREAMS_UPSTRAND_CORE_H */
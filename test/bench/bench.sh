@@ -0,0 +1,299 @@
+#!/bin/sh
+
+# Measures the cost of upstrand hops compared with a plain upstream and with
+# the native failover between servers of a single upstream.
+#
+# Nginx must be built with this module and the echo module, and be found in
+# PATH or in variable NGINX. The backends run in a separate Nginx instance so
+# that the proxy's workers do not share their memory and CPU with them.
+#
+# Tunables (environment variables):
+#   NGINX        Nginx executable (default nginx)
+#   WORKERS      number of worker processes of the proxy (default 2)
+#   CONNS        number of client connections (default 64)
+#   DURATION     duration of a scenario in seconds (default 10)
+#   LATENCY      latency of the backends in seconds, e.g. 0.005 (default 0)
+#   FAIL_RATIO   percentage of failed responses of the failing backend
+#                (default 100)
+#   FAIL_STATUS  status of failed responses, 503 or 204 (default 503)
+#   SCENARIOS    scenarios to run (default all: plain native2 native4 native8
+#                upstrand1 upstrand2 upstrand4 upstrand8)
+#
+# In scenarios nativeN and upstrandN a request walks through N - 1 failing
+# upstreams before it reaches the good one. Native failover does not retry
+# on status 204, so the native scenarios are skipped with FAIL_STATUS=204.
+
+set -e
+
+NGINX=${NGINX:-nginx}
+WORKERS=${WORKERS:-2}
+CONNS=${CONNS:-64}
+DURATION=${DURATION:-10}
+LATENCY=${LATENCY:-0}
+FAIL_RATIO=${FAIL_RATIO:-100}
+FAIL_STATUS=${FAIL_STATUS:-503}
+SCENARIOS=${SCENARIOS:-"plain native2 native4 native8
+                        upstrand1 upstrand2 upstrand4 upstrand8"}
+
+PROXY_PORT=8010
+OK_PORT=9000
+FAIL_PORT=9001
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+WORK_DIR=$(mktemp -d "${TMPDIR:-/tmp}/upstrand-bench.XXXXXX")
+
+cleanup() {
+    for instance in proxy backend
+    do
+        if [ -f "$WORK_DIR/$instance/logs/nginx.pid" ]
+        then
+            "$NGINX" -p "$WORK_DIR/$instance" -c nginx.conf -s stop \
+                2>/dev/null || true
+        fi
+    done
+    rm -rf "$WORK_DIR"
+}
+
+trap cleanup EXIT INT TERM
+
+${CC:-cc} -O2 -o "$WORK_DIR/client" "$BENCH_DIR/client.c"
+
+start_nginx() {
+    mkdir -p "$WORK_DIR/$1/logs"
+    "$NGINX" -p "$WORK_DIR/$1" -c nginx.conf
+    # wait until the pid file appears
+    for i in 1 2 3 4 5 6 7 8 9 10
+    do
+        [ -f "$WORK_DIR/$1/logs/nginx.pid" ] && break
+        sleep 0.2
+    done
+}
+
+stop_nginx() {
+    "$NGINX" -p "$WORK_DIR/$1" -c nginx.conf -s stop
+    while [ -f "$WORK_DIR/$1/logs/nginx.pid" ]
+    do
+        sleep 0.2
+    done
+}
+
+backend_location() {
+    if [ "$LATENCY" != 0 ]
+    then
+        echo "echo_sleep $LATENCY;"
+    fi
+}
+
+write_backend_conf() {
+    mkdir -p "$WORK_DIR/backend"
+
+    if [ "$FAIL_RATIO" -ge 100 ]
+    then
+        FAIL_SPLIT="* 1;"
+    elif [ "$FAIL_RATIO" -le 0 ]
+    then
+        FAIL_SPLIT="* \"\";"
+    else
+        FAIL_SPLIT="$FAIL_RATIO% 1; * \"\";"
+    fi
+
+    cat > "$WORK_DIR/backend/nginx.conf" <<EOF
+worker_processes  2;
+error_log         logs/error.log crit;
+pid               logs/nginx.pid;
+
+events {
+    worker_connections  4096;
+}
+
+http {
+    access_log          off;
+
+    split_clients "\$request_id" \$bench_fail {
+        $FAIL_SPLIT
+    }
+
+    server {
+        listen          127.0.0.1:$OK_PORT backlog=4096;
+        keepalive_requests 100000;
+
+        location / {
+            $(backend_location)
+            echo ok;
+        }
+    }
+    server {
+        listen          127.0.0.1:$FAIL_PORT backlog=4096;
+        keepalive_requests 100000;
+
+        location / {
+            if (\$bench_fail) {
+                rewrite ^ /fail last;
+            }
+            $(backend_location)
+            echo ok;
+        }
+        location /fail {
+            internal;
+            $(backend_location)
+            echo_status $FAIL_STATUS;
+            echo fail;
+        }
+    }
+}
+EOF
+}
+
+# prints the upstreams and the location of the scenario
+scenario_conf() {
+    case $1 in
+    plain)
+        cat <<EOF
+    upstream u_ok {
+        server 127.0.0.1:$OK_PORT;
+        keepalive 64;
+    }
+--- location
+            proxy_pass http://u_ok;
+EOF
+        ;;
+    native*)
+        depth=${1#native}
+        echo "    upstream u_native {"
+        i=1
+        while [ $i -lt "$depth" ]
+        do
+            echo "        server 127.0.0.1:$FAIL_PORT max_fails=0;"
+            i=$((i + 1))
+        done
+        cat <<EOF
+        server 127.0.0.1:$OK_PORT backup;
+        keepalive 64;
+    }
+--- location
+            proxy_next_upstream error timeout http_503;
+            proxy_next_upstream_tries 0;
+            proxy_pass http://u_native;
+EOF
+        ;;
+    upstrand*)
+        depth=${1#upstrand}
+        cat <<EOF
+    upstream u_ok {
+        server 127.0.0.1:$OK_PORT;
+        keepalive 64;
+    }
+EOF
+        i=1
+        while [ $i -lt "$depth" ]
+        do
+            cat <<EOF
+    upstream u_fail$i {
+        server 127.0.0.1:$FAIL_PORT;
+        keepalive 64;
+    }
+EOF
+            i=$((i + 1))
+        done
+        echo "    upstrand us1 {"
+        i=1
+        while [ $i -lt "$depth" ]
+        do
+            echo "        upstream u_fail$i;"
+            i=$((i + 1))
+        done
+        if [ "$depth" -gt 1 ]
+        then
+            echo "        upstream u_ok backup;"
+        else
+            echo "        upstream u_ok;"
+        fi
+        cat <<EOF
+        next_upstream_statuses error timeout 5xx 204;
+    }
+--- location
+            proxy_pass http://\$upstrand_us1;
+EOF
+        ;;
+    *)
+        echo "unknown scenario $1" >&2
+        return 1
+        ;;
+    esac
+}
+
+write_proxy_conf() {
+    mkdir -p "$WORK_DIR/proxy"
+
+    scenario_conf "$1" > "$WORK_DIR/scenario"
+    sed '/^--- location$/,$d' "$WORK_DIR/scenario" > "$WORK_DIR/upstreams"
+    sed '1,/^--- location$/d' "$WORK_DIR/scenario" > "$WORK_DIR/location"
+
+    cat > "$WORK_DIR/proxy/nginx.conf" <<EOF
+worker_processes  $WORKERS;
+error_log         logs/error.log crit;
+pid               logs/nginx.pid;
+
+events {
+    worker_connections  4096;
+}
+
+http {
+    access_log          off;
+
+$(cat "$WORK_DIR/upstreams")
+
+    server {
+        listen          127.0.0.1:$PROXY_PORT backlog=4096;
+        keepalive_requests 100000;
+
+        proxy_http_version 1.1;
+        proxy_set_header Connection "";
+
+        location / {
+$(cat "$WORK_DIR/location")
+        }
+    }
+}
+EOF
+}
+
+worker_rss() {
+    master=$(cat "$WORK_DIR/proxy/logs/nginx.pid")
+    rss=""
+    for pid in $(pgrep -P "$master")
+    do
+        kb=$(awk '/^VmRSS:/ { print $2 }' "/proc/$pid/status")
+        rss="$rss${rss:+,}$kb"
+    done
+    echo "$rss"
+}
+
+write_backend_conf
+start_nginx backend
+
+printf "%-12s %s\n" scenario "result (worker rss in kB)"
+
+for scenario in $SCENARIOS
+do
+    case $scenario in
+    native*)
+        if [ "$FAIL_STATUS" != 503 ]
+        then
+            printf "%-12s %s\n" "$scenario" "skipped"
+            continue
+        fi
+        ;;
+    esac
+
+    write_proxy_conf "$scenario"
+    start_nginx proxy
+
+    result=$("$WORK_DIR/client" -p $PROXY_PORT -c "$CONNS" -d "$DURATION" /)
+
+    printf "%-12s %s rss=%s\n" "$scenario" "$result" "$(worker_rss)"
+
+    stop_nginx proxy
+done
+
+stop_nginx backend
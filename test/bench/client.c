@@ -0,0 +1,460 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  client.c
+ *
+ *    Description:  a minimal HTTP/1.1 load generator for the upstrand
+ *                  benchmarks: keeps a number of keep-alive connections busy
+ *                  for a given time and reports throughput and latencies
+ *
+ * =============================================================================
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+
+#define BUF_SIZE 65536
+
+
+typedef struct {
+    int         fd;
+    size_t      sent;
+    size_t      len;
+    uint64_t    start;
+    char        buf[BUF_SIZE];
+} conn_t;
+
+
+typedef struct {
+    uint64_t   *elts;
+    size_t      nelts;
+    size_t      nalloc;
+} samples_t;
+
+
+static const char  *host = "127.0.0.1";
+static const char  *port = "8010";
+static const char  *path = "/";
+static int          nconns = 32;
+static int          duration = 10;
+
+static char         request[1024];
+static size_t       request_len;
+
+static struct addrinfo  *addr;
+
+static uint64_t     requests, errors, bad_statuses;
+static samples_t    samples;
+
+
+static uint64_t
+now_usec(void)
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static int
+add_sample(uint64_t value)
+{
+    uint64_t  *elts;
+
+    if (samples.nelts == samples.nalloc) {
+        samples.nalloc = samples.nalloc ? samples.nalloc * 2 : 65536;
+        elts = realloc(samples.elts, samples.nalloc * sizeof(uint64_t));
+        if (elts == NULL) {
+            return -1;
+        }
+        samples.elts = elts;
+    }
+
+    samples.elts[samples.nelts++] = value;
+
+    return 0;
+}
+
+
+static int
+cmp_samples(const void *one, const void *two)
+{
+    uint64_t  a = *(const uint64_t *) one, b = *(const uint64_t *) two;
+
+    return a < b ? -1 : a > b;
+}
+
+
+static uint64_t
+percentile(double p)
+{
+    size_t  i;
+
+    if (samples.nelts == 0) {
+        return 0;
+    }
+
+    i = (size_t) (p * (samples.nelts - 1) + 0.5);
+
+    return samples.elts[i];
+}
+
+
+/* returns the length of the first complete response in the buffer, 0 if the
+ * response is incomplete and -1 if it cannot be parsed; the status is put in
+ * status */
+
+static ssize_t
+parse_response(const char *buf, size_t len, int *status)
+{
+    const char  *p, *last, *end, *h;
+    size_t       size;
+    long         content_length = -1;
+    int          chunked = 0;
+
+    last = buf + len;
+
+    end = memmem(buf, len, "\r\n\r\n", 4);
+    if (end == NULL) {
+        return len == BUF_SIZE ? -1 : 0;
+    }
+
+    if (len < 12 || strncmp(buf, "HTTP/1.", 7) != 0) {
+        return -1;
+    }
+
+    *status = atoi(buf + 9);
+
+    for (h = memchr(buf, '\n', end - buf) + 1; h < end;
+         h = memchr(h, '\n', end + 2 - h) + 1)
+    {
+        if (strncasecmp(h, "Content-Length:", 15) == 0) {
+            content_length = strtol(h + 15, NULL, 10);
+
+        } else if (strncasecmp(h, "Transfer-Encoding:", 18) == 0) {
+            p = h + 18;
+            while (*p == ' ') {
+                p++;
+            }
+            chunked = strncasecmp(p, "chunked", 7) == 0;
+        }
+    }
+
+    p = end + 4;
+
+    if (!chunked) {
+        if (content_length < 0) {
+            content_length = 0;
+        }
+
+        if (last - p < content_length) {
+            return 0;
+        }
+
+        return p + content_length - buf;
+    }
+
+    for ( ;; ) {
+        end = memmem(p, last - p, "\r\n", 2);
+        if (end == NULL) {
+            return 0;
+        }
+
+        size = strtoul(p, NULL, 16);
+        p = end + 2;
+
+        if ((size_t) (last - p) < size + 2) {
+            return 0;
+        }
+
+        p += size + 2;
+
+        if (size == 0) {
+            return p - buf;
+        }
+    }
+}
+
+
+static int
+conn_open(int ep, conn_t *c)
+{
+    int                  one = 1;
+    struct epoll_event   ev;
+
+    c->fd = socket(addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd == -1) {
+        return -1;
+    }
+
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(c->fd, addr->ai_addr, addr->ai_addrlen) == -1
+        && errno != EINPROGRESS)
+    {
+        close(c->fd);
+        return -1;
+    }
+
+    c->sent = 0;
+    c->len = 0;
+    c->start = now_usec();
+
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = c;
+
+    return epoll_ctl(ep, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+
+static void
+conn_reopen(int ep, conn_t *c)
+{
+    errors++;
+
+    close(c->fd);
+
+    if (conn_open(ep, c) == -1) {
+        fprintf(stderr, "failed to reconnect: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+
+static void
+conn_write(int ep, conn_t *c)
+{
+    ssize_t             n;
+    struct epoll_event  ev;
+
+    while (c->sent < request_len) {
+        n = send(c->fd, request + c->sent, request_len - c->sent,
+                 MSG_NOSIGNAL);
+
+        if (n == -1) {
+            if (errno == EAGAIN) {
+                return;
+            }
+            conn_reopen(ep, c);
+            return;
+        }
+
+        c->sent += n;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+
+    epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+
+static void
+conn_read(int ep, conn_t *c, int record)
+{
+    int                 status;
+    ssize_t             n, rlen;
+    struct epoll_event  ev;
+
+    for ( ;; ) {
+        n = recv(c->fd, c->buf + c->len, BUF_SIZE - c->len, 0);
+
+        if (n == -1 && errno == EAGAIN) {
+            return;
+        }
+
+        if (n <= 0) {
+            conn_reopen(ep, c);
+            return;
+        }
+
+        c->len += n;
+
+        rlen = parse_response(c->buf, c->len, &status);
+
+        if (rlen == -1) {
+            conn_reopen(ep, c);
+            return;
+        }
+
+        if (rlen > 0) {
+            break;
+        }
+    }
+
+    if (record) {
+        requests++;
+
+        if (status != 200) {
+            bad_statuses++;
+        }
+
+        if (add_sample(now_usec() - c->start) == -1) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+
+    /* pipelining is not used, the rest of the buffer must be empty */
+    c->len = 0;
+    c->sent = 0;
+    c->start = now_usec();
+
+    ev.events = EPOLLOUT;
+    ev.data.ptr = c;
+
+    epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+
+    conn_write(ep, c);
+}
+
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-h host] [-p port] [-c connections] "
+            "[-d seconds] [path]\n", name);
+    exit(2);
+}
+
+
+int
+main(int argc, char **argv)
+{
+    int                  ep, i, n, opt, rc;
+    conn_t              *conns, *c;
+    uint64_t             start, warmup, elapsed, now;
+    struct addrinfo      hints;
+    struct epoll_event   events[256];
+
+    while ((opt = getopt(argc, argv, "h:p:c:d:")) != -1) {
+        switch (opt) {
+        case 'h':
+            host = optarg;
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 'c':
+            nconns = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind < argc) {
+        path = argv[optind];
+    }
+
+    if (nconns < 1 || duration < 1) {
+        usage(argv[0]);
+    }
+
+    request_len = snprintf(request, sizeof(request),
+                           "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", path, host);
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    rc = getaddrinfo(host, port, &hints, &addr);
+    if (rc != 0) {
+        fprintf(stderr, "bad address %s:%s: %s\n", host, port,
+                gai_strerror(rc));
+        return 1;
+    }
+
+    ep = epoll_create1(0);
+    if (ep == -1) {
+        perror("epoll_create1");
+        return 1;
+    }
+
+    conns = calloc(nconns, sizeof(conn_t));
+    if (conns == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    for (i = 0; i < nconns; i++) {
+        if (conn_open(ep, &conns[i]) == -1) {
+            perror("connect");
+            return 1;
+        }
+    }
+
+    /* the first second warms up the backends and is not recorded */
+    start = now_usec();
+    warmup = start + 1000000;
+    elapsed = 0;
+
+    for ( ;; ) {
+        now = now_usec();
+
+        if (now >= warmup + (uint64_t) duration * 1000000) {
+            elapsed = now - warmup;
+            break;
+        }
+
+        n = epoll_wait(ep, events, 256, 100);
+
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            return 1;
+        }
+
+        for (i = 0; i < n; i++) {
+            c = events[i].data.ptr;
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP)
+                && !(events[i].events & EPOLLIN))
+            {
+                conn_reopen(ep, c);
+                continue;
+            }
+
+            if (events[i].events & EPOLLOUT) {
+                conn_write(ep, c);
+
+            } else if (events[i].events & EPOLLIN) {
+                conn_read(ep, c, c->start >= warmup);
+            }
+        }
+    }
+
+    qsort(samples.elts, samples.nelts, sizeof(uint64_t), cmp_samples);
+
+    printf("requests=%llu errors=%llu non_200=%llu rps=%.1f "
+           "p50_us=%llu p99_us=%llu\n",
+           (unsigned long long) requests, (unsigned long long) errors,
+           (unsigned long long) bad_statuses,
+           requests * 1000000.0 / elapsed,
+           (unsigned long long) percentile(0.50),
+           (unsigned long long) percentile(0.99));
+
+    return 0;
+}
@@ -0,0 +1,430 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  microbench.c
+ *
+ *    Description:  microbenchmarks of the upstrand hot paths: walking through
+ *                  upstrands of various sizes, matching response statuses and
+ *                  rendering status variables; built outside of Nginx against
+ *                  the mock headers in directory mock, see microbench.sh
+ *
+ * =============================================================================
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+#include <ngx_http_combined_upstreams_upstrand_core.h>
+
+
+#define RUNS 7
+
+
+typedef void (*bench_pt)(void *data, ngx_uint_t iterations);
+
+
+typedef struct {
+    double      ns;
+    double      cycles;
+} result_t;
+
+
+static volatile ngx_uint_t  sink;
+static ngx_uint_t           iterations = 1000000;
+static time_t               now;
+
+
+static uint64_t
+now_nsec(void)
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static uint64_t
+now_cycles(void)
+{
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+
+static int
+cmp_doubles(const void *one, const void *two)
+{
+    double  a = *(const double *) one, b = *(const double *) two;
+
+    return a < b ? -1 : a > b;
+}
+
+
+/* runs the benchmark RUNS times and returns the medians of the costs of a
+ * single call */
+
+static result_t
+run(bench_pt bench, void *data, ngx_uint_t n)
+{
+    int        i;
+    double     ns[RUNS], cycles[RUNS];
+    uint64_t   start_ns, start_cycles;
+    result_t   res;
+
+    /* warm up caches and branch predictors */
+    bench(data, n / 10 + 1);
+
+    for (i = 0; i < RUNS; i++) {
+        start_ns = now_nsec();
+        start_cycles = now_cycles();
+
+        bench(data, n);
+
+        cycles[i] = (double) (now_cycles() - start_cycles) / n;
+        ns[i] = (double) (now_nsec() - start_ns) / n;
+    }
+
+    qsort(ns, RUNS, sizeof(double), cmp_doubles);
+    qsort(cycles, RUNS, sizeof(double), cmp_doubles);
+
+    res.ns = ns[RUNS / 2];
+    res.cycles = cycles[RUNS / 2];
+
+    return res;
+}
+
+
+static void
+report(const char *name, result_t res)
+{
+#ifdef HAVE_RDTSC
+    printf("%-40s %12.1f ns %12.1f cycles\n", name, res.ns, res.cycles);
+#else
+    printf("%-40s %12.1f ns\n", name, res.ns);
+#endif
+}
+
+
+/* walk */
+
+typedef struct {
+    ngx_http_upstrand_upstream_conf_t   *elts;
+    ngx_http_upstrand_upstream_state_t  *state;
+    ngx_uint_t                           nelts;
+} upstrand_t;
+
+
+static void
+upstrand_init(upstrand_t *us, ngx_uint_t nelts, ngx_uint_t nblacklisted)
+{
+    ngx_uint_t  i;
+
+    us->nelts = nelts;
+    us->elts = calloc(nelts, sizeof(ngx_http_upstrand_upstream_conf_t));
+    us->state = calloc(nelts, sizeof(ngx_http_upstrand_upstream_state_t));
+
+    if (us->elts == NULL || us->state == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    for (i = 0; i < nelts; i++) {
+        us->elts[i].blacklist_interval = 60;
+        us->elts[i].blacklist_max_interval = 60;
+        us->elts[i].state = &us->state[i];
+        us->elts[i].index = i;
+        us->elts[i].weight = 1;
+
+        /* the open breaker: the upstream failed right now */
+        if (i < nblacklisted) {
+            us->state[i].failures = 1;
+            us->state[i].blacklist_last_occurrence = now;
+            us->state[i].probe = now;
+        }
+    }
+}
+
+
+static void
+upstrand_free(upstrand_t *us)
+{
+    free(us->elts);
+    free(us->state);
+}
+
+
+static void
+bench_walk(void *data, ngx_uint_t n)
+{
+    upstrand_t               *us = data;
+    ngx_uint_t                i;
+    ngx_http_upstrand_walk_t  w;
+
+    for (i = 0; i < n; i++) {
+        memset(&w, 0, sizeof(w));
+
+        w.u_elts = us->elts;
+        w.u_nelts = us->nelts;
+        w.start_cur = w.cur = i % us->nelts;
+
+        ngx_http_upstrand_walk(&w, now);
+
+        sink += w.cur;
+    }
+}
+
+
+static void
+bench_least_recently_failed(void *data, ngx_uint_t n)
+{
+    upstrand_t  *us = data;
+    ngx_uint_t   i;
+
+    for (i = 0; i < n; i++) {
+        sink += ngx_http_upstrand_least_recently_failed(us->elts, NULL,
+                                                        us->nelts);
+    }
+}
+
+
+/* status matching */
+
+typedef struct {
+    ngx_int_t     *statuses;
+    ngx_uint_t     nstatuses;
+    ngx_array_t    intercept;
+    ngx_int_t      status;
+} match_t;
+
+
+static void
+bench_next_upstream(void *data, ngx_uint_t n)
+{
+    match_t     *m = data;
+    ngx_uint_t   i;
+
+    for (i = 0; i < n; i++) {
+        sink += ngx_http_upstrand_is_next_upstream_status(m->statuses,
+                                                          m->nstatuses,
+                                                          m->status, 0);
+    }
+}
+
+
+static void
+bench_intercept(void *data, ngx_uint_t n)
+{
+    match_t     *m = data;
+    ngx_uint_t   i;
+    ngx_str_t    uri;
+
+    for (i = 0; i < n; i++) {
+        sink += ngx_http_upstrand_intercept_statuses(&m->intercept, m->status,
+                                                     &uri) == NGX_OK;
+    }
+}
+
+
+/* rendering */
+
+typedef struct {
+    ngx_http_upstrand_status_data_t  *upstreams;
+    ngx_uint_t                        nelts;
+    u_char                           *buf;
+} render_t;
+
+
+static void
+render_init(render_t *rd, ngx_uint_t nelts)
+{
+    ngx_uint_t   i, j;
+    u_char      *name;
+
+    rd->nelts = nelts;
+    rd->upstreams = calloc(nelts, sizeof(ngx_http_upstrand_status_data_t));
+    /* a name and a status take far less than 64 bytes */
+    rd->buf = malloc(nelts * 64);
+
+    if (rd->upstreams == NULL || rd->buf == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    for (i = 0; i < nelts; i++) {
+        name = malloc(16);
+        if (name == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+
+        rd->upstreams[i].upstream.len = snprintf((char *) name, 16,
+                                                 "u%lu", (unsigned long) i);
+        rd->upstreams[i].upstream.data = name;
+
+        for (j = 0; j < UPSTREAM_VARS_SIZE; j++) {
+            rd->upstreams[i].data[j].len = 3;
+            rd->upstreams[i].data[j].data = (u_char *) "503";
+        }
+    }
+}
+
+
+static void
+render_free(render_t *rd)
+{
+    ngx_uint_t  i;
+
+    for (i = 0; i < rd->nelts; i++) {
+        free(rd->upstreams[i].upstream.data);
+    }
+
+    free(rd->upstreams);
+    free(rd->buf);
+}
+
+
+static void
+bench_render_path(void *data, ngx_uint_t n)
+{
+    render_t    *rd = data;
+    ngx_uint_t   i;
+    size_t       len;
+    u_char      *p;
+
+    for (i = 0; i < n; i++) {
+        len = ngx_http_upstrand_path_len(rd->upstreams, rd->nelts);
+        p = ngx_http_upstrand_render_path(rd->buf, rd->upstreams, rd->nelts);
+        sink += len + (p - rd->buf);
+    }
+}
+
+
+static void
+bench_render_status(void *data, ngx_uint_t n)
+{
+    render_t    *rd = data;
+    ngx_uint_t   i;
+    size_t       len;
+    u_char      *p;
+
+    for (i = 0; i < n; i++) {
+        len = ngx_http_upstrand_status_len(rd->upstreams, rd->nelts, 6);
+        p = ngx_http_upstrand_render_status(rd->buf, rd->upstreams,
+                                            rd->nelts, 6);
+        sink += len + (p - rd->buf);
+    }
+}
+
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-n iterations]\n", name);
+    exit(2);
+}
+
+
+int
+main(int argc, char **argv)
+{
+    char         name[64];
+    ngx_uint_t   i, n, sizes[] = { 2, 10, 100, 1000, 10000 };
+    upstrand_t   us;
+    render_t     rd;
+    match_t      m;
+
+    ngx_int_t    statuses[] = { -101, -102, 404, 204, -5 };
+
+    ngx_http_upstrand_intercept_status_data_t  intercept[] = {
+        { 404, ngx_string("/404") },
+        { 204, ngx_string("/204") },
+        { -5, ngx_string("/5xx") }
+    };
+
+    if (argc == 3 && strcmp(argv[1], "-n") == 0) {
+        iterations = strtoul(argv[2], NULL, 10);
+    } else if (argc != 1) {
+        usage(argv[0]);
+    }
+
+    if (iterations == 0) {
+        usage(argv[0]);
+    }
+
+    now = time(NULL);
+
+    /* the walk costs one check of the blacklist when no upstream is
+     * blacklisted and grows with the number of skipped upstreams */
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        /* the cost of a walk over a large upstrand grows with its size, so
+         * the number of iterations shrinks to keep the run time sane */
+        n = ngx_max(iterations / sizes[i], 100);
+
+        upstrand_init(&us, sizes[i], 0);
+        snprintf(name, sizeof(name), "walk/%lu/none_blacklisted",
+                 (unsigned long) sizes[i]);
+        report(name, run(bench_walk, &us, iterations));
+        upstrand_free(&us);
+
+        upstrand_init(&us, sizes[i], sizes[i] / 2);
+        snprintf(name, sizeof(name), "walk/%lu/half_blacklisted",
+                 (unsigned long) sizes[i]);
+        report(name, run(bench_walk, &us, n));
+        upstrand_free(&us);
+
+        upstrand_init(&us, sizes[i], sizes[i]);
+        snprintf(name, sizeof(name), "walk/%lu/all_blacklisted",
+                 (unsigned long) sizes[i]);
+        report(name, run(bench_walk, &us, n));
+        snprintf(name, sizeof(name), "least_recently_failed/%lu",
+                 (unsigned long) sizes[i]);
+        report(name, run(bench_least_recently_failed, &us, n));
+        upstrand_free(&us);
+    }
+
+    m.statuses = statuses;
+    m.nstatuses = sizeof(statuses) / sizeof(statuses[0]);
+    m.intercept.elts = intercept;
+    m.intercept.nelts = sizeof(intercept) / sizeof(intercept[0]);
+    m.intercept.size = sizeof(intercept[0]);
+
+    m.status = 200;
+    report("next_upstream_statuses/miss", run(bench_next_upstream, &m,
+                                              iterations));
+    report("intercept_statuses/miss", run(bench_intercept, &m, iterations));
+
+    m.status = 503;
+    report("next_upstream_statuses/hit_last", run(bench_next_upstream, &m,
+                                                  iterations));
+    report("intercept_statuses/hit_last", run(bench_intercept, &m,
+                                              iterations));
+
+    for (i = 0; i < 3; i++) {
+        n = ngx_max(iterations / sizes[i], 100);
+
+        render_init(&rd, sizes[i]);
+        snprintf(name, sizeof(name), "render_path/%lu",
+                 (unsigned long) sizes[i]);
+        report(name, run(bench_render_path, &rd, n));
+        snprintf(name, sizeof(name), "render_status/%lu",
+                 (unsigned long) sizes[i]);
+        report(name, run(bench_render_status, &rd, n));
+        render_free(&rd);
+    }
+
+    return 0;
+}
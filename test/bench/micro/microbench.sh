@@ -0,0 +1,23 @@
+#!/bin/sh
+
+# Builds and runs the microbenchmarks of the upstrand hot paths. They do not
+# need Nginx: the mock headers in directory mock stand in for the Nginx ones.
+#
+# Tunables (environment variables):
+#   CC           C compiler (default cc)
+#   CFLAGS       compiler flags (default -O2)
+#   ITERATIONS   number of calls in a single run of a benchmark (default
+#                1000000), walks over large upstrands use proportionally less
+
+set -e
+
+MICRO_DIR=$(cd "$(dirname "$0")" && pwd)
+SRC_DIR=$MICRO_DIR/../../../src
+WORK_DIR=$(mktemp -d "${TMPDIR:-/tmp}/upstrand-microbench.XXXXXX")
+
+trap 'rm -rf "$WORK_DIR"' EXIT INT TERM
+
+${CC:-cc} ${CFLAGS:--O2} -I "$MICRO_DIR/mock" -I "$SRC_DIR" \
+    -o "$WORK_DIR/microbench" "$MICRO_DIR/microbench.c"
+
+"$WORK_DIR/microbench" -n "${ITERATIONS:-1000000}"
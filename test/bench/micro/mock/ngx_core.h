@@ -0,0 +1,64 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  ngx_core.h
+ *
+ *    Description:  thin mocks of the Nginx core types and macros used in
+ *                  ngx_http_combined_upstreams_upstrand_core.h
+ *
+ * =============================================================================
+ */
+
+#ifndef NGX_CORE_H
+#define NGX_CORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+
+typedef intptr_t        ngx_int_t;
+typedef uintptr_t       ngx_uint_t;
+typedef unsigned char   u_char;
+typedef ngx_uint_t      ngx_msec_t;
+
+typedef long                        ngx_atomic_int_t;
+typedef unsigned long               ngx_atomic_uint_t;
+typedef volatile ngx_atomic_uint_t  ngx_atomic_t;
+
+
+typedef struct {
+    size_t      len;
+    u_char     *data;
+} ngx_str_t;
+
+
+typedef struct {
+    void        *elts;
+    ngx_uint_t   nelts;
+    size_t       size;
+    ngx_uint_t   nalloc;
+    void        *pool;
+} ngx_array_t;
+
+
+#define NGX_OK          0
+#define NGX_ERROR      -1
+#define NGX_DECLINED   -5
+
+#define ngx_inline      inline
+
+#define ngx_string(str)     { sizeof(str) - 1, (u_char *) str }
+#define ngx_null_string     { 0, NULL }
+
+#define ngx_max(val1, val2)  ((val1 < val2) ? (val2) : (val1))
+#define ngx_min(val1, val2)  ((val1 > val2) ? (val2) : (val1))
+
+#define ngx_memcpy(dst, src, n)   (void) memcpy(dst, src, n)
+#define ngx_cpymem(dst, src, n)   (((u_char *) memcpy(dst, src, n)) + (n))
+
+#define ngx_atomic_cmp_set(lock, old, set)                                    \
+    __sync_bool_compare_and_swap(lock, old, set)
+
+#endif /* NGX_CORE_H */
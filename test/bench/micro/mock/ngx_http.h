@@ -0,0 +1,24 @@
+/*
+ * =============================================================================
+ *
+ *       Filename:  ngx_http.h
+ *
+ *    Description:  thin mocks of the Nginx HTTP types and macros used in
+ *                  ngx_http_combined_upstreams_upstrand_core.h
+ *
+ * =============================================================================
+ */
+
+#ifndef NGX_HTTP_H
+#define NGX_HTTP_H
+
+#include <ngx_core.h>
+
+
+typedef struct ngx_http_request_s  ngx_http_request_t;
+
+
+#define NGX_HTTP_BAD_GATEWAY        502
+#define NGX_HTTP_GATEWAY_TIME_OUT   504
+
+#endif /* NGX_HTTP_H */
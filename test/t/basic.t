@@ -3,7 +3,7 @@
 use Test::Nginx::Socket;
 
 repeat_each(2);
-plan tests => repeat_each() * (2 * (blocks() + 3));
+plan tests => repeat_each() * (2 * (blocks() + 11));
 
 no_shuffle();
 run_tests();
@@ -70,6 +70,34 @@ __DATA__
         next_upstream_statuses error timeout non_idempotent 5xx;
         intercept_statuses 5xx /Internal/failover;
     }
+    upstrand us5 {
+        upstream u01;
+        upstream u02 weight=0;
+    }
+    upstrand us6 {
+        upstream ~^u0;
+        order hash $arg_k;
+    }
+    upstrand us7 {
+        upstream ~^u0;
+        order hash $arg_k consistent;
+    }
+    upstrand us8 {
+        upstream ~^u0;
+        next_upstream_statuses 5xx;
+        intercept_statuses 5xx /Internal/nested;
+    }
+    upstrand us9 {
+        upstream u1;
+    }
+    upstrand us10 {
+        upstream U02;
+        upstream ~^u0;
+        upstream u02;
+    }
+    upstrand us_with_a_name_that_is_too_long_for_a_default_bucket_of_the_hash_table {
+        upstream u1;
+    }
 
     proxy_read_timeout 5s;
     proxy_intercept_errors on;
@@ -153,6 +181,18 @@ __DATA__
         location /echo/us1 {
             echo $upstrand_us1;
         }
+        location /echo/us5 {
+            echo $upstrand_us5;
+        }
+        location /echo/us6 {
+            echo $upstrand_us6;
+        }
+        location /echo/us7 {
+            echo $upstrand_us7;
+        }
+        location /echo/us10 {
+            echo $upstrand_us10;
+        }
         location /dus1 {
             dynamic_upstrand $dus2 $arg_b;
             if ($arg_b) {
@@ -176,6 +216,13 @@ __DATA__
             internal;
             echo "Caught by error_page";
         }
+        location /us8 {
+            proxy_pass http://$upstrand_us8;
+        }
+        location /Internal/nested {
+            internal;
+            proxy_pass http://$upstrand_us9;
+        }
         location /Internal/failover {
             internal;
             echo_status 503;
@@ -281,3 +328,38 @@ In 8060
 ["Passed to backend1\n", "Passed to backend1\n"]
 --- error_code eval: [200, 200]
 
+=== TEST 12: upstrand with weighted start
+--- request eval
+["GET /echo/us5", "GET /echo/us5", "GET /echo/us5"]
+--- response_body eval
+["u01\n", "u01\n", "u01\n"]
+--- error_code eval: [200, 200, 200]
+
+=== TEST 13: upstrands with hash order
+--- request eval
+["GET /echo/us6?k=a", "GET /echo/us6?k=d", "GET /echo/us7?k=a",
+ "GET /echo/us7?k=b"]
+--- response_body eval
+["u02\n", "u01\n", "u01\n", "u02\n"]
+--- error_code eval: [200, 200, 200, 200]
+
+=== TEST 14: nested upstrand in failover location
+--- request
+GET /us8
+--- response_body
+Passed to backend1
+--- error_code: 200
+
+=== TEST 15: upstrand with upstreams registered more than once
+--- request eval
+["GET /echo/us10", "GET /echo/us10", "GET /echo/us10", "GET /echo/us10"]
+--- response_body eval
+["u02\n", "u01\n", "u02\n", "u01\n"]
+--- error_code eval: [200, 200, 200, 200]
+
+=== TEST 16: dynamic upstrand with a long name in mixed case
+--- request
+GET /dus1?b=US_with_a_name_that_is_too_long_for_a_default_bucket_of_the_HASH_table
+--- response_body
+Passed to backend1
+--- error_code: 200
@@ -0,0 +1,56 @@
+# vi:filetype=
+
+use Test::Nginx::Socket;
+
+repeat_each(1);
+plan tests => repeat_each() * (2 * blocks());
+
+no_shuffle();
+run_tests();
+
+__DATA__
+
+=== TEST 1: upstrand replays unbuffered request body
+--- http_config
+    upstream u01 {
+        server localhost:8040;
+    }
+    upstream b01 {
+        server localhost:8060;
+    }
+
+    upstrand us1 {
+        upstream u01;
+        upstream b01 backup;
+        next_upstream_statuses non_idempotent 5xx;
+    }
+
+    server {
+        listen       8040;
+        server_name  backend01;
+
+        location / {
+            return 503;
+        }
+    }
+    server {
+        listen       8060;
+        server_name  backend03;
+
+        location / {
+            echo_read_request_body;
+            echo_request_body;
+        }
+    }
+--- config
+        location /us1 {
+            upstrand_request_body_replay 1k;
+            proxy_request_buffering off;
+            proxy_pass http://$upstrand_us1;
+        }
+--- request
+POST /us1
+hello
+--- response_body chomp
+hello
+--- error_code: 200
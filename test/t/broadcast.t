@@ -0,0 +1,228 @@
+# vi:filetype=
+
+use Test::Nginx::Socket;
+
+repeat_each(1);
+plan tests => repeat_each() * (2 * blocks());
+
+no_shuffle();
+run_tests();
+
+__DATA__
+
+=== TEST 1: broadcast with first 2xx policy
+--- http_config
+    upstream u01 {
+        server localhost:8040;
+    }
+    upstream u02 {
+        server localhost:8050;
+    }
+    upstream u03 {
+        server localhost:8060;
+    }
+
+    upstrand us1 {
+        upstream ~^u0;
+        order broadcast;
+    }
+
+    server {
+        listen       8040;
+        server_name  backend01;
+
+        location / {
+            return 503;
+        }
+    }
+    server {
+        listen       8050;
+        server_name  backend02;
+
+        location / {
+            echo_sleep 0.5;
+            echo "In 8050";
+        }
+    }
+    server {
+        listen       8060;
+        server_name  backend03;
+
+        location / {
+            echo_sleep 1;
+            echo "In 8060";
+        }
+    }
+--- config
+        location /us1 {
+            proxy_pass http://$upstrand_us1;
+        }
+--- request
+GET /us1
+--- response_body
+In 8050
+--- error_code: 200
+
+=== TEST 2: broadcast with worst status policy
+--- http_config
+    upstream u01 {
+        server localhost:8040;
+    }
+    upstream u02 {
+        server localhost:8050;
+    }
+    upstream u03 {
+        server localhost:8060;
+    }
+
+    upstrand us1 {
+        upstream ~^u0;
+        order broadcast;
+        broadcast_policy worst;
+    }
+
+    server {
+        listen       8040;
+        server_name  backend01;
+
+        location / {
+            return 503 "In 8040\n";
+        }
+    }
+    server {
+        listen       8050;
+        server_name  backend02;
+
+        location / {
+            echo "In 8050";
+        }
+    }
+    server {
+        listen       8060;
+        server_name  backend03;
+
+        location / {
+            echo_sleep 0.5;
+            echo "In 8060";
+        }
+    }
+--- config
+        location /us1 {
+            proxy_pass http://$upstrand_us1;
+        }
+--- request
+GET /us1
+--- response_body
+In 8040
+--- error_code: 503
+
+=== TEST 3: broadcast with all-must-succeed policy
+--- http_config
+    upstream u01 {
+        server localhost:8040;
+    }
+    upstream u02 {
+        server localhost:8050;
+    }
+    upstream u03 {
+        server localhost:8060;
+    }
+
+    upstrand us1 {
+        upstream ~^u0;
+        order broadcast;
+        broadcast_policy all;
+    }
+
+    server {
+        listen       8040;
+        server_name  backend01;
+
+        location / {
+            echo "In 8040";
+        }
+    }
+    server {
+        listen       8050;
+        server_name  backend02;
+
+        location / {
+            echo "In 8050";
+        }
+    }
+    server {
+        listen       8060;
+        server_name  backend03;
+
+        location / {
+            echo_sleep 0.5;
+            echo "In 8060";
+        }
+    }
+--- config
+        location /us1 {
+            proxy_pass http://$upstrand_us1;
+        }
+--- request
+GET /us1
+--- response_body
+In 8060
+--- error_code: 200
+
+=== TEST 4: broadcast chooses response which is still arriving
+--- http_config
+    upstream u01 {
+        server localhost:8040;
+    }
+    upstream u02 {
+        server localhost:8050;
+    }
+    upstream u03 {
+        server localhost:8060;
+    }
+
+    upstrand us1 {
+        upstream ~^u0;
+        order broadcast;
+        broadcast_policy worst;
+    }
+
+    server {
+        listen       8040;
+        server_name  backend01;
+
+        location / {
+            echo_status 503;
+            echo "Start in 8040";
+            echo_flush;
+            echo_sleep 0.5;
+            echo "Finish in 8040";
+        }
+    }
+    server {
+        listen       8050;
+        server_name  backend02;
+
+        location / {
+            echo "In 8050";
+        }
+    }
+    server {
+        listen       8060;
+        server_name  backend03;
+
+        location / {
+            echo_sleep 0.2;
+            echo "In 8060";
+        }
+    }
+--- config
+        location /us1 {
+            proxy_pass http://$upstrand_us1;
+        }
+--- request
+GET /us1
+--- response_body
+Start in 8040
+Finish in 8040
+--- error_code: 503
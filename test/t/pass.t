@@ -0,0 +1,102 @@
+# vi:filetype=
+
+use Test::Nginx::Socket;
+
+repeat_each(1);
+plan tests => repeat_each() * (2 * (blocks() + 1));
+
+no_shuffle();
+run_tests();
+
+__DATA__
+
+=== TEST 1: upstrand_pass failover
+--- http_config
+    upstream u01 {
+        server localhost:8040;
+    }
+    upstream u02 {
+        server localhost:8050;
+    }
+    upstream b01 {
+        server localhost:8060;
+    }
+
+    upstrand us1 {
+        upstream ~^u0 blacklist_interval=60s;
+        upstream b01 backup;
+    }
+
+    server {
+        listen       8040;
+        server_name  backend01;
+
+        location / {
+            return 503;
+        }
+    }
+    server {
+        listen       8050;
+        server_name  backend02;
+
+        location / {
+            return 503;
+        }
+    }
+    server {
+        listen       8060;
+        server_name  backend03;
+
+        location / {
+            echo "In 8060";
+        }
+    }
+--- config
+        location /us1 {
+            upstrand_pass us1;
+            proxy_next_upstream error timeout http_503;
+        }
+--- request eval
+["GET /us1", "GET /us1"]
+--- response_body eval
+["In 8060\n", "In 8060\n"]
+--- error_code eval: [200, 200]
+
+=== TEST 2: upstrand_pass without next upstream status
+--- http_config
+    upstream u01 {
+        server localhost:8040;
+    }
+    upstream b01 {
+        server localhost:8060;
+    }
+
+    upstrand us1 {
+        upstream u01;
+        upstream b01 backup;
+    }
+
+    server {
+        listen       8040;
+        server_name  backend01;
+
+        location / {
+            return 503;
+        }
+    }
+    server {
+        listen       8060;
+        server_name  backend03;
+
+        location / {
+            echo "In 8060";
+        }
+    }
+--- config
+        location /us1 {
+            upstrand_pass us1;
+        }
+--- request
+    GET /us1
+--- response_body_like: 503 Service Temporarily Unavailable
+--- error_code: 503
@@ -3,7 +3,7 @@
 use Test::Nginx::Socket;
 
 repeat_each(1);
-plan tests => repeat_each() * (2 * (blocks() + 2));
+plan tests => repeat_each() * (2 * (blocks() + 12));
 
 no_shuffle();
 run_tests();
@@ -76,3 +76,339 @@ __DATA__
 ["Failover\n", "Failover\n", "In 8060\n"]
 --- error_code eval: [503, 503, 200]
 
+
+=== TEST 2: upstrand discards slow body of next upstream
+--- http_config
+    upstream u01 {
+        server localhost:8040;
+    }
+    upstream b01 {
+        server localhost:8060;
+    }
+
+    upstrand us1 {
+        upstream u01;
+        upstream b01 backup;
+        next_upstream_statuses 5xx;
+        next_upstream_discard_body;
+    }
+
+    server {
+        listen       8040;
+        server_name  backend01;
+
+        location / {
+            echo_status 503;
+            echo_flush;
+            echo_sleep 3;
+            echo "In 8040";
+        }
+    }
+    server {
+        listen       8060;
+        server_name  backend03;
+
+        location / {
+            echo "In 8060";
+        }
+    }
+--- config
+        location /us1 {
+            proxy_pass http://$upstrand_us1;
+        }
+--- request
+GET /us1
+--- timeout: 2s
+--- response_body
+In 8060
+--- error_code: 200
+
+=== TEST 3: upstrand hedged request
+--- http_config
+    upstream u01 {
+        server localhost:8040;
+    }
+    upstream b01 {
+        server localhost:8060;
+    }
+
+    upstrand us1 {
+        upstream u01;
+        upstream b01 backup;
+        next_upstream_statuses 5xx;
+        hedge_after 100ms budget=100%;
+    }
+
+    server {
+        listen       8040;
+        server_name  backend01;
+
+        location / {
+            echo_sleep 3;
+            echo "In 8040";
+        }
+    }
+    server {
+        listen       8060;
+        server_name  backend03;
+
+        location / {
+            echo "In 8060";
+        }
+    }
+--- config
+        location /us1 {
+            proxy_pass http://$upstrand_us1;
+        }
+--- request
+GET /us1
+--- timeout: 2s
+--- response_body
+In 8060
+--- error_code: 200
+
+=== TEST 4: upstrand with least time order
+--- http_config
+    upstream u01 {
+        server localhost:8040;
+    }
+    upstream u02 {
+        server localhost:8050;
+    }
+
+    upstrand us1 {
+        upstream ~^u0;
+        order least_time;
+    }
+
+    server {
+        listen       8040;
+        server_name  backend01;
+
+        location / {
+            echo_sleep 0.5;
+            echo "In 8040";
+        }
+    }
+    server {
+        listen       8050;
+        server_name  backend02;
+
+        location / {
+            echo "In 8050";
+        }
+    }
+--- config
+        location /us1 {
+            proxy_pass http://$upstrand_us1;
+        }
+--- request eval
+["GET /us1", "GET /us1", "GET /us1"]
+--- response_body eval
+["In 8040\n", "In 8050\n", "In 8050\n"]
+--- error_code eval: [200, 200, 200]
+
+=== TEST 5: upstrand hedged request loses to original request
+--- http_config
+    upstream u01 {
+        server localhost:8040;
+    }
+    upstream b01 {
+        server localhost:8060;
+    }
+
+    upstrand us1 {
+        upstream u01;
+        upstream b01 backup;
+        next_upstream_statuses 5xx;
+        hedge_after 100ms budget=100%;
+    }
+
+    server {
+        listen       8040;
+        server_name  backend01;
+
+        location / {
+            echo_sleep 0.5;
+            echo "In 8040";
+        }
+    }
+    server {
+        listen       8060;
+        server_name  backend03;
+
+        location / {
+            echo_sleep 3;
+            echo "In 8060";
+        }
+    }
+--- config
+        location /us1 {
+            proxy_pass http://$upstrand_us1;
+        }
+--- request
+GET /us1
+--- timeout: 2s
+--- response_body
+In 8040
+--- error_code: 200
+
+=== TEST 6: upstrand hedged request beyond budget
+--- http_config
+    upstream u01 {
+        server localhost:8040;
+    }
+    upstream b01 {
+        server localhost:8060;
+    }
+
+    upstrand us1 {
+        upstream u01;
+        upstream b01 backup;
+        next_upstream_statuses 5xx;
+        hedge_after 100ms budget=1%;
+    }
+
+    server {
+        listen       8040;
+        server_name  backend01;
+
+        location / {
+            echo_sleep 0.5;
+            echo "In 8040";
+        }
+    }
+    server {
+        listen       8060;
+        server_name  backend03;
+
+        location / {
+            echo "In 8060";
+        }
+    }
+--- config
+        location /us1 {
+            proxy_pass http://$upstrand_us1;
+        }
+--- request
+GET /us1
+--- timeout: 2s
+--- response_body
+In 8040
+--- error_code: 200
+
+=== TEST 7: upstrand hedged request fails along with original request
+--- http_config
+    upstream u01 {
+        server localhost:8040;
+    }
+    upstream b01 {
+        server localhost:8060;
+    }
+
+    upstrand us1 {
+        upstream u01;
+        upstream b01 backup;
+        next_upstream_statuses 5xx;
+        hedge_after 100ms budget=100%;
+    }
+
+    server {
+        listen       8040;
+        server_name  backend01;
+
+        location / {
+            echo_status 503;
+            echo_sleep 0.5;
+            echo "In 8040";
+        }
+    }
+    server {
+        listen       8060;
+        server_name  backend03;
+
+        location / {
+            echo_status 503;
+            echo "In 8060";
+        }
+    }
+--- config
+        location /us1 {
+            proxy_pass http://$upstrand_us1;
+        }
+--- request
+GET /us1
+--- timeout: 2s
+--- response_body
+In 8040
+--- error_code: 503
+
+=== TEST 8: upstrand with least time order fails over to next fastest upstream
+--- http_config
+    upstream u01 {
+        server localhost:8040;
+    }
+    upstream u02 {
+        server localhost:8050;
+    }
+    upstream u03 {
+        server localhost:8060;
+    }
+
+    upstrand us1 zone=us1:64k {
+        upstream ~^u0;
+        order least_time;
+        next_upstream_statuses 5xx;
+    }
+
+    server {
+        listen       8040;
+        server_name  backend01;
+
+        location / {
+            echo_sleep 0.1;
+            echo "In 8040";
+        }
+    }
+    server {
+        listen       8050;
+        server_name  backend02;
+
+        location / {
+            if ($arg_fail) {
+                return 503;
+            }
+            echo_sleep 0.01;
+            echo "In 8050";
+        }
+    }
+    server {
+        listen       8060;
+        server_name  backend03;
+
+        location / {
+            echo_sleep 0.3;
+            echo "In 8060";
+        }
+    }
+--- config
+        location /us1 {
+            proxy_pass http://$upstrand_us1;
+        }
+        location /echo/us1 {
+            echo $upstrand_us1;
+        }
+        location /api {
+            upstrand_api;
+        }
+--- request eval
+["GET /us1", "GET /us1", "GET /us1", "GET /us1?fail=1", "GET /echo/us1",
+ "POST /api?upstrand=us1&upstream=u01&mode=blacklisted", "GET /echo/us1",
+ "POST /api?upstrand=us1&upstream=u01&mode=up", "GET /echo/us1"]
+--- response_body_like eval
+[qr/^In 8040$/, qr/^In 8050$/, qr/^In 8060$/, qr/^In 8040$/, qr/^u01$/,
+ qr/\{"name":"u01","backup":false,"mode":"blacklisted","weight":1\}/,
+ qr/^u03$/,
+ qr/\{"name":"u01","backup":false,"mode":"up","weight":1\}/,
+ qr/^u01$/]
+--- error_code eval: [(200) x 9]
@@ -0,0 +1,74 @@
+# vi:filetype=
+
+use Test::Nginx::Socket;
+
+repeat_each(1);
+plan tests => repeat_each() * (4 * blocks());
+
+no_shuffle();
+run_tests();
+
+__DATA__
+
+=== TEST 1: upstrand trace in JSON across hops
+--- http_config
+    upstream u01 {
+        server localhost:8040;
+    }
+    upstream u02 {
+        server localhost:8050;
+    }
+    upstream u03 {
+        server localhost:8060;
+    }
+
+    upstrand us1 {
+        upstream ~^u0;
+        next_upstream_statuses 5xx;
+    }
+
+    log_format trace escape=none 'trace: $upstrand_trace_json';
+
+    server {
+        listen       8040;
+        server_name  backend01;
+
+        location / {
+            return 503;
+        }
+    }
+    server {
+        listen       8050;
+        server_name  backend02;
+
+        location / {
+            return 503;
+        }
+    }
+    server {
+        listen       8060;
+        server_name  backend03;
+
+        location / {
+            echo "In 8060";
+        }
+    }
+--- config
+        location /us1 {
+            # the header gets the trace before the last hop has finished, the
+            # access log (written to the error log for the check) must get it
+            # rendered anew after that
+            add_header X-Upstrand-Trace $upstrand_trace_json;
+            access_log logs/error.log trace;
+            proxy_pass http://$upstrand_us1;
+        }
+--- request
+GET /us1
+--- response_headers_like
+X-Upstrand-Trace: ^\[\{"upstream":"u01"[^}]*\},\{"upstream":"u02"[^}]*\},\{"upstream":"u03"\}\]$
+--- error_log eval
+qr/trace: \[\{"upstream":"u01",[^}]*"status":"503"\},\{"upstream":"u02",[^}]*"status":"503"\},\{"upstream":"u03",[^}]*"status":"200"\}\]/
+--- wait: 0.1
+--- response_body
+In 8060
+--- error_code: 200
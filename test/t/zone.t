@@ -0,0 +1,703 @@
+# vi:filetype=
+
+use Test::Nginx::Socket;
+
+repeat_each(1);
+plan tests => repeat_each() * (2 * (blocks() + 91));
+
+no_shuffle();
+run_tests();
+
+__DATA__
+
+=== TEST 1: upstrand with shared zone blacklisting
+--- http_config
+    upstream u01 {
+        server localhost:8040;
+    }
+    upstream u02 {
+        server localhost:8050;
+    }
+    upstream b01 {
+        server localhost:8060;
+    }
+
+    upstrand us1 zone=us1:64k {
+        upstream ~^u0 blacklist_interval=60s;
+        upstream b01 backup;
+        order start_random;
+        next_upstream_statuses error timeout 5xx;
+    }
+
+    server {
+        listen       8040;
+        server_name  backend01;
+
+        location / {
+            return 503;
+        }
+    }
+    server {
+        listen       8050;
+        server_name  backend02;
+
+        location / {
+            return 503;
+        }
+    }
+    server {
+        listen       8060;
+        server_name  backend03;
+
+        location / {
+            echo "In 8060";
+        }
+    }
+--- config
+        location /us1 {
+            proxy_pass http://$upstrand_us1;
+        }
+        location /echo/us1 {
+            echo $upstrand_us1;
+        }
+--- request eval
+["GET /us1", "GET /us1", "GET /echo/us1"]
+--- response_body eval
+["In 8060\n", "In 8060\n", "b01\n"]
+--- error_code eval: [200, 200, 200]
+
+=== TEST 2: upstrand with global round-robin cycle
+--- http_config
+    upstream u01 {
+        server localhost:8040;
+    }
+    upstream u02 {
+        server localhost:8050;
+    }
+
+    upstrand us1 zone=us1:64k {
+        upstream ~^u0;
+        order global;
+    }
+--- config
+        location /echo/us1 {
+            echo $upstrand_us1;
+        }
+--- request eval
+["GET /echo/us1", "GET /echo/us1", "GET /echo/us1"]
+--- response_body eval
+["u01\n", "u02\n", "u01\n"]
+--- error_code eval: [200, 200, 200]
+
+=== TEST 3: upstrand with power of two choices order
+--- http_config
+    upstream u01 {
+        server localhost:8040;
+    }
+    upstream u02 {
+        server localhost:8050;
+    }
+
+    upstrand us1 zone=us1:64k {
+        upstream ~^u0 blacklist_interval=60s;
+        order p2c;
+        next_upstream_statuses error timeout 5xx;
+    }
+
+    server {
+        listen       8040;
+        server_name  backend01;
+
+        location / {
+            return 503;
+        }
+    }
+    server {
+        listen       8050;
+        server_name  backend02;
+
+        location / {
+            echo "In 8050";
+        }
+    }
+--- config
+        location /us1 {
+            proxy_pass http://$upstrand_us1;
+        }
+--- request eval
+["GET /us1", "GET /us1"]
+--- response_body eval
+["In 8050\n", "In 8050\n"]
+--- error_code eval: [200, 200]
+
+=== TEST 4: upstrand with exponential blacklisting backoff
+--- http_config
+    upstream u01 {
+        server localhost:8040;
+    }
+    upstream u02 {
+        server localhost:8050;
+    }
+
+    upstrand us1 zone=us1:64k {
+        upstream u01 blacklist_interval=2s blacklist_max_interval=4s;
+        upstream u02 weight=0;
+        next_upstream_statuses error timeout 5xx;
+    }
+
+    server {
+        listen       8040;
+        server_name  backend01;
+
+        location / {
+            if ($arg_fail) {
+                return 503;
+            }
+            echo "In 8040";
+        }
+    }
+    server {
+        listen       8050;
+        server_name  backend02;
+
+        location / {
+            echo "In 8050";
+        }
+    }
+--- config
+        location /us1 {
+            proxy_pass http://$upstrand_us1;
+        }
+        location /sleep {
+            echo_sleep 2.1;
+            echo "ok";
+        }
+        location /echo/us1 {
+            echo $upstrand_us1;
+        }
+        location /status {
+            upstrand_status;
+        }
+--- request eval
+["GET /us1?fail=1", "GET /echo/us1", "GET /sleep", "GET /echo/us1",
+ "GET /echo/us1", "GET /sleep", "GET /us1?fail=1", "GET /sleep",
+ "GET /echo/us1", "GET /sleep", "GET /us1?fail=1", "GET /sleep",
+ "GET /sleep", "GET /us1", "GET /echo/us1", "GET /echo/us1", "GET /status"]
+--- response_body_like eval
+[qr/^In 8050$/, qr/^u02$/, qr/^ok$/, qr/^u01$/,
+ qr/^u02$/, qr/^ok$/, qr/^In 8050$/, qr/^ok$/,
+ qr/^u02$/, qr/^ok$/, qr/^In 8050$/, qr/^ok$/,
+ qr/^ok$/, qr/^In 8040$/, qr/^u01$/, qr/^u01$/,
+ qr/"name":"u01","backup":false,"hops":\d+,"next_upstream":3,"blacklistings":3,"blacklisted":0,/]
+--- error_code eval: [(200) x 17]
+
+=== TEST 5: upstrand with slow start of recovered upstreams
+--- http_config
+    upstream u01 {
+        server localhost:8040;
+    }
+    upstream u02 {
+        server localhost:8050;
+    }
+
+    upstrand us1 zone=us1:64k {
+        upstream ~^u0 blacklist_interval=1s slow_start=600s;
+        order global;
+        next_upstream_statuses error timeout 5xx;
+    }
+
+    server {
+        listen       8040;
+        server_name  backend01;
+
+        location / {
+            if ($arg_fail) {
+                return 503;
+            }
+            echo "In 8040";
+        }
+    }
+    server {
+        listen       8050;
+        server_name  backend02;
+
+        location / {
+            echo "In 8050";
+        }
+    }
+--- config
+        location /us1 {
+            proxy_pass http://$upstrand_us1;
+        }
+        location /sleep {
+            echo_sleep 1.1;
+            echo "ok";
+        }
+        location /echo/us1 {
+            echo $upstrand_us1;
+        }
+--- request eval
+["GET /us1?fail=1", "GET /sleep", "GET /us1", "GET /us1",
+ "GET /echo/us1", "GET /echo/us1", "GET /echo/us1", "GET /echo/us1"]
+--- response_body eval
+["In 8050\n", "ok\n", "In 8050\n", "In 8040\n",
+ "u02\n", "u02\n", "u02\n", "u02\n"]
+--- error_code eval: [(200) x 8]
+
+=== TEST 6: upstrand with outlier detection
+--- http_config
+    upstream u01 {
+        server localhost:8040;
+    }
+    upstream u02 {
+        server localhost:8050;
+    }
+
+    upstrand us1 zone=us1:64k {
+        upstream ~^u0;
+        order global;
+        next_upstream_statuses error timeout 5xx;
+        outlier_detection errors=2 interval=10s max_ejected=50%;
+    }
+
+    server {
+        listen       8040;
+        server_name  backend01;
+
+        location / {
+            return 503;
+        }
+    }
+    server {
+        listen       8050;
+        server_name  backend02;
+
+        location / {
+            echo "In 8050";
+        }
+    }
+--- config
+        location /us1 {
+            proxy_pass http://$upstrand_us1;
+        }
+        location /sleep {
+            echo_sleep 1.1;
+            echo "ok";
+        }
+        location /status {
+            upstrand_status;
+        }
+        location /echo/us1 {
+            echo $upstrand_us1;
+        }
+--- request eval
+[("GET /us1") x 20, "GET /sleep", "GET /us1", "GET /status",
+ "GET /echo/us1", "GET /echo/us1"]
+--- response_body_like eval
+[(qr/^In 8050$/) x 20, qr/^ok$/, qr/^In 8050$/,
+ qr/"name":"u01","backup":false,"hops":\d+,"next_upstream":\d+,"blacklistings":0,"blacklisted":0,"ejected":1,.*"name":"u02","backup":false,"hops":\d+,"next_upstream":0,"blacklistings":0,"blacklisted":0,"ejected":0,/s,
+ qr/^u02$/, qr/^u02$/]
+--- error_code eval: [(200) x 25]
+
+=== TEST 7: upstrand with active health checks
+--- http_config
+    upstream u01 {
+        server localhost:8040;
+    }
+    upstream u02 {
+        server localhost:8050;
+    }
+
+    upstrand us1 zone=us1:64k {
+        upstream ~^u0;
+        health_check uri=/ping interval=500ms fails=1 passes=2;
+    }
+
+    server {
+        listen       8040;
+        server_name  backend01;
+
+        location /ping {
+            return 503;
+        }
+    }
+    server {
+        listen       8050;
+        server_name  backend02;
+
+        location /ping {
+            echo "pong";
+        }
+    }
+--- config
+        location /sleep {
+            echo_sleep 1.5;
+            echo "ok";
+        }
+        location /echo/us1 {
+            echo $upstrand_us1;
+        }
+--- request eval
+["GET /sleep", "GET /echo/us1", "GET /echo/us1"]
+--- response_body eval
+["ok\n", "u02\n", "u02\n"]
+--- error_code eval: [200, 200, 200]
+
+=== TEST 8: upstrand status in JSON and Prometheus formats
+--- http_config
+    upstream u01 {
+        server localhost:8040;
+    }
+    upstream u02 {
+        server localhost:8050;
+    }
+
+    upstrand us1 zone=us1:64k {
+        upstream ~^u0;
+        order global;
+        next_upstream_statuses error timeout 5xx;
+    }
+
+    server {
+        listen       8040;
+        server_name  backend01;
+
+        location / {
+            return 503;
+        }
+    }
+    server {
+        listen       8050;
+        server_name  backend02;
+
+        location / {
+            echo "In 8050";
+        }
+    }
+--- config
+        location /us1 {
+            proxy_pass http://$upstrand_us1;
+        }
+        location /status {
+            upstrand_status;
+        }
+        location /metrics {
+            upstrand_status prometheus;
+        }
+--- request eval
+["GET /us1", "GET /status", "GET /metrics"]
+--- response_body_like eval
+[qr/^In 8050$/,
+ qr/^\{"us1":\{"requests":1,"hops":2,"timeouts":0,"intercepts":0,"all_blacklisted":0,"next_upstream":\{"4xx":0,"5xx":1,"error":0,"other":0\},"cur":1,"b_cur":0,"upstreams":\[\{"name":"u01","backup":false,"hops":1,"next_upstream":1,/,
+ qr/upstrand_requests_total\{upstrand="us1"\} 1\n.*upstrand_upstream_hops_total\{upstrand="us1",upstream="u02"\} 1\n/s]
+--- error_code eval: [200, 200, 200]
+
+=== TEST 9: upstrand latency and hop count histograms
+--- http_config
+    upstream u01 {
+        server localhost:8040;
+    }
+    upstream u02 {
+        server localhost:8050;
+    }
+
+    upstrand us1 zone=us1:64k {
+        upstream ~^u0;
+        order global;
+        next_upstream_statuses error timeout 5xx;
+        histogram_reset 1h;
+    }
+
+    server {
+        listen       8040;
+        server_name  backend01;
+
+        location / {
+            return 503;
+        }
+    }
+    server {
+        listen       8050;
+        server_name  backend02;
+
+        location / {
+            echo "In 8050";
+        }
+    }
+--- config
+        location /us1 {
+            proxy_pass http://$upstrand_us1;
+        }
+        location /status {
+            upstrand_status;
+        }
+        location /metrics {
+            upstrand_status prometheus;
+        }
+--- request eval
+["GET /us1", "GET /status", "GET /metrics"]
+--- response_body_like eval
+[qr/^In 8050$/,
+ qr/"name":"u02".*"header_time_histogram":\{"buckets":\[[\d,]+\],"sum":\d+,"count":1\}.*\],"hops_histogram":\{"buckets":\[0,1,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0\],"sum":2,"count":1\}\}\}$/s,
+ qr/upstrand_hops_bucket\{upstrand="us1",le="1"\} 0\nupstrand_hops_bucket\{upstrand="us1",le="2"\} 1\n.*upstrand_hops_count\{upstrand="us1"\} 1\n.*upstrand_upstream_header_time_seconds_bucket\{upstrand="us1",upstream="u02",le="\+Inf"\} 1\n/s]
+--- error_code eval: [200, 200, 200]
+
+=== TEST 10: upstrand runtime control API
+--- http_config
+    upstream u01 {
+        server localhost:8040;
+    }
+    upstream u02 {
+        server localhost:8050;
+    }
+
+    upstrand us1 zone=us1:64k {
+        upstream ~^u0;
+        order global;
+    }
+--- config
+        location /echo/us1 {
+            echo $upstrand_us1;
+        }
+        location /api {
+            upstrand_api;
+        }
+--- request eval
+["POST /api?upstrand=us1&upstream=u01&mode=drained", "GET /echo/us1",
+ "GET /echo/us1", "POST /api?upstrand=us1&upstream=u01&weight=2",
+ "GET /api?upstrand=us2"]
+--- response_body_like eval
+[qr/^\{"us1":\{"zone":true,"weighted":false,"upstreams":\[\{"name":"u01","backup":false,"mode":"drained","weight":1\},\{"name":"u02","backup":false,"mode":"up","weight":1\}\]\}\}$/,
+ qr/^u02$/, qr/^u02$/, qr/409 Conflict/, qr/404 Not Found/]
+--- error_code eval: [200, 200, 200, 409, 404]
+
+=== TEST 11: upstrand reopens least recently failed upstream
+--- http_config
+    upstream u01 {
+        server localhost:8040;
+    }
+    upstream u02 {
+        server localhost:8050;
+    }
+
+    upstrand us1 zone=us1:64k {
+        upstream ~^u0 blacklist_interval=60s;
+        order global;
+        next_upstream_statuses error timeout 5xx;
+    }
+
+    server {
+        listen       8040;
+        server_name  backend01;
+
+        location / {
+            if ($arg_fail1) {
+                return 503;
+            }
+            echo "In 8040";
+        }
+    }
+    server {
+        listen       8050;
+        server_name  backend02;
+
+        location / {
+            if ($arg_fail2) {
+                return 503;
+            }
+            echo "In 8050";
+        }
+    }
+--- config
+        location /us1 {
+            proxy_pass http://$upstrand_us1;
+        }
+        location /sleep {
+            echo_sleep 1.1;
+            echo "ok";
+        }
+        location /echo/us1 {
+            echo $upstrand_us1;
+        }
+        location /status {
+            upstrand_status;
+        }
+--- request eval
+["GET /echo/us1", "GET /us1?fail2=1", "GET /sleep", "GET /us1?fail1=1",
+ "GET /status"]
+--- response_body_like eval
+[qr/^u01$/, qr/^In 8040$/, qr/^ok$/, qr/^In 8050$/,
+ qr/"all_blacklisted":1,.*"name":"u01","backup":false,"hops":2,"next_upstream":1,"blacklistings":1,"blacklisted":1,.*"name":"u02","backup":false,"hops":2,"next_upstream":1,"blacklistings":1,"blacklisted":0,/s]
+--- error_code eval: [200, 200, 200, 200, 200]
+
+=== TEST 12: upstrand runtime control API with weights and modes
+--- http_config
+    upstream u01 {
+        server localhost:8040;
+    }
+    upstream u02 {
+        server localhost:8050;
+    }
+
+    upstrand us1 zone=us1:64k {
+        upstream u01;
+        upstream u02 weight=0 blacklist_interval=60s;
+        next_upstream_statuses error timeout 5xx;
+    }
+
+    server {
+        listen       8040;
+        server_name  backend01;
+
+        location / {
+            echo "In 8040";
+        }
+    }
+    server {
+        listen       8050;
+        server_name  backend02;
+
+        location / {
+            if ($arg_fail) {
+                return 503;
+            }
+            echo "In 8050";
+        }
+    }
+--- config
+        location /us1 {
+            proxy_pass http://$upstrand_us1;
+        }
+        location /echo/us1 {
+            echo $upstrand_us1;
+        }
+        location /api {
+            upstrand_api;
+        }
+--- request eval
+["GET /echo/us1", "POST /api?upstrand=us1&upstream=u02&weight=1000000",
+ "GET /echo/us1", "GET /echo/us1", "GET /us1?fail=1", "GET /echo/us1",
+ "POST /api?upstrand=us1&upstream=u02&mode=whitelisted", "GET /echo/us1",
+ "POST /api?upstrand=us1&upstream=u02&mode=blacklisted", "GET /echo/us1",
+ "POST /api?upstrand=us1&upstream=u02&mode=up", "GET /echo/us1"]
+--- response_body_like eval
+[qr/^u01$/,
+ qr/^\{"us1":\{"zone":true,"weighted":true,"upstreams":\[\{"name":"u01","backup":false,"mode":"up","weight":1\},\{"name":"u02","backup":false,"mode":"up","weight":1000000\}\]\}\}$/,
+ qr/^u02$/, qr/^u02$/, qr/^In 8040$/, qr/^u01$/,
+ qr/\{"name":"u02","backup":false,"mode":"whitelisted","weight":1000000\}/,
+ qr/^u02$/,
+ qr/\{"name":"u02","backup":false,"mode":"blacklisted","weight":1000000\}/,
+ qr/^u01$/,
+ qr/\{"name":"u02","backup":false,"mode":"up","weight":1000000\}/,
+ qr/^u01$/]
+--- error_code eval: [(200) x 12]
+
+=== TEST 13: upstrand with active health checks of the root uri
+--- http_config
+    upstream u01 {
+        server localhost:8040;
+    }
+    upstream u02 {
+        server localhost:8050;
+    }
+
+    upstrand us1 zone=us1:64k {
+        upstream ~^u0;
+        health_check uri=/ interval=500ms fails=1 passes=2;
+    }
+
+    server {
+        listen       8040;
+        server_name  backend01;
+
+        location = / {
+            return 503;
+        }
+    }
+    server {
+        listen       8050;
+        server_name  backend02;
+
+        location = / {
+            echo "pong";
+        }
+    }
+--- config
+        location /sleep {
+            echo_sleep 1.5;
+            echo "ok";
+        }
+        location /echo/us1 {
+            echo $upstrand_us1;
+        }
+--- request eval
+["GET /sleep", "GET /echo/us1", "GET /echo/us1"]
+--- response_body eval
+["ok\n", "u02\n", "u02\n"]
+--- error_code eval: [200, 200, 200]
+
+=== TEST 14: upstrand runtime control API with zero and default weights
+--- http_config
+    upstream u01 {
+        server localhost:8040;
+    }
+    upstream u02 {
+        server localhost:8050;
+    }
+
+    upstrand us1 zone=us1:64k {
+        upstream u01;
+        upstream u02 weight=0;
+    }
+--- config
+        location /echo/us1 {
+            echo $upstrand_us1;
+        }
+        location /api {
+            upstrand_api;
+        }
+--- request eval
+["POST /api?upstrand=us1&upstream=u01&weight=0",
+ "POST /api?upstrand=us1&upstream=u02&weight=1",
+ "POST /api?upstrand=us1&upstream=u01&weight=0", "GET /echo/us1",
+ "GET /echo/us1", "POST /api?upstrand=us1&upstream=u01&weight=default",
+ "POST /api?upstrand=us1&upstream=u02&weight=default", "GET /echo/us1"]
+--- response_body_like eval
+[qr/409 Conflict/,
+ qr/\{"name":"u01","backup":false,"mode":"up","weight":1\},\{"name":"u02","backup":false,"mode":"up","weight":1\}/,
+ qr/\{"name":"u01","backup":false,"mode":"up","weight":0\},\{"name":"u02","backup":false,"mode":"up","weight":1\}/,
+ qr/^u02$/, qr/^u02$/,
+ qr/\{"name":"u01","backup":false,"mode":"up","weight":1\},\{"name":"u02","backup":false,"mode":"up","weight":1\}/,
+ qr/\{"name":"u01","backup":false,"mode":"up","weight":1\},\{"name":"u02","backup":false,"mode":"up","weight":0\}/,
+ qr/^u01$/]
+--- error_code eval: [409, (200) x 7]
+
+=== TEST 15: upstrand with slow start of upstreams back from blacklisted mode
+--- http_config
+    upstream u01 {
+        server localhost:8040;
+    }
+    upstream u02 {
+        server localhost:8050;
+    }
+
+    upstrand us1 zone=us1:64k {
+        upstream ~^u0 slow_start=600s;
+        order global;
+    }
+--- config
+        location /echo/us1 {
+            echo $upstrand_us1;
+        }
+        location /api {
+            upstrand_api;
+        }
+--- request eval
+["POST /api?upstrand=us1&upstream=u01&mode=blacklisted",
+ "POST /api?upstrand=us1&upstream=u01&mode=up",
+ "GET /echo/us1", "GET /echo/us1", "GET /echo/us1", "GET /echo/us1"]
+--- response_body_like eval
+[qr/\{"name":"u01","backup":false,"mode":"blacklisted","weight":1\}/,
+ qr/\{"name":"u01","backup":false,"mode":"up","weight":1\}/,
+ qr/^u02$/, qr/^u02$/, qr/^u02$/, qr/^u02$/]
+--- error_code eval: [(200) x 6]